@@ -0,0 +1,89 @@
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "CheckpointReader.h"
+
+using namespace std::string_literals;
+
+MappedFile::MappedFile(std::string const &path, bool populate)
+    : data_(nullptr),
+      size_(0)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Can not open file: "s + std::strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        throw std::runtime_error("Can not stat file: "s + std::strerror(errno));
+    }
+    size_ = st.st_size;
+
+    int flags = MAP_SHARED | (populate ? MAP_POPULATE : 0);
+    void *addr = mmap(nullptr, size_, PROT_READ, flags, fd, 0);
+
+    // the mapping keeps its own reference to the file
+    close(fd);
+
+    if (addr == MAP_FAILED)
+        throw std::runtime_error("Can not map file: "s + std::strerror(errno));
+
+    // every weight is streamed once per token, start the readahead right away
+    if (!populate)
+        madvise(addr, size_, MADV_WILLNEED);
+
+    data_ = static_cast<char const *>(addr);
+}
+
+MappedFile::~MappedFile() { munmap(const_cast<char *>(data_), size_); }
+
+char const *MappedFile::data() const { return data_; }
+
+size_t MappedFile::size() const { return size_; }
+
+CheckpointReader::CheckpointReader(std::string const &path, Mode mode)
+    : offset(0)
+{
+    if (mode == READ)
+    {
+        inputStream.open(path, std::ios::binary);
+
+        if (!inputStream.is_open())
+            throw std::runtime_error("Can not open file!");
+    }
+    else
+        mappedFile = std::make_shared<MappedFile>(path, mode == MMAP_POPULATE);
+}
+
+void CheckpointReader::read(void *dest, size_t bytes)
+{
+    if (mappedFile)
+    {
+        if (offset + bytes > mappedFile->size())
+            throw std::runtime_error("Unexpected end of checkpoint");
+
+        std::memcpy(dest, mappedFile->data() + offset, bytes);
+        offset += bytes;
+    }
+    else if (!inputStream.read(static_cast<char *>(dest), bytes))
+        throw std::runtime_error("Unexpected end of checkpoint");
+}
+
+void CheckpointReader::seek(size_t offset)
+{
+    if (mappedFile)
+        this->offset = offset;
+    else
+        inputStream.seekg(offset);
+}
+
+bool CheckpointReader::isMapped() const { return mappedFile != nullptr; }
+
+std::shared_ptr<MappedFile> const &CheckpointReader::mapping() const { return mappedFile; }
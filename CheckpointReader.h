@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <fstream>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+
+// ----------------------------------------------------------------------------
+// Read-only memory mapping of a whole file. The pages are shared with every
+// other process mapping the same file, so the weights are only kept once in
+// the page cache.
+
+class MappedFile
+{
+public:
+    MappedFile(std::string const &path, bool populate);
+    ~MappedFile();
+
+    MappedFile(MappedFile const &) = delete;
+    MappedFile &operator=(MappedFile const &) = delete;
+
+    char const *data() const;
+    size_t size() const;
+
+private:
+    char const *data_;
+    size_t size_;
+};
+
+// ----------------------------------------------------------------------------
+// Sequential reader of the checkpoint file. In READ mode the data is copied
+// from an ifstream, in the MMAP modes the tensors can be referenced directly
+// from the mapping by view().
+
+class CheckpointReader
+{
+public:
+    enum Mode
+    {
+        READ,
+        MMAP,          // map the file, the pages are faulted in on first use
+        MMAP_POPULATE, // map the file and prefault all pages at once
+    };
+
+public:
+    CheckpointReader(std::string const &path, Mode mode);
+
+    void read(void *dest, size_t bytes);
+    template <typename T> T read();
+    template <typename T> std::span<T const> view(size_t count);
+
+    // whether values of type T skip bytes ahead can be viewed: the file has
+    // to be mapped and they have to be aligned in it, otherwise they are read
+    template <typename T> bool canView(size_t skip = 0) const;
+
+    void seek(size_t offset);
+
+    bool isMapped() const;
+    std::shared_ptr<MappedFile> const &mapping() const;
+
+private:
+    std::ifstream inputStream;
+    std::shared_ptr<MappedFile> mappedFile;
+    size_t offset;
+};
+
+template <typename T> T CheckpointReader::read()
+{
+    T value;
+    read(&value, sizeof(value));
+    return value;
+}
+
+template <typename T> std::span<T const> CheckpointReader::view(size_t count)
+{
+    if (!mappedFile)
+        throw std::runtime_error("Views are only available from a mapped checkpoint");
+
+    if (!canView<T>())
+        throw std::runtime_error("Misaligned values in the checkpoint");
+
+    if (offset + count * sizeof(T) > mappedFile->size())
+        throw std::runtime_error("Unexpected end of checkpoint");
+
+    std::span<T const> result(reinterpret_cast<T const *>(mappedFile->data() + offset), count);
+    offset += count * sizeof(T);
+    return result;
+}
+
+template <typename T> bool CheckpointReader::canView(size_t skip) const
+{
+    // the mapping itself starts at a page boundary
+    return mappedFile && 0 == (offset + skip) % alignof(T);
+}
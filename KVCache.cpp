@@ -0,0 +1,355 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+#if defined(__AVX2__) && defined(__F16C__) && defined(__FMA__)
+#include <immintrin.h>
+#define KVCACHE_AVX2
+#endif
+
+#include "KVCache.h"
+#include "kernels.h"
+
+namespace detail
+{
+
+// number of positions the attention loops prefetch ahead in the cache
+constexpr size_t prefetchDistance = 4;
+
+#if defined(KVCACHE_AVX2)
+inline float horizontalSum(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+inline __m256 loadFloat16(uint16_t const *p) { return _mm256_cvtph_ps(_mm_loadu_si128((__m128i const *)p)); }
+
+inline __m256 loadInt8(int8_t const *p)
+{
+    return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((__m128i const *)p)));
+}
+#endif
+
+inline float dotFloat16(float const *q, uint16_t const *k, size_t n)
+{
+#if defined(KVCACHE_AVX2)
+    __m256 acc = _mm256_setzero_ps();
+    for (size_t j = 0; j < n; j += 8)
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(q + j), loadFloat16(k + j), acc);
+    return horizontalSum(acc);
+#else
+    float sum = 0.0f;
+    for (size_t j = 0; j < n; j++)
+        sum += q[j] * kernels::fromFloat16(k[j]);
+    return sum;
+#endif
+}
+
+inline float dotQ8(float const *q, int8_t const *k, float const *s, size_t n)
+{
+    float sum = 0.0f;
+    for (size_t g = 0; g < n / KVCache::groupSize; g++, q += KVCache::groupSize, k += KVCache::groupSize)
+    {
+#if defined(KVCACHE_AVX2)
+        __m256 acc = _mm256_setzero_ps();
+        for (size_t j = 0; j < KVCache::groupSize; j += 8)
+            acc = _mm256_fmadd_ps(_mm256_loadu_ps(q + j), loadInt8(k + j), acc);
+        sum += horizontalSum(acc) * s[g];
+#else
+        float groupSum = 0.0f;
+        for (size_t j = 0; j < KVCache::groupSize; j++)
+            groupSum += q[j] * k[j];
+        sum += groupSum * s[g];
+#endif
+    }
+    return sum;
+}
+
+inline void axpyFloat16(float *out, float a, uint16_t const *v, size_t n)
+{
+#if defined(KVCACHE_AVX2)
+    __m256 va = _mm256_set1_ps(a);
+    for (size_t j = 0; j < n; j += 8)
+        _mm256_storeu_ps(out + j, _mm256_fmadd_ps(va, loadFloat16(v + j), _mm256_loadu_ps(out + j)));
+#else
+    for (size_t j = 0; j < n; j++)
+        out[j] += a * kernels::fromFloat16(v[j]);
+#endif
+}
+
+inline void axpyQ8(float *out, float a, int8_t const *v, float const *s, size_t n)
+{
+    for (size_t g = 0; g < n / KVCache::groupSize; g++, out += KVCache::groupSize, v += KVCache::groupSize)
+    {
+        float as = a * s[g];
+#if defined(KVCACHE_AVX2)
+        __m256 va = _mm256_set1_ps(as);
+        for (size_t j = 0; j < KVCache::groupSize; j += 8)
+            _mm256_storeu_ps(out + j, _mm256_fmadd_ps(va, loadInt8(v + j), _mm256_loadu_ps(out + j)));
+#else
+        for (size_t j = 0; j < KVCache::groupSize; j++)
+            out[j] += as * v[j];
+#endif
+    }
+}
+
+} // namespace detail
+
+KVCache::KVCache(size_t seqLength, size_t nKVHeads, size_t headSize, Type type)
+    : seqLength(seqLength),
+      nKVHeads(nKVHeads),
+      headSize(headSize),
+      type(type),
+      pos(0)
+{
+    if (type != F32 && 0 != headSize % groupSize)
+        throw std::runtime_error("The head size has to be a multiple of 32 for a compressed KV cache");
+
+    rowBytes = rowSize(type, headSize);
+    buffer.resize(2 * nKVHeads * seqLength * rowBytes);
+}
+
+size_t KVCache::rowSize(Type type, size_t headSize)
+{
+    switch (type)
+    {
+    case F32:
+        return headSize * sizeof(float);
+    case F16:
+        return headSize * sizeof(kernels::Float16);
+    case Q8:
+        return headSize * sizeof(int8_t) + headSize / groupSize * sizeof(float);
+    }
+
+    throw std::runtime_error("Unknown KV cache type");
+}
+
+size_t KVCache::position() const { return pos; }
+
+size_t KVCache::windowStart(size_t position) const { return position < seqLength ? 0 : position + 1 - seqLength; }
+
+size_t KVCache::offset(size_t kvHead, size_t position) const
+{
+    return (kvHead * seqLength + position % seqLength) * rowBytes;
+}
+
+uint8_t const *KVCache::keyRow(size_t kvHead, size_t position) const
+{
+    return buffer.data() + offset(kvHead, position);
+}
+
+uint8_t const *KVCache::valueRow(size_t kvHead, size_t position) const
+{
+    return buffer.data() + buffer.size() / 2 + offset(kvHead, position);
+}
+
+float KVCache::score(uint8_t const *k, float const *q) const
+{
+    switch (type)
+    {
+    case F32:
+        return std::inner_product(q, q + headSize, reinterpret_cast<float const *>(k), 0.0f);
+    case F16:
+        return detail::dotFloat16(q, reinterpret_cast<uint16_t const *>(k), headSize);
+    case Q8:
+        return detail::dotQ8(q, reinterpret_cast<int8_t const *>(k), reinterpret_cast<float const *>(k + headSize),
+                             headSize);
+    }
+
+    return 0.0f;
+}
+
+void KVCache::accumulate(uint8_t const *v, float a, float *out) const
+{
+    switch (type)
+    {
+    case F32:
+    {
+        float const *vf = reinterpret_cast<float const *>(v);
+        for (size_t j = 0; j < headSize; j++)
+            out[j] += a * vf[j];
+        break;
+    }
+    case F16:
+        detail::axpyFloat16(out, a, reinterpret_cast<uint16_t const *>(v), headSize);
+        break;
+    case Q8:
+        detail::axpyQ8(out, a, reinterpret_cast<int8_t const *>(v), reinterpret_cast<float const *>(v + headSize),
+                       headSize);
+        break;
+    }
+}
+
+void KVCache::scores(size_t kvHead, size_t first, size_t last, float const *q, float scale, float *att) const
+{
+    for (size_t t = first; t < last; t++)
+    {
+        if (t + detail::prefetchDistance < last)
+            __builtin_prefetch(keyRow(kvHead, t + detail::prefetchDistance));
+
+        att[t - first] = score(keyRow(kvHead, t), q) * scale;
+    }
+}
+
+void KVCache::accumulate(size_t kvHead, size_t first, size_t last, float const *att, float *out) const
+{
+    for (size_t t = first; t < last; t++)
+    {
+        if (t + detail::prefetchDistance < last)
+            __builtin_prefetch(valueRow(kvHead, t + detail::prefetchDistance));
+
+        accumulate(valueRow(kvHead, t), att[t - first], out);
+    }
+}
+
+void KVCache::scores(uint8_t const *keys, size_t kvHead, size_t n, float const *q, float scale, float *att) const
+{
+    for (size_t i = 0; i < n; i++)
+        att[i] = score(keys + (i * nKVHeads + kvHead) * rowBytes, q) * scale;
+}
+
+void KVCache::accumulate(uint8_t const *values, size_t kvHead, size_t n, float const *att, float *out) const
+{
+    for (size_t i = 0; i < n; i++)
+        accumulate(values + (i * nKVHeads + kvHead) * rowBytes, att[i], out);
+}
+
+void KVCache::store(Type as, uint8_t *dest, float const *row) const
+{
+    switch (as)
+    {
+    case F32:
+        std::copy(row, row + headSize, reinterpret_cast<float *>(dest));
+        break;
+    case F16:
+        std::transform(row, row + headSize, reinterpret_cast<kernels::Float16 *>(dest), kernels::toFloat16);
+        break;
+    case Q8:
+        // symmetric quantization in groups, the int8 values followed by the scales
+        kernels::quantizeQ8(reinterpret_cast<int8_t *>(dest), reinterpret_cast<float *>(dest + headSize), row,
+                            headSize, groupSize);
+        break;
+    }
+}
+
+void KVCache::load(Type from, uint8_t const *src, float *row) const
+{
+    // the rows may come from a mapped file, unaligned
+    switch (from)
+    {
+    case F32:
+        std::memcpy(row, src, headSize * sizeof(float));
+        break;
+    case F16:
+        for (size_t j = 0; j < headSize; j++)
+        {
+            kernels::Float16 h;
+            std::memcpy(&h, src + j * sizeof(h), sizeof(h));
+            row[j] = kernels::fromFloat16(h);
+        }
+        break;
+    case Q8:
+    {
+        int8_t const *q = reinterpret_cast<int8_t const *>(src);
+        for (size_t g = 0; g < headSize / groupSize; g++)
+        {
+            float scale;
+            std::memcpy(&scale, src + headSize + g * sizeof(float), sizeof(float));
+            for (size_t j = g * groupSize; j < (g + 1) * groupSize; j++)
+                row[j] = q[j] * scale;
+        }
+        break;
+    }
+    }
+}
+
+void KVCache::append(float const *keys, float const *values, size_t nTokens)
+{
+    uint8_t *keyCache = buffer.data();
+    uint8_t *valueCache = buffer.data() + buffer.size() / 2;
+
+    for (size_t i = 0; i < nTokens; i++, pos++)
+    {
+        for (size_t h = 0; h < nKVHeads; h++)
+        {
+            store(type, keyCache + offset(h, pos), keys + (i * nKVHeads + h) * headSize);
+            store(type, valueCache + offset(h, pos), values + (i * nKVHeads + h) * headSize);
+        }
+    }
+}
+
+void KVCache::storeRows(float const *rows, size_t nTokens, uint8_t *dest) const
+{
+    for (size_t i = 0; i < nTokens * nKVHeads; i++)
+        store(type, dest + i * rowBytes, rows + i * headSize);
+}
+
+size_t KVCache::bytes(size_t nTokens) const { return 2 * nTokens * nKVHeads * rowBytes; }
+
+size_t KVCache::bytes(size_t nTokens, Type as) const { return 2 * nTokens * nKVHeads * rowSize(as, headSize); }
+
+void KVCache::copyRows(size_t first, size_t nTokens, uint8_t *dest) const { copyRows(first, nTokens, dest, type); }
+
+void KVCache::copyRows(size_t first, size_t nTokens, uint8_t *dest, Type as) const
+{
+    if (pos < first + nTokens || (0 < pos && first < windowStart(pos - 1)))
+        throw std::runtime_error("The positions are not in the KV cache");
+
+    size_t destBytes = rowSize(as, headSize);
+    std::vector<float> row(as == type ? 0 : headSize);
+
+    // the key and then the value rows of all heads, position by position
+    for (size_t t = first; t < first + nTokens; t++)
+    {
+        for (size_t h = 0; h < nKVHeads; h++, dest += 2 * destBytes)
+        {
+            if (as == type)
+            {
+                std::copy_n(keyRow(h, t), rowBytes, dest);
+                std::copy_n(valueRow(h, t), rowBytes, dest + rowBytes);
+                continue;
+            }
+
+            load(type, keyRow(h, t), row.data());
+            store(as, dest, row.data());
+            load(type, valueRow(h, t), row.data());
+            store(as, dest + destBytes, row.data());
+        }
+    }
+}
+
+void KVCache::appendRows(uint8_t const *src, size_t nTokens) { appendRows(src, nTokens, type); }
+
+void KVCache::appendRows(uint8_t const *src, size_t nTokens, Type from)
+{
+    uint8_t *keyCache = buffer.data();
+    uint8_t *valueCache = buffer.data() + buffer.size() / 2;
+
+    size_t srcBytes = rowSize(from, headSize);
+    std::vector<float> row(from == type ? 0 : headSize);
+
+    for (size_t i = 0; i < nTokens; i++, pos++)
+    {
+        for (size_t h = 0; h < nKVHeads; h++, src += 2 * srcBytes)
+        {
+            if (from == type)
+            {
+                std::copy_n(src, rowBytes, keyCache + offset(h, pos));
+                std::copy_n(src + rowBytes, rowBytes, valueCache + offset(h, pos));
+                continue;
+            }
+
+            load(from, src, row.data());
+            store(type, keyCache + offset(h, pos), row.data());
+            load(from, src + srcBytes, row.data());
+            store(type, valueCache + offset(h, pos), row.data());
+        }
+    }
+}
+
+void KVCache::reset(size_t position) { pos = position; }
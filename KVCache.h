@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Tensor.h"
+
+// ----------------------------------------------------------------------------
+// The keys and values of the past positions of one attention layer, stored in
+// a ring buffer of seqLength positions. When the buffer is full every new
+// position overwrites the oldest one, so generation continues over a sliding
+// window at constant cost per token. Positions are absolute, the keys keep
+// the rotary embedding of the position they were computed at.
+//
+// Both are kept in a single aligned buffer laid out as [kvHead][slot][row],
+// so the scan of a head over the positions reads one linear stream. A row
+// holds the headSize values of a position either as float32, as fp16, or
+// quantized to int8 in groups like QuantizedTensor (the int8 values followed
+// by the scaling factors of the row). The attention works on the stored
+// format directly through scores() and accumulate().
+
+class KVCache
+{
+public:
+    enum Type
+    {
+        F32,
+        F16,
+        Q8,
+    };
+
+    static constexpr GroupSize groupSize = 32; // group size of Q8
+
+public:
+    KVCache(size_t seqLength, size_t nKVHeads, size_t headSize, Type type = F32);
+
+    // the position of the next token
+    size_t position() const;
+
+    // the oldest position a token at the given position attends to
+    size_t windowStart(size_t position) const;
+
+    // att[t - first] = scale * q . key(t) for the positions t in [first, last)
+    void scores(size_t kvHead, size_t first, size_t last, float const *q, float scale, float *att) const;
+
+    // out += sum of att[t - first] * value(t) for the positions t in [first, last)
+    void accumulate(size_t kvHead, size_t first, size_t last, float const *att, float *out) const;
+
+    // the same for n consecutive positions stored by storeRows(), which are
+    // not appended yet
+    void scores(uint8_t const *keys, size_t kvHead, size_t n, float const *q, float scale, float *att) const;
+    void accumulate(uint8_t const *values, size_t kvHead, size_t n, float const *att, float *out) const;
+
+    // appends the keys and values of nTokens consecutive positions, given as
+    // (nTokens, nKVHeads * headSize) rows
+    void append(float const *keys, float const *values, size_t nTokens);
+
+    // stores the keys or the values of nTokens positions, given like to
+    // append(), to dest as they are stored in the cache, bytes(nTokens) / 2
+    // of them. The positions of a batch attend to each other through them
+    // before they are appended, at the precision later positions see.
+    void storeRows(float const *rows, size_t nTokens, uint8_t *dest) const;
+
+    // the size of the keys and values of nTokens positions, as stored or as
+    // the given type
+    size_t bytes(size_t nTokens) const;
+    size_t bytes(size_t nTokens, Type as) const;
+
+    // copies the keys and values of the positions [first, first + nTokens),
+    // which must still be in the cache, to dest. They are copied as stored,
+    // or converted to the given type.
+    void copyRows(size_t first, size_t nTokens, uint8_t *dest) const;
+    void copyRows(size_t first, size_t nTokens, uint8_t *dest, Type as) const;
+
+    // appends positions copied by copyRows() from a cache of the same
+    // geometry, stored as the given type
+    void appendRows(uint8_t const *src, size_t nTokens);
+    void appendRows(uint8_t const *src, size_t nTokens, Type from);
+
+    // empties the cache, the next position appended is the given one
+    void reset(size_t position = 0);
+
+    // the bytes of a row of headSize values stored as type
+    static size_t rowSize(Type type, size_t headSize);
+
+private:
+    uint8_t const *keyRow(size_t kvHead, size_t position) const;
+    uint8_t const *valueRow(size_t kvHead, size_t position) const;
+    size_t offset(size_t kvHead, size_t position) const;
+
+    float score(uint8_t const *k, float const *q) const;
+    void accumulate(uint8_t const *v, float a, float *out) const;
+
+    void store(Type as, uint8_t *dest, float const *row) const;
+    void load(Type from, uint8_t const *src, float *row) const;
+
+private:
+    size_t seqLength;
+    size_t nKVHeads;
+    size_t headSize;
+    Type type;
+    size_t rowBytes;
+    size_t pos;
+
+    // keys in the first half, values in the second half
+    std::vector<uint8_t, AlignedAllocator<uint8_t>> buffer;
+};
@@ -0,0 +1,399 @@
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+#include "LogitsProcessor.h"
+#include "kernels.h"
+
+namespace detail
+{
+
+// by decreasing probability, the lower token first among equal ones
+inline bool moreLikely(Candidate const &a, Candidate const &b)
+{
+    return a.prob > b.prob || (a.prob == b.prob && a.token < b.token);
+}
+
+inline float sumProbs(Candidate const *first, Candidate const *last)
+{
+    return std::accumulate(first, last, 0.0f, [](float sum, Candidate const &c) { return sum + c.prob; });
+}
+
+// sorts the most likely of the candidates in [first, last) to their front,
+// until they hold more than mass, returns the end of the nucleus
+Candidate *selectNucleus(Candidate *first, Candidate *last, float mass)
+{
+    // the nucleus usually holds a few tokens only, try the most probable ones
+    // first, selected with a single pass over the candidates
+    constexpr std::ptrdiff_t head = 32;
+    auto lo = first;
+    auto hi = last;
+    float cumulativeProb = 0.0f;
+
+    if (head < last - first)
+    {
+        std::partial_sort(first, first + head, last, moreLikely);
+        float headProb = sumProbs(first, first + head);
+        if (headProb > mass)
+            hi = first + head;
+        else
+        {
+            lo = first + head;
+            cumulativeProb = headProb;
+        }
+    }
+
+    // otherwise bisect for the boundary of the nucleus: nth_element splits the
+    // rest at its median, and the half the boundary lies in is kept, so that
+    // [first, lo) is in the nucleus and its end is in [lo, hi)
+    while (hi - lo > head)
+    {
+        auto mid = lo + (hi - lo) / 2;
+        std::nth_element(lo, mid, hi, moreLikely);
+
+        float upper = sumProbs(lo, mid);
+        if (cumulativeProb + upper > mass)
+            hi = mid;
+        else
+        {
+            cumulativeProb += upper;
+            lo = mid;
+        }
+    }
+
+    std::sort(lo, hi, moreLikely);
+    for (; lo != hi; ++lo)
+        if ((cumulativeProb += lo->prob) > mass)
+            return lo + 1; // we've exceeded topp by including this one
+
+    return hi; // in case of rounding errors
+}
+
+inline float maxLogit(std::vector<Candidate> const &list)
+{
+    float maxVal = -std::numeric_limits<float>::infinity();
+    for (auto const &c : list)
+        maxVal = std::max(maxVal, c.logit);
+    return maxVal;
+}
+
+} // namespace detail
+
+// ----------------------------------------------------------------------------
+// Candidates
+
+void Candidates::assign(std::span<float> l)
+{
+    logits = l;
+    temperature = 1.0f;
+    dense = true;
+    list.clear();
+}
+
+size_t Candidates::size() const { return dense ? logits.size() : list.size(); }
+
+void Candidates::select(uint32_t const *tokens, size_t n)
+{
+    list.clear();
+    for (size_t i = 0; i < n; i++)
+        list.push_back({tokens[i], logits[tokens[i]] / temperature, 0.0f});
+    dense = false;
+}
+
+float Candidates::weigh()
+{
+    float maxVal = detail::maxLogit(list);
+
+    float sum = 0.0f;
+    for (auto &c : list)
+        sum += c.prob = std::exp(c.logit - maxVal);
+    return sum;
+}
+
+// ----------------------------------------------------------------------------
+// LogitBias
+
+LogitBias::LogitBias(std::vector<std::pair<int, float>> biases)
+    : biases(std::move(biases))
+{
+}
+
+void LogitBias::apply(Candidates &candidates)
+{
+    for (auto [token, bias] : biases)
+        candidates.update(token, [bias](float logit) { return logit + bias; });
+}
+
+// ----------------------------------------------------------------------------
+// Penalties
+
+Penalties::Penalties(size_t lastN, float repeat, float frequency, float presence)
+    : lastN(lastN),
+      repeat(repeat),
+      frequency(frequency),
+      presence(presence)
+{
+}
+
+void Penalties::apply(Candidates &candidates)
+{
+    auto penalize = [this](float logit, int count)
+    {
+        if (1.0f != repeat)
+            logit = 0.0f < logit ? logit / repeat : logit * repeat;
+        return logit - count * frequency - presence;
+    };
+
+    if (candidates.dense)
+    {
+        for (auto [token, count] : counts)
+            candidates.update(token, [&, count](float logit) { return penalize(logit, count); });
+        return;
+    }
+
+    for (auto &c : candidates.list)
+        if (auto it = counts.find(c.token); it != counts.end())
+            c.logit = penalize(c.logit, it->second);
+}
+
+void Penalties::accept(int token)
+{
+    history.push_back(token);
+    counts[token]++;
+
+    if (0 < lastN && lastN < history.size())
+    {
+        auto it = counts.find(history.front());
+        if (0 == --it->second)
+            counts.erase(it);
+        history.pop_front();
+    }
+}
+
+void Penalties::reset()
+{
+    history.clear();
+    counts.clear();
+}
+
+// ----------------------------------------------------------------------------
+// TopK
+
+TopK::TopK(size_t k)
+    : k(k)
+{
+}
+
+void TopK::apply(Candidates &candidates)
+{
+    if (0 == k || candidates.size() <= k)
+        return;
+
+    auto larger = [](Candidate const &a, Candidate const &b) { return a.logit > b.logit; };
+
+    if (!candidates.dense)
+    {
+        auto &list = candidates.list;
+        std::nth_element(list.begin(), list.begin() + k, list.end(), larger);
+        list.resize(k);
+        return;
+    }
+
+    // a heap of the k largest logits so far, the smallest on top: the rest of
+    // the logits is filtered by it in chunks, usually few of them are larger
+    auto logits = candidates.logits;
+    heap.clear();
+    for (uint32_t i = 0; i < k; i++)
+        heap.push_back({i, logits[i], 0.0f});
+    std::make_heap(heap.begin(), heap.end(), larger);
+
+    constexpr size_t chunk = 1024;
+    indices.resize(std::max(chunk, k));
+    for (size_t start = k; start < logits.size(); start += chunk)
+    {
+        size_t n = kernels::indicesAtLeast(logits.data() + start, std::min(chunk, logits.size() - start),
+                                           heap.front().logit, indices.data());
+        for (size_t i = 0; i < n; i++)
+        {
+            uint32_t token = start + indices[i];
+            if (logits[token] > heap.front().logit)
+            {
+                std::pop_heap(heap.begin(), heap.end(), larger);
+                heap.back() = {token, logits[token], 0.0f};
+                std::push_heap(heap.begin(), heap.end(), larger);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < k; i++)
+        indices[i] = heap[i].token;
+    candidates.select(indices.data(), k);
+}
+
+// ----------------------------------------------------------------------------
+// Temperature
+
+Temperature::Temperature(float temperature)
+    : temperature(temperature)
+{
+}
+
+void Temperature::apply(Candidates &candidates)
+{
+    if (0.0f == temperature)
+    {
+        // greedy, keep the most likely token only
+        if (candidates.dense)
+        {
+            uint32_t token = std::distance(candidates.logits.begin(),
+                                           std::max_element(candidates.logits.begin(), candidates.logits.end()));
+            candidates.select(&token, 1);
+        }
+        else if (!candidates.list.empty())
+        {
+            auto &list = candidates.list;
+            std::iter_swap(list.begin(), std::max_element(list.begin(), list.end(), [](auto const &a, auto const &b)
+                                                          { return a.logit < b.logit; }));
+            list.resize(1);
+        }
+        return;
+    }
+
+    if (candidates.dense)
+        candidates.temperature *= temperature;
+    else
+        for (auto &c : candidates.list)
+            c.logit /= temperature;
+}
+
+// ----------------------------------------------------------------------------
+// TypicalP
+
+TypicalP::TypicalP(float p)
+    : p(p)
+{
+}
+
+void TypicalP::apply(Candidates &candidates)
+{
+    if (1.0f <= p)
+        return;
+
+    // all tokens are ranked, best preceded by a processor cutting the tail
+    if (candidates.dense)
+    {
+        indices.resize(candidates.logits.size());
+        std::iota(indices.begin(), indices.end(), 0);
+        candidates.select(indices.data(), indices.size());
+    }
+
+    auto &list = candidates.list;
+    if (list.empty())
+        return;
+
+    float sum = candidates.weigh();
+    float maxVal = detail::maxLogit(list);
+    float logSum = std::log(sum);
+
+    // the information content of a token is -log q = logSum - (logit - max)
+    double entropy = 0.0;
+    for (auto const &c : list)
+        if (0.0f < c.prob)
+            entropy += c.prob / sum * (logSum - (c.logit - maxVal));
+
+    deviations.clear();
+    for (uint32_t i = 0; i < list.size(); i++)
+    {
+        float deviation = std::abs(logSum - (list[i].logit - maxVal) - static_cast<float>(entropy));
+        deviations.push_back({0.0f < list[i].prob ? deviation : std::numeric_limits<float>::infinity(), i});
+    }
+    std::sort(deviations.begin(), deviations.end());
+
+    // the most typical tokens until they hold p, at least one
+    float mass = p * sum;
+    float cumulativeProb = 0.0f;
+    size_t n = 0;
+    while (n < deviations.size() && (0 == n || cumulativeProb <= mass))
+        cumulativeProb += list[deviations[n++].second].prob;
+
+    indices.resize(n);
+    for (size_t i = 0; i < n; i++)
+        indices[i] = deviations[i].second;
+
+    // the kept ones in the order of the list, then move them to its front
+    std::sort(indices.begin(), indices.end());
+    for (size_t i = 0; i < n; i++)
+        list[i] = list[indices[i]];
+    list.resize(n);
+}
+
+// ----------------------------------------------------------------------------
+// TopP
+
+TopP::TopP(float p)
+    : p(p)
+{
+}
+
+void TopP::apply(Candidates &candidates)
+{
+    if (1.0f <= p)
+        return;
+
+    float sum;
+    if (candidates.dense)
+    {
+        auto logits = candidates.logits;
+        probs.resize(logits.size());
+        sum = kernels::softmaxWeights(logits.data(), probs.data(), logits.size(), candidates.temperature);
+
+        // values smaller than (1 - p) / (n - 1) cannot be part of the nucleus,
+        // all of them together are less than 1 - p. With the peaked
+        // distributions of a language model this leaves few candidates.
+        const float cutoff = (1.0f - p) / (logits.size() - 1) * sum;
+        indices.resize(logits.size());
+        size_t n = kernels::indicesAtLeast(probs.data(), probs.size(), cutoff, indices.data());
+
+        candidates.select(indices.data(), n);
+        for (auto &c : candidates.list)
+            c.prob = probs[c.token];
+    }
+    else
+        sum = candidates.weigh();
+
+    auto &list = candidates.list;
+    if (list.empty())
+        return;
+
+    auto last = detail::selectNucleus(list.data(), list.data() + list.size(), p * sum);
+    list.resize(last - list.data());
+}
+
+// ----------------------------------------------------------------------------
+// MinP
+
+MinP::MinP(float p)
+    : p(p)
+{
+}
+
+void MinP::apply(Candidates &candidates)
+{
+    if (p <= 0.0f)
+        return;
+
+    // q >= p * qmax, in logits (logit - max) / temperature >= log p
+    if (candidates.dense)
+    {
+        auto logits = candidates.logits;
+        float threshold = kernels::maxValue(logits.data(), logits.size()) + candidates.temperature * std::log(p);
+
+        indices.resize(logits.size());
+        size_t n = kernels::indicesAtLeast(logits.data(), logits.size(), threshold, indices.data());
+        candidates.select(indices.data(), n);
+        return;
+    }
+
+    float threshold = detail::maxLogit(candidates.list) + std::log(p);
+    std::erase_if(candidates.list, [threshold](Candidate const &c) { return c.logit < threshold; });
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <span>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Tensor.h"
+
+// ----------------------------------------------------------------------------
+// The tokens still in the running while the logits processors of a
+// SamplerChain narrow them down. They start dense, as the whole logits
+// buffer, which the processors modify in place. Once a processor selects a
+// subset, they become a list of (token, logit) and the later processors only
+// touch that list. A temperature is applied lazily to the dense logits: they
+// are divided by it whenever they are read, the logits of the list are final.
+
+struct Candidate
+{
+    uint32_t token;
+    float logit;
+    float prob; // not normalized, only valid after Candidates::weigh()
+};
+
+struct Candidates
+{
+    std::span<float> logits;
+    float temperature;
+
+    bool dense;
+    std::vector<Candidate> list;
+
+    // starts over with all tokens of the logits
+    void assign(std::span<float> logits);
+
+    size_t size() const;
+
+    // the candidates become the given tokens
+    void select(uint32_t const *tokens, size_t n);
+
+    // applies f to the logit of the token, if it is a candidate
+    template <typename F> void update(uint32_t token, F const &f);
+
+    // sets the probabilities of the list to exp(logit - max), returns their sum
+    float weigh();
+};
+
+template <typename F> void Candidates::update(uint32_t token, F const &f)
+{
+    if (dense)
+    {
+        if (token < logits.size())
+            logits[token] = f(logits[token] / temperature) * temperature;
+        return;
+    }
+
+    for (auto &c : list)
+        if (c.token == token)
+            c.logit = f(c.logit);
+}
+
+// ----------------------------------------------------------------------------
+// A step of the sampling pipeline, modifying the logits or dropping
+// candidates. Processors depending on the previous tokens see them through
+// accept().
+
+class LogitsProcessor
+{
+public:
+    using SP = std::shared_ptr<LogitsProcessor>;
+
+public:
+    virtual ~LogitsProcessor() = default;
+
+    virtual void apply(Candidates &candidates) = 0;
+
+    // a token of the sequence, from the prompt or sampled
+    virtual void accept(int) {}
+    virtual void reset() {}
+};
+
+// adds a bias to the logits of some tokens, -infinity bans them
+class LogitBias : public LogitsProcessor
+{
+public:
+    LogitBias(std::vector<std::pair<int, float>> biases);
+    void apply(Candidates &candidates);
+
+private:
+    std::vector<std::pair<int, float>> biases;
+};
+
+// penalizes the tokens of the last lastN tokens of the sequence (all of them
+// with 0): the repetition penalty divides a positive logit by repeat and
+// multiplies a negative one, then count * frequency + presence is subtracted
+class Penalties : public LogitsProcessor
+{
+public:
+    Penalties(size_t lastN, float repeat, float frequency, float presence);
+    void apply(Candidates &candidates);
+    void accept(int token);
+    void reset();
+
+private:
+    size_t lastN;
+    float repeat;
+    float frequency;
+    float presence;
+
+    std::deque<int> history;
+    std::unordered_map<int, int> counts; // of the tokens in history
+};
+
+// keeps the k tokens with the largest logits
+class TopK : public LogitsProcessor
+{
+public:
+    TopK(size_t k);
+    void apply(Candidates &candidates);
+
+private:
+    size_t k;
+
+    std::vector<Candidate> heap;
+    std::vector<uint32_t> indices;
+};
+
+// divides the logits by the temperature, 0 keeps the most likely token only
+class Temperature : public LogitsProcessor
+{
+public:
+    Temperature(float temperature);
+    void apply(Candidates &candidates);
+
+private:
+    float temperature;
+};
+
+// locally typical sampling: keeps the tokens whose information content is
+// closest to the entropy of the distribution, until they hold p
+class TypicalP : public LogitsProcessor
+{
+public:
+    TypicalP(float p);
+    void apply(Candidates &candidates);
+
+private:
+    float p;
+
+    std::vector<uint32_t> indices;
+    std::vector<std::pair<float, uint32_t>> deviations;
+};
+
+// nucleus sampling: keeps the most likely tokens, until they hold p
+class TopP : public LogitsProcessor
+{
+public:
+    TopP(float p);
+    void apply(Candidates &candidates);
+
+private:
+    float p;
+
+    FloatTensor probs;
+    std::vector<uint32_t> indices;
+};
+
+// keeps the tokens with at least p times the probability of the most likely
+class MinP : public LogitsProcessor
+{
+public:
+    MinP(float p);
+    void apply(Candidates &candidates);
+
+private:
+    float p;
+
+    std::vector<uint32_t> indices;
+};
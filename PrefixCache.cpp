@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "PrefixCache.h"
+
+namespace detail
+{
+
+// FNV-1a over the tokens of a block
+inline uint64_t hashBlock(std::span<int const> block)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (int token : block)
+    {
+        hash ^= static_cast<uint32_t>(token);
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+} // namespace detail
+
+PrefixCache::PrefixCache(size_t budget, size_t blockSize)
+    : budget(budget),
+      blockSize(blockSize),
+      used(0)
+{
+    if (0 == blockSize)
+        throw std::runtime_error("The block size of the prefix cache must not be 0");
+}
+
+size_t PrefixCache::restore(std::span<int const> tokens, Sequence &sequence)
+{
+    if (0 != sequence.position())
+        throw std::runtime_error("A prefix can only be restored into an empty sequence");
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::vector<Node *> path;
+    Node *node = &root;
+    for (size_t first = 0; first + blockSize < tokens.size(); first += blockSize)
+    {
+        auto block = tokens.subspan(first, blockSize);
+        if (!(node = find(node, block, detail::hashBlock(block))))
+            break;
+        path.push_back(node);
+    }
+
+    for (Node const *n : path)
+    {
+        uint8_t const *rows = n->rows.data();
+        for (size_t l = 0; l < sequence.nLayers(); l++)
+        {
+            sequence.cache(l).appendRows(rows, blockSize);
+            rows += sequence.cache(l).bytes(blockSize);
+        }
+    }
+
+    touch(path);
+    return path.size() * blockSize;
+}
+
+void PrefixCache::insert(std::span<int const> tokens, Sequence const &sequence)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // the blocks still in the KV caches, none once the first one is overwritten
+    size_t position = sequence.position();
+    if (0 == position || 0 < sequence.cache(0).windowStart(position - 1))
+        return;
+    size_t nBlocks = std::min(tokens.size(), position) / blockSize;
+
+    std::vector<Node *> path;
+    Node *node = &root;
+    for (size_t b = 0; b < nBlocks; b++)
+    {
+        auto block = tokens.subspan(b * blockSize, blockSize);
+        uint64_t key = detail::hashBlock(block);
+
+        if (Node *child = find(node, block, key))
+        {
+            path.push_back(node = child);
+            continue;
+        }
+
+        // a different block with the same hash keeps its place
+        if (node->children.contains(key))
+            break;
+
+        auto child = std::make_unique<Node>();
+        child->parent = node;
+        child->key = key;
+        child->tokens.assign(block.begin(), block.end());
+
+        size_t bytes = 0;
+        for (size_t l = 0; l < sequence.nLayers(); l++)
+            bytes += sequence.cache(l).bytes(blockSize);
+        child->rows.resize(bytes);
+
+        uint8_t *rows = child->rows.data();
+        for (size_t l = 0; l < sequence.nLayers(); l++)
+        {
+            sequence.cache(l).copyRows(b * blockSize, blockSize, rows);
+            rows += sequence.cache(l).bytes(blockSize);
+        }
+
+        used += bytes;
+        child->lru = lru.insert(lru.end(), child.get());
+        node = node->children.emplace(key, std::move(child)).first->second.get();
+        path.push_back(node);
+    }
+
+    touch(path);
+    evict();
+}
+
+size_t PrefixCache::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return used;
+}
+
+PrefixCache::Node *PrefixCache::find(Node *node, std::span<int const> block, uint64_t key) const
+{
+    auto it = node->children.find(key);
+    if (it == node->children.end() || !std::equal(block.begin(), block.end(), it->second->tokens.begin()))
+        return nullptr;
+    return it->second.get();
+}
+
+void PrefixCache::touch(std::span<Node *const> path)
+{
+    // the deepest node first, so that every node is more recent than its
+    // descendants
+    for (auto it = path.rbegin(); it != path.rend(); ++it)
+        lru.splice(lru.begin(), lru, (*it)->lru);
+}
+
+void PrefixCache::evict()
+{
+    while (budget < used && !lru.empty())
+    {
+        Node *node = lru.back();
+        lru.pop_back();
+        used -= node->rows.size();
+        node->parent->children.erase(node->key);
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+#include "Transformer.h"
+
+// ----------------------------------------------------------------------------
+// Keeps the KV caches of prompt prefixes, so that a sequence starting with a
+// prefix seen before, e.g. a long system prompt, restores it instead of
+// computing it again. The prefixes are stored as a radix tree over blocks of
+// blockSize tokens: a node holds the keys and values of one block in all
+// layers, and its children are keyed by the hash of their block. The nodes
+// beyond the memory budget are evicted, least recently used first. A node is
+// always used together with its ancestors, which are marked as more recent,
+// so only leaves are evicted.
+//
+// The stored rows are copied as they are, all sequences using a cache need
+// the same KV cache type.
+
+class PrefixCache
+{
+public:
+    PrefixCache(size_t budget, size_t blockSize = 32);
+
+    // restores the longest cached prefix of the tokens into the empty
+    // sequence, but never the last token, whose logits are still needed.
+    // Returns the number of tokens restored.
+    size_t restore(std::span<int const> tokens, Sequence &sequence);
+
+    // caches the full blocks of the tokens, whose keys and values the
+    // sequence holds from position 0 on
+    void insert(std::span<int const> tokens, Sequence const &sequence);
+
+    // the size of the cached keys and values
+    size_t size() const;
+
+private:
+    struct Node
+    {
+        Node *parent = nullptr;
+        uint64_t key = 0; // the hash of the block
+        std::vector<int> tokens;
+        std::vector<uint8_t> rows; // of the block in all layers, see KVCache::copyRows()
+        std::unordered_map<uint64_t, std::unique_ptr<Node>> children;
+        std::list<Node *>::iterator lru;
+    };
+
+    // the child of node holding the block, if any
+    Node *find(Node *node, std::span<int const> block, uint64_t key) const;
+
+    // marks the nodes as used, the path from the root in order
+    void touch(std::span<Node *const> path);
+    void evict();
+
+private:
+    size_t budget;
+    size_t blockSize;
+    size_t used;
+
+    Node root;
+    std::list<Node *> lru; // the most recently used first
+
+    mutable std::mutex mutex;
+};
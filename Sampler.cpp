@@ -1,36 +1,8 @@
 #include <algorithm>
 #include <cmath>
-#include <numeric>
 
 #include "Sampler.h"
-
-void softmax(FloatTensor const &logits, FloatTensor &dst, float temperature)
-{
-    dst.resize(logits.size());
-    size_t dim = dst.size();
-
-    // temperature scaling and
-    // find max value (for numerical stability)
-    float maxVal = std::numeric_limits<float>::min();
-    for (size_t i = 0; i < dim; ++i)
-    {
-        dst[i] = logits[i] / temperature;
-        if (dst[i] > maxVal)
-            maxVal = dst[i];
-    }
-
-    // exp and sum
-    float sum = 0.0f;
-    for (size_t i = 0; i < dim; ++i)
-    {
-        dst[i] = std::exp(dst[i] - maxVal);
-        sum += dst[i];
-    }
-
-    // normalize
-    for (size_t i = 0; i < dim; ++i)
-        dst[i] /= sum;
-}
+#include "kernels.h"
 
 unsigned int random_u32(unsigned long long *state)
 {
@@ -46,27 +18,26 @@ float random_f32(unsigned long long *state)
     return (random_u32(state) >> 8) / 16777216.0f;
 }
 
-size_t sampleFromDistribution(FloatTensor::const_iterator first, FloatTensor::const_iterator last,
+size_t sampleFromDistribution(FloatTensor::const_iterator first, FloatTensor::const_iterator last, float sum,
                               unsigned long long *rng_state)
 {
-    float coin = random_f32(rng_state);
+    // the weights do not need to be normalized, the coin is scaled by their sum
+    float coin = random_f32(rng_state) * sum;
 
     float cdf = 0.0f;
+    size_t lastPositive = 0;
     for (size_t i = 0; first != last; i++, first++)
     {
         cdf += *first;
         if (coin < cdf)
             return i;
+        if (0.0f < *first)
+            lastPositive = i;
     }
-    return std::distance(first, last) - 1; // in case of rounding errors
+    return lastPositive; // in case of rounding errors
 }
 
-size_t sampleFromDistribution(FloatTensor const &probs, unsigned long long *rng_state)
-{
-    return sampleFromDistribution(probs.begin(), probs.end(), rng_state);
-}
-
-size_t ArgmaxSampler::sample(FloatTensor const &logits)
+size_t ArgmaxSampler::sample(std::span<float> logits)
 {
     // greedy argmax sampling: take the token with the highest probability
     return std::distance(logits.begin(), std::max_element(logits.begin(), logits.end()));
@@ -77,58 +48,91 @@ SimpleSampler::SimpleSampler(unsigned long long rngSeed)
 {
 }
 
-size_t SimpleSampler::sample(FloatTensor const &logits)
+size_t SimpleSampler::sample(std::span<float> logits)
 {
-    softmax(logits, probs, 1.0f);
-    return sampleFromDistribution(probs, &rngState);
+    probs.resize(logits.size());
+    float sum = kernels::softmaxWeights(logits.data(), probs.data(), probs.size());
+    return sampleFromDistribution(probs.begin(), probs.end(), sum, &rngState);
 }
 
-NucleusSampler::NucleusSampler(size_t dim, float temperature, float topP, unsigned long long rngSeed)
-    : temperature(temperature),
-      topP(topP),
-      rngState(rngSeed),
-      probs(dim),
-      probIndex(dim)
+SamplerChain::SamplerChain(size_t dim, unsigned long long rngSeed)
+    : rngState(rngSeed),
+      probs(dim)
 {
 }
 
-size_t NucleusSampler::sample(FloatTensor const &logits)
+SamplerChain::SamplerChain(size_t dim, SamplingParams const &params, unsigned long long rngSeed)
+    : SamplerChain(dim, rngSeed)
 {
-    softmax(logits, probs, temperature);
-
-    auto probindexFirst = probIndex.data();
-    auto probindexLast = probIndex.data();
-
-    const float cutoff = (1.0f - topP) / (probs.size() - 1);
-    for (size_t i = 0; i < probs.size(); i++)
-        if (probs[i] >= cutoff)
-            *probindexLast++ = ProbIndex{probs[i], i};
+    if (!params.logitBias.empty())
+        add(std::make_shared<LogitBias>(params.logitBias));
+    if (1.0f != params.repeatPenalty || 0.0f != params.frequencyPenalty || 0.0f != params.presencePenalty)
+        add(std::make_shared<Penalties>(params.penaltyLastN, params.repeatPenalty, params.frequencyPenalty,
+                                        params.presencePenalty));
+    if (0 < params.topK)
+        add(std::make_shared<TopK>(params.topK));
+    if (1.0f != params.temperature)
+        add(std::make_shared<Temperature>(params.temperature));
+    if (params.typicalP < 1.0f)
+        add(std::make_shared<TypicalP>(params.typicalP));
+    if (0.0f < params.topP && params.topP < 1.0f)
+        add(std::make_shared<TopP>(params.topP));
+    if (0.0f < params.minP)
+        add(std::make_shared<MinP>(params.minP));
+}
 
-    std::sort(probindexFirst, probindexLast,
-              [](auto const &first, auto const &second) { return first.prob >= second.prob; });
+SamplerChain &SamplerChain::add(LogitsProcessor::SP processor)
+{
+    processors.push_back(std::move(processor));
+    return *this;
+}
 
-    float cumulativeProb = 0.0f;
-    auto it = probindexFirst;
-    for (; it != probindexLast - 1; ++it)
-        if ((cumulativeProb += it->prob) > topP)
-            break; // we've exceeded topp by including last_idx
+size_t SamplerChain::sample(std::span<float> logits)
+{
+    candidates.assign(logits);
+    for (auto &processor : processors)
+        processor->apply(candidates);
 
-    size_t ix = sampleFromDistribution(probindexFirst, it + 1, cumulativeProb);
+    if (candidates.dense)
+    {
+        probs.resize(logits.size());
+        float sum = kernels::softmaxWeights(logits.data(), probs.data(), probs.size(), candidates.temperature);
+        return sampleFromDistribution(probs.begin(), probs.end(), sum, &rngState);
+    }
 
-    return probIndex[ix].index;
-}
+    auto const &list = candidates.list;
+    if (list.empty())
+        return std::distance(logits.begin(), std::max_element(logits.begin(), logits.end()));
 
-size_t NucleusSampler::sampleFromDistribution(ProbIndex *first, ProbIndex *last, float cumulativeProb)
-{
-    float coin = random_f32(&rngState) * cumulativeProb;
+    float coin = random_f32(&rngState) * candidates.weigh();
 
     float cdf = 0.0f;
-    auto it = first;
-    for (size_t i = 0; it != last; i++, it++)
+    for (auto const &c : list)
     {
-        cdf += first->prob;
+        cdf += c.prob;
         if (coin < cdf)
-            return i;
+            return c.token;
     }
-    return std::distance(first, last) - 1; // in case of rounding errors
-}
\ No newline at end of file
+    return list.back().token; // in case of rounding errors
+}
+
+void SamplerChain::accept(int token)
+{
+    for (auto &processor : processors)
+        processor->accept(token);
+}
+
+void SamplerChain::reset()
+{
+    for (auto &processor : processors)
+        processor->reset();
+}
+
+NucleusSampler::NucleusSampler(size_t dim, float temperature, float topP, unsigned long long rngSeed)
+    : SamplerChain(dim, rngSeed)
+{
+    if (1.0f != temperature)
+        add(std::make_shared<Temperature>(temperature));
+    if (0.0f < topP && topP < 1.0f)
+        add(std::make_shared<TopP>(topP));
+}
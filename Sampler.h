@@ -1,13 +1,19 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
+#include <span>
+#include <utility>
 #include <vector>
 
+#include "LogitsProcessor.h"
 #include "Tensor.h"
 
 // ----------------------------------------------------------------------------
 // The Sampler, which takes logits and returns a sampled token
-// sampling can be done in a few ways: greedy argmax, sampling, top-p sampling
+// sampling can be done in a few ways: greedy argmax, sampling, or sampling
+// after a chain of logits processors like top-k, top-p and penalties. The
+// logits may be modified.
 
 class Sampler
 {
@@ -15,20 +21,26 @@ public:
     using SP = std::shared_ptr<Sampler>;
 
 public:
-    virtual size_t sample(FloatTensor const &logits) = 0;
+    virtual ~Sampler() = default;
+
+    virtual size_t sample(std::span<float> logits) = 0;
+
+    // a token of the sequence, from the prompt or sampled
+    virtual void accept(int) {}
+    virtual void reset() {}
 };
 
 class ArgmaxSampler : public Sampler
 {
 public:
-    size_t sample(FloatTensor const &logits);
+    size_t sample(std::span<float> logits);
 };
 
 class SimpleSampler : public Sampler
 {
 public:
     SimpleSampler(unsigned long long rngSeed);
-    size_t sample(FloatTensor const &logits);
+    size_t sample(std::span<float> logits);
 
 private:
     unsigned long long rngState;
@@ -36,26 +48,49 @@ private:
     FloatTensor probs;
 };
 
-class NucleusSampler : public Sampler
+// The settings of the standard chain of logits processors, in their fixed
+// order: logit bias, penalties, top-k, temperature, typical, top-p and min-p.
+// The processors with neutral settings are left out.
+struct SamplingParams
+{
+    float temperature = 1.0f;
+    float topP = 0.9f;
+    int topK = 0;
+    float minP = 0.0f;
+    float typicalP = 1.0f;
+    float repeatPenalty = 1.0f;
+    float frequencyPenalty = 0.0f;
+    float presencePenalty = 0.0f;
+    int penaltyLastN = 64;
+    std::vector<std::pair<int, float>> logitBias;
+};
+
+// samples after the logits processors, applied in the order they were added
+class SamplerChain : public Sampler
 {
 public:
-    NucleusSampler(size_t dim, float temperature, float topP, unsigned long long rngSeed);
-    size_t sample(FloatTensor const &logits);
+    SamplerChain(size_t dim, unsigned long long rngSeed);
 
-private:
-    typedef struct
-    {
-        float prob;
-        size_t index;
-    } ProbIndex; // struct used when sorting probabilities during top-p sampling
+    // the standard chain
+    SamplerChain(size_t dim, SamplingParams const &params, unsigned long long rngSeed);
 
-    size_t sampleFromDistribution(ProbIndex *first, ProbIndex *last, float cumulativeProb);
+    SamplerChain &add(LogitsProcessor::SP processor);
+
+    size_t sample(std::span<float> logits);
+    void accept(int token);
+    void reset();
 
 private:
-    float temperature;
-    float topP;
+    std::vector<LogitsProcessor::SP> processors;
     unsigned long long rngState;
 
+    Candidates candidates;
     FloatTensor probs;
-    std::vector<ProbIndex> probIndex; // buffer used in top-p sampling
+};
+
+// temperature and top-p
+class NucleusSampler : public SamplerChain
+{
+public:
+    NucleusSampler(size_t dim, float temperature, float topP, unsigned long long rngSeed);
 };
@@ -0,0 +1,657 @@
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Logger.h"
+#include "Server.h"
+#include "Tracer.h"
+
+namespace detail
+{
+
+inline void skipSpace(std::string_view json, size_t &i)
+{
+    while (i < json.size() && std::isspace(static_cast<unsigned char>(json[i])))
+        i++;
+}
+
+inline void expect(std::string_view json, size_t &i, char c)
+{
+    skipSpace(json, i);
+    if (i == json.size() || json[i] != c)
+        throw std::runtime_error(std::string("JSON: expected '") + c + "'");
+    i++;
+}
+
+inline unsigned parseHex4(std::string_view json, size_t i)
+{
+    unsigned value = 0;
+    auto last = json.data() + i + 4;
+    if (json.size() < i + 4 || std::from_chars(json.data() + i, last, value, 16).ptr != last)
+        throw std::runtime_error("JSON: bad \\u escape");
+    return value;
+}
+
+inline void appendUtf8(std::string &out, unsigned c)
+{
+    if (c < 0x80)
+        out += static_cast<char>(c);
+    else if (c < 0x800)
+    {
+        out += static_cast<char>(0xc0 | c >> 6);
+        out += static_cast<char>(0x80 | (c & 0x3f));
+    }
+    else if (c < 0x10000)
+    {
+        out += static_cast<char>(0xe0 | c >> 12);
+        out += static_cast<char>(0x80 | (c >> 6 & 0x3f));
+        out += static_cast<char>(0x80 | (c & 0x3f));
+    }
+    else
+    {
+        out += static_cast<char>(0xf0 | c >> 18);
+        out += static_cast<char>(0x80 | (c >> 12 & 0x3f));
+        out += static_cast<char>(0x80 | (c >> 6 & 0x3f));
+        out += static_cast<char>(0x80 | (c & 0x3f));
+    }
+}
+
+std::string parseString(std::string_view json, size_t &i)
+{
+    expect(json, i, '"');
+
+    std::string out;
+    while (i < json.size() && json[i] != '"')
+    {
+        char c = json[i++];
+        if (c != '\\')
+        {
+            out += c;
+            continue;
+        }
+
+        if (i == json.size())
+            break;
+        switch (c = json[i++])
+        {
+        case 'b':
+            out += '\b';
+            break;
+        case 'f':
+            out += '\f';
+            break;
+        case 'n':
+            out += '\n';
+            break;
+        case 'r':
+            out += '\r';
+            break;
+        case 't':
+            out += '\t';
+            break;
+        case 'u':
+        {
+            unsigned code = parseHex4(json, i);
+            i += 4;
+
+            // a surrogate pair encodes a code point beyond the BMP
+            if (0xd800 <= code && code < 0xdc00 && json.substr(i, 2) == "\\u")
+            {
+                unsigned low = parseHex4(json, i + 2);
+                if (0xdc00 <= low && low < 0xe000)
+                {
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                    i += 6;
+                }
+            }
+            appendUtf8(out, code);
+            break;
+        }
+        default: // '"', '\\' and '/'
+            out += c;
+        }
+    }
+
+    expect(json, i, '"');
+    return out;
+}
+
+std::unordered_map<std::string, std::string> parseJsonObject(std::string_view json)
+{
+    std::unordered_map<std::string, std::string> members;
+    size_t i = 0;
+
+    expect(json, i, '{');
+    skipSpace(json, i);
+    if (i < json.size() && json[i] == '}')
+        return members;
+
+    while (true)
+    {
+        std::string key = parseString(json, i);
+        expect(json, i, ':');
+        skipSpace(json, i);
+
+        if (i < json.size() && json[i] == '"')
+            members[key] = parseString(json, i);
+        else
+        {
+            size_t start = i;
+            while (i < json.size() && json[i] != ',' && json[i] != '}' &&
+                   !std::isspace(static_cast<unsigned char>(json[i])))
+                i++;
+            if (start == i || json[start] == '{' || json[start] == '[')
+                throw std::runtime_error("JSON: unsupported value of " + key);
+            members[key] = json.substr(start, i - start);
+        }
+
+        skipSpace(json, i);
+        if (i < json.size() && json[i] == '}')
+            return members;
+        expect(json, i, ',');
+    }
+}
+
+// ----------------------------------------------------------------------------
+// HTTP
+
+struct Request
+{
+    std::string method;
+    std::string path;
+    std::string body;
+};
+
+bool sendAll(int connection, std::string_view data)
+{
+    while (!data.empty())
+    {
+        ssize_t n = ::send(connection, data.data(), data.size(), MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        data.remove_prefix(n);
+    }
+    return true;
+}
+
+bool sendResponse(int connection, std::string_view status, std::string_view body)
+{
+    std::string response = "HTTP/1.1 " + std::string(status) +
+                           "\r\nContent-Type: text/plain; charset=utf-8\r\nConnection: close\r\nContent-Length: " +
+                           std::to_string(body.size()) + "\r\n\r\n" + std::string(body);
+    return sendAll(connection, response);
+}
+
+bool sendChunk(int connection, std::string_view data)
+{
+    char size[20];
+    auto end = std::to_chars(size, size + sizeof(size), data.size(), 16).ptr;
+    return sendAll(connection, std::string(size, end) + "\r\n" + std::string(data) + "\r\n");
+}
+
+// receives up to size bytes, at least one, before the deadline of the
+// request, so that a client that stops sending can not hold its thread
+size_t receive(int connection, char *buffer, size_t size, std::chrono::steady_clock::time_point deadline)
+{
+    auto left = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now());
+    if (left.count() <= 0)
+        throw std::runtime_error("request timed out");
+
+    timeval timeout{static_cast<time_t>(left.count() / 1000000), static_cast<suseconds_t>(left.count() % 1000000)};
+    if (::setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+        throw std::runtime_error(std::string("couldn't set the receive timeout: ") + std::strerror(errno));
+
+    ssize_t n = ::recv(connection, buffer, size, 0);
+    if (0 == n)
+        throw std::runtime_error("connection closed");
+    if (n < 0)
+        throw std::runtime_error(EAGAIN == errno || EWOULDBLOCK == errno ? "request timed out"
+                                                                         : std::strerror(errno));
+    return n;
+}
+
+Request readRequest(int connection)
+{
+    constexpr size_t maxHeaderSize = 16384;
+    constexpr size_t maxBodySize = 1 << 20;
+    constexpr auto timeout = std::chrono::seconds(30); // for the whole request
+
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+
+    std::string data;
+    size_t headerEnd;
+    char buffer[4096];
+
+    while (std::string::npos == (headerEnd = data.find("\r\n\r\n")))
+    {
+        if (maxHeaderSize < data.size())
+            throw std::runtime_error("request header too large");
+        data.append(buffer, receive(connection, buffer, sizeof(buffer), deadline));
+    }
+
+    Request request;
+    std::string_view header(data.data(), headerEnd);
+    size_t lineEnd = std::min(header.find("\r\n"), header.size());
+    std::string_view line = header.substr(0, lineEnd);
+
+    size_t space1 = line.find(' ');
+    size_t space2 = line.find(' ', space1 + 1);
+    if (std::string_view::npos == space1 || std::string_view::npos == space2)
+        throw std::runtime_error("bad request line");
+    request.method = line.substr(0, space1);
+    request.path = line.substr(space1 + 1, space2 - space1 - 1);
+
+    size_t contentLength = 0;
+    for (size_t pos = lineEnd; pos < header.size();)
+    {
+        size_t end = std::min(header.find("\r\n", pos + 2), header.size());
+        std::string_view field = header.substr(pos + 2, end - pos - 2);
+        pos = end;
+
+        size_t colon = field.find(':');
+        if (std::string_view::npos == colon)
+            continue;
+
+        std::string name(field.substr(0, colon));
+        std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+        if (name != "content-length")
+            continue;
+
+        auto value = field.substr(colon + 1);
+        value.remove_prefix(std::min(value.find_first_not_of(' '), value.size()));
+        if (std::from_chars(value.data(), value.data() + value.size(), contentLength).ec != std::errc())
+            throw std::runtime_error("bad content length");
+    }
+
+    if (maxBodySize < contentLength)
+        throw std::runtime_error("request body too large");
+
+    request.body = data.substr(headerEnd + 4);
+    while (request.body.size() < contentLength)
+        request.body.append(buffer, receive(connection, buffer, sizeof(buffer), deadline));
+    request.body.resize(contentLength);
+
+    return request;
+}
+
+int listenOn(std::string const &address)
+{
+    int fd;
+
+    if (address.starts_with("unix:"))
+    {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        std::string path = address.substr(5);
+        if (path.empty() || sizeof(addr.sun_path) <= path.size())
+            throw std::runtime_error("bad socket path " + path);
+        std::copy(path.begin(), path.end(), addr.sun_path);
+
+        // a socket file left behind by a previous server
+        ::unlink(path.c_str());
+
+        fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+            throw std::runtime_error("couldn't bind " + address + ": " + std::strerror(errno));
+    }
+    else
+    {
+        // host:port, or just the port on the loopback interface
+        size_t colon = address.rfind(':');
+        std::string host = std::string::npos == colon ? "127.0.0.1" : address.substr(0, colon);
+        std::string port = std::string::npos == colon ? address : address.substr(colon + 1);
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(std::stoi(port));
+        if (1 != ::inet_pton(AF_INET, host.c_str(), &addr.sin_addr))
+            throw std::runtime_error("bad address " + address);
+
+        fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        int reuse = 1;
+        if (fd < 0 || ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+            ::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+            throw std::runtime_error("couldn't bind " + address + ": " + std::strerror(errno));
+    }
+
+    if (::listen(fd, 64) < 0)
+        throw std::runtime_error("couldn't listen on " + address + ": " + std::strerror(errno));
+
+    return fd;
+}
+
+template <typename T>
+T member(std::unordered_map<std::string, std::string> const &members, std::string const &key, T value)
+{
+    auto it = members.find(key);
+    if (it == members.end() || it->second == "null")
+        return value;
+
+    auto const &s = it->second;
+    if (std::from_chars(s.data(), s.data() + s.size(), value).ptr != s.data() + s.size())
+        throw std::runtime_error("bad value of " + key + ": " + s);
+    return value;
+}
+
+} // namespace detail
+
+// ----------------------------------------------------------------------------
+// Session
+
+struct Server::Session
+{
+    Session(Tokenizer const &tokenizer, size_t vocabSize, SamplingParams const &sampling,
+            unsigned long long rngSeed, std::vector<std::string> stopStrings)
+        : sampler(vocabSize, sampling, rngSeed),
+          decoder(tokenizer, std::move(stopStrings))
+    {
+    }
+
+    // used by the scheduler only
+    std::vector<int> prompt;
+    size_t fed = 0;  // the number of prompt tokens fed to the model or restored
+    bool cached = false; // whether the prompt was put into the prefix cache
+    int next = 0;    // the token to feed next once the prompt is done
+    size_t maxTokens = 0;
+    size_t generated = 0;
+    std::unique_ptr<Sequence> sequence;
+    SamplerChain sampler;
+    StreamDecoder decoder;
+
+    // the text for the connection, guarded by mutex
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::string output;
+    bool finished = false;
+    bool failed = false; // a step with the session threw, the response is cut off
+    bool cancelled = false;
+};
+
+// ----------------------------------------------------------------------------
+// Server
+
+Server::Server(Transformer const &transformer, Tokenizer const &tokenizer, Options options)
+    : transformer(transformer),
+      tokenizer(tokenizer),
+      options(std::move(options)),
+      context(transformer.getConfig(), this->options.kvType),
+      logits(transformer.getConfig().vocabSize)
+{
+    if (0 == this->options.maxSessions || Transformer::maxBatchSize < this->options.maxSessions)
+        throw std::runtime_error("the number of sessions must be in [1, " +
+                                 std::to_string(Transformer::maxBatchSize) + "]");
+
+    if (0 < this->options.prefixCacheBytes)
+        prefixCache = std::make_unique<PrefixCache>(this->options.prefixCacheBytes);
+}
+
+void Server::run()
+{
+    int listener = detail::listenOn(options.address);
+    logger(Logger::INFO) << "listening on " << options.address << std::endl;
+
+    std::thread(&Server::schedule, this).detach();
+
+    while (true)
+    {
+        int connection = ::accept(listener, nullptr, nullptr);
+        if (connection < 0)
+        {
+            if (EINTR == errno || ECONNABORTED == errno)
+                continue;
+            throw std::runtime_error(std::string("accept failed: ") + std::strerror(errno));
+        }
+
+        std::thread(&Server::handle, this, connection).detach();
+    }
+}
+
+void Server::schedule()
+{
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            admission.wait(lock, [this]() { return !waiting.empty() || !active.empty(); });
+
+            while (active.size() < options.maxSessions && !waiting.empty())
+            {
+                auto session = std::move(waiting.front());
+                waiting.pop_front();
+
+                std::lock_guard<std::mutex> sessionLock(session->mutex);
+                if (!session->cancelled)
+                    active.push_back(std::move(session));
+            }
+        }
+
+        try
+        {
+            step();
+        }
+        catch (std::exception const &e)
+        {
+            // the state of the sessions in the batch is unknown, they fail
+            // and the others are served on
+            logger(Logger::ERROR) << "step failed: " << e.what() << std::endl;
+
+            for (Session *session : batch)
+            {
+                std::lock_guard<std::mutex> lock(session->mutex);
+                session->finished = true;
+                session->failed = true;
+                session->ready.notify_one();
+            }
+        }
+
+        retire();
+    }
+}
+
+void Server::step()
+{
+    auto const &config = transformer.getConfig();
+
+    // the decoding sessions first, with one token each, then chunks of the
+    // prompts while the batch has room. A chunk of a single sequence must
+    // fit into its KV cache.
+    inputs.clear();
+    batch.clear();
+    size_t room = Transformer::maxBatchSize;
+
+    for (auto &session : active)
+        if (session->fed == session->prompt.size())
+        {
+            inputs.push_back({session->sequence.get(), std::span<int const>(&session->next, 1)});
+            batch.push_back(session.get());
+            room--;
+        }
+
+    for (auto &session : active)
+        if (session->fed < session->prompt.size() && 0 < room)
+        {
+            // in the batch before anything can throw for it
+            batch.push_back(session.get());
+
+            if (!session->sequence)
+            {
+                session->sequence = std::make_unique<Sequence>(config, options.kvType);
+                if (prefixCache)
+                    session->fed = prefixCache->restore(session->prompt, *session->sequence);
+            }
+
+            size_t n = std::min({room, session->prompt.size() - session->fed, static_cast<size_t>(config.seqLength)});
+            inputs.push_back({session->sequence.get(), std::span(session->prompt).subspan(session->fed, n)});
+            session->fed += n;
+            room -= n;
+        }
+
+    transformer.forward(context, inputs, logits);
+
+    // a token for every session that is done with its prompt
+    size_t vocabSize = config.vocabSize;
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+        Session &session = *batch[i];
+        if (session.fed < session.prompt.size())
+            continue;
+
+        if (prefixCache && !session.cached)
+        {
+            prefixCache->insert(session.prompt, *session.sequence);
+            session.cached = true;
+        }
+
+        int token;
+        {
+            Tracer::Scope trace(Tracer::SAMPLING);
+            token = session.sampler.sample(std::span(logits.f()).subspan(i * vocabSize, vocabSize));
+            session.sampler.accept(token);
+        }
+
+        std::string text;
+        bool done = token == 128001 || token == 128009;
+        if (!done)
+            done = session.decoder.decode(token, text);
+        done = done || session.maxTokens <= ++session.generated;
+        if (done)
+            session.decoder.flush(text);
+        session.next = token;
+
+        std::lock_guard<std::mutex> lock(session.mutex);
+        session.output += text;
+        session.finished = done;
+        session.ready.notify_one();
+    }
+}
+
+void Server::retire()
+{
+    // the finished sessions, their KV caches are freed right away
+    std::erase_if(active,
+                  [](std::shared_ptr<Session> const &session)
+                  {
+                      std::lock_guard<std::mutex> lock(session->mutex);
+                      if (!session->finished && !session->cancelled)
+                          return false;
+                      session->sequence.reset();
+                      return true;
+                  });
+}
+
+void Server::handle(int connection)
+{
+    try
+    {
+        auto request = detail::readRequest(connection);
+
+        if (request.method == "GET" && request.path == "/health")
+            detail::sendResponse(connection, "200 OK", "ok\n");
+        else if (request.method == "POST" && request.path == "/generate")
+            generate(connection, request.body);
+        else
+            detail::sendResponse(connection, "404 Not Found", "not found\n");
+    }
+    catch (std::exception const &e)
+    {
+        logger(Logger::DEBUG) << "request failed: " << e.what() << std::endl;
+    }
+
+    ::close(connection);
+}
+
+void Server::generate(int connection, std::string_view body)
+{
+    std::shared_ptr<Session> session;
+
+    try
+    {
+        auto members = detail::parseJsonObject(body);
+
+        auto prompt = members.find("prompt");
+        if (prompt == members.end())
+            throw std::runtime_error("no prompt");
+
+        SamplingParams sampling = options.sampling;
+        sampling.temperature = detail::member(members, "temperature", sampling.temperature);
+        sampling.topP = detail::member(members, "top_p", sampling.topP);
+        sampling.topK = detail::member(members, "top_k", sampling.topK);
+        sampling.minP = detail::member(members, "min_p", sampling.minP);
+        sampling.typicalP = detail::member(members, "typical_p", sampling.typicalP);
+        sampling.repeatPenalty = detail::member(members, "repeat_penalty", sampling.repeatPenalty);
+        sampling.frequencyPenalty = detail::member(members, "frequency_penalty", sampling.frequencyPenalty);
+        sampling.presencePenalty = detail::member(members, "presence_penalty", sampling.presencePenalty);
+        sampling.penaltyLastN = detail::member(members, "penalty_last_n", sampling.penaltyLastN);
+        if (sampling.temperature < 0.0f || sampling.topK < 0 || sampling.penaltyLastN < 0)
+            throw std::runtime_error("invalid sampling parameters");
+
+        auto rngSeed = detail::member(members, "seed", static_cast<unsigned long long>(std::random_device()()));
+        auto maxTokens = detail::member(members, "max_tokens", options.maxTokens);
+
+        auto stopStrings = options.stopStrings;
+        if (auto stop = members.find("stop"); stop != members.end() && !stop->second.empty())
+            stopStrings = {stop->second};
+
+        session = std::make_shared<Session>(tokenizer, transformer.getConfig().vocabSize, sampling, rngSeed,
+                                            std::move(stopStrings));
+
+        auto tokens = tokenizer.encode(prompt->second, 1, 0);
+        session->prompt.assign(tokens.begin(), tokens.end());
+        session->maxTokens = std::max<size_t>(1, maxTokens);
+        for (int token : session->prompt)
+            session->sampler.accept(token);
+    }
+    catch (std::exception const &e)
+    {
+        detail::sendResponse(connection, "400 Bad Request", std::string(e.what()) + "\n");
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        waiting.push_back(session);
+    }
+    admission.notify_one();
+
+    bool connected = detail::sendAll(connection, "HTTP/1.1 200 OK\r\nContent-Type: text/plain; charset=utf-8\r\n"
+                                                 "Transfer-Encoding: chunked\r\nConnection: close\r\n\r\n");
+
+    // stream the text as the scheduler produces it
+    while (connected)
+    {
+        std::string text;
+        bool finished;
+        bool failed;
+        {
+            std::unique_lock<std::mutex> lock(session->mutex);
+            session->ready.wait(lock, [&]() { return !session->output.empty() || session->finished; });
+            std::swap(text, session->output);
+            finished = session->finished;
+            failed = session->failed;
+        }
+
+        if (!text.empty())
+            connected = detail::sendChunk(connection, text);
+        if (finished)
+        {
+            // without the last chunk the client sees an incomplete response
+            if (!failed)
+                detail::sendAll(connection, "0\r\n\r\n");
+            return;
+        }
+    }
+
+    // the client went away, the scheduler retires the session
+    std::lock_guard<std::mutex> lock(session->mutex);
+    session->cancelled = true;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "KVCache.h"
+#include "PrefixCache.h"
+#include "Sampler.h"
+#include "Tokenizer.h"
+#include "Transformer.h"
+
+// ----------------------------------------------------------------------------
+// Serves completions over HTTP on a local TCP port or a Unix socket. A client
+// POSTs a JSON request to /generate, e.g. {"prompt": "...", "max_tokens": 64},
+// and the generated text is streamed back in chunks as it is decoded.
+//
+// Every request becomes a session with its own Sequence, sampler and decoder,
+// only the weights are shared. A single scheduler thread drives the model.
+// Every step it admits waiting sessions, up to maxSessions, and feeds the next
+// token of every decoding session together with prompt chunks of the admitted
+// ones through the model as one batch, so that every Linear runs one multi-row
+// matmul for all sessions. Finished sessions, and the ones whose client went
+// away, are retired after the step and free their KV caches. With a prefix
+// cache, an admitted session starts from the longest prefix of its prompt
+// that was computed before. If a step throws, the sessions of its batch fail,
+// their responses end without the final chunk, and the others are served on.
+// A connection has 30 seconds to send its request.
+
+class Server
+{
+public:
+    struct Options
+    {
+        std::string address = "127.0.0.1:8080"; // host:port or unix:path
+        size_t maxSessions = 4;
+        KVCache::Type kvType = KVCache::F32;
+        size_t prefixCacheBytes = 0; // the budget of the prefix cache, 0 disables it
+
+        // the defaults of the requests
+        SamplingParams sampling;
+        size_t maxTokens = 256;
+        std::vector<std::string> stopStrings;
+    };
+
+public:
+    Server(Transformer const &transformer, Tokenizer const &tokenizer, Options options);
+
+    // listens on the address and serves until the process ends
+    void run();
+
+private:
+    struct Session;
+
+    void schedule();
+    void step();
+    void retire();
+
+    void handle(int connection);
+    void generate(int connection, std::string_view body);
+
+private:
+    Transformer const &transformer;
+    Tokenizer const &tokenizer;
+    Options options;
+
+    // the sessions not admitted yet, guarded by mutex
+    std::mutex mutex;
+    std::condition_variable admission;
+    std::deque<std::shared_ptr<Session>> waiting;
+
+    // the admitted sessions and the buffers of a step, used by the scheduler
+    std::vector<std::shared_ptr<Session>> active;
+    InferenceContext context;
+    std::unique_ptr<PrefixCache> prefixCache;
+    std::vector<SequenceInput> inputs;
+    std::vector<Session *> batch; // the session of every input
+    Tensor logits;
+};
+
+namespace detail
+{
+
+// the members of a flat JSON object, strings unescaped and the other values
+// as written
+std::unordered_map<std::string, std::string> parseJsonObject(std::string_view json);
+
+} // namespace detail
@@ -1,53 +1,36 @@
 #include <cmath>
+#include <stdexcept>
 
 #include "Tensor.h"
+#include "Tracer.h"
+#include "kernels.h"
 
 namespace detail
 {
 
-inline void dequantize(FloatTensor &dest, QuantizedTensor const &source)
+inline QuantizedView view(QuantizedTensor const &qt) { return {qt.groupSize, qt.q, qt.s}; }
+
+inline Q4View view(Q4Tensor const &qt) { return {qt.groupSize, qt.q, qt.s, qt.min}; }
+
+inline void dequantize(FloatTensor &dest, QuantizedView const &source)
 {
     for (size_t i = 0; i < dest.size(); i++)
         dest[i] = source.q[i] * source.s[i / source.groupSize];
 }
 
-inline void quantize(QuantizedTensor &qx, FloatTensor const &x, GroupSize groupSize)
-{
-    int num_groups = x.size() / groupSize;
-    float Q_MAX = 127.0f;
-
-    for (int group = 0; group < num_groups; group++)
-    {
-
-        // find the max absolute value in the current group
-        float wmax = 0.0;
-        for (size_t i = 0; i < groupSize; i++)
-        {
-            float val = std::abs(x[group * groupSize + i]);
-            if (val > wmax)
-                wmax = val;
-        }
-
-        // calculate and write the scaling factor
-        float scale = wmax / Q_MAX;
-        qx.s[group] = scale;
-
-        // calculate and write the quantized values
-        for (size_t i = 0; i < groupSize; i++)
-        {
-            float quant_value = x[group * groupSize + i] / scale; // scale
-            int8_t quantized = (int8_t)std::round(quant_value);   // round and clamp
-            qx.q[group * groupSize + i] = quantized;
-        }
-    }
-}
-
 } // namespace detail
 
 Tensor::Tensor(size_t size)
     : size_(size),
       isFloatValid_(false),
-      isQuantizedValid_(false)
+      isQuantizedValid_(false),
+      isQ4Valid_(false),
+      isHalfValid_(false),
+      isMapped_(false),
+      halfIsBFloat16(false),
+      mappedQuantized{0, {}, {}},
+      mappedQ4{0, {}, {}, {}},
+      mappedHalf{false, {}}
 {
 }
 
@@ -60,102 +43,405 @@ Tensor::Tensor(size_t size, bool initFloat)
 
 FloatTensor &Tensor::f()
 {
+    detach();
     ensureFloat();
     isQuantizedValid_ = false;
+    isQ4Valid_ = false;
+    isHalfValid_ = false;
     return floatTensor;
 }
 
-FloatTensor const &Tensor::cf()
+std::span<float const> Tensor::cf()
 {
+    if (isMapped_ && isFloatValid_)
+        return mappedFloat;
+
+    detach();
     ensureFloat();
     return floatTensor;
 }
 
+std::span<float const> Tensor::cf() const
+{
+    if (!isFloatValid_)
+        throw std::runtime_error("Trying to access invalid float tensor");
+    return isMapped_ ? mappedFloat : std::span<float const>(floatTensor);
+}
+
+void Tensor::detach()
+{
+    if (!isMapped_)
+        return;
+
+    if (isFloatValid_)
+        floatTensor.assign(mappedFloat.begin(), mappedFloat.end());
+
+    if (isQuantizedValid_)
+    {
+        quantizedTensor.groupSize = mappedQuantized.groupSize;
+        quantizedTensor.q.assign(mappedQuantized.q.begin(), mappedQuantized.q.end());
+        quantizedTensor.s.assign(mappedQuantized.s.begin(), mappedQuantized.s.end());
+    }
+
+    if (isQ4Valid_)
+    {
+        q4Tensor.groupSize = mappedQ4.groupSize;
+        q4Tensor.q.assign(mappedQ4.q.begin(), mappedQ4.q.end());
+        q4Tensor.s.assign(mappedQ4.s.begin(), mappedQ4.s.end());
+        q4Tensor.min.assign(mappedQ4.min.begin(), mappedQ4.min.end());
+    }
+
+    if (isHalfValid_)
+    {
+        halfIsBFloat16 = mappedHalf.bfloat16;
+        halfTensor.assign(mappedHalf.h.begin(), mappedHalf.h.end());
+    }
+
+    isMapped_ = false;
+    mappedFloat = {};
+    mappedQuantized = {0, {}, {}};
+    mappedQ4 = {0, {}, {}, {}};
+    mappedHalf = {false, {}};
+}
+
 void Tensor::ensureFloat()
 {
     if (!isFloatValid_)
     {
         floatTensor.resize(size_);
 
+        if (isQuantizedValid_ || isQ4Valid_ || isHalfValid_)
+            tracer.countConversion(Tracer::DEQUANTIZE, size_);
+
         if (isQuantizedValid_)
-            detail::dequantize(floatTensor, quantizedTensor);
+            detail::dequantize(floatTensor, detail::view(quantizedTensor));
+        else if (isQ4Valid_)
+            kernels::dequantizeQ4(floatTensor.data(), detail::view(q4Tensor), 0, size_);
+        else if (isHalfValid_)
+            kernels::widen(floatTensor.data(), {halfIsBFloat16, halfTensor}, 0, size_);
         isFloatValid_ = true;
     }
 }
 
 QuantizedTensor &Tensor::q(GroupSize groupSize)
 {
+    detach();
+
     if (isQuantizedValid_ && groupSize != quantizedTensor.groupSize)
         throw std::runtime_error("Trying to re-quantize Tensor. It would result extremely slow performance!");
 
     ensureQuantized(groupSize);
 
     isFloatValid_ = false;
+    isQ4Valid_ = false;
+    isHalfValid_ = false;
     return quantizedTensor;
 }
 
-QuantizedTensor const &Tensor::cq() const
+QuantizedView Tensor::cq() const
 {
     if (!isQuantizedValid_)
         throw std::runtime_error("Trying to access invalid quantized tensor");
-    return quantizedTensor;
+    return isMapped_ ? mappedQuantized : detail::view(quantizedTensor);
 }
 
-QuantizedTensor const &Tensor::cq(GroupSize groupSize)
+QuantizedView Tensor::cq(GroupSize groupSize)
 {
+    if (isMapped_ && isQuantizedValid_)
+        return mappedQuantized;
+
+    detach();
     ensureQuantized(groupSize);
-    return quantizedTensor;
+    return detail::view(quantizedTensor);
+}
+
+Q4View Tensor::cq4() const
+{
+    if (!isQ4Valid_)
+        throw std::runtime_error("Trying to access invalid 4-bit tensor");
+    return isMapped_ ? mappedQ4 : detail::view(q4Tensor);
+}
+
+Q4View Tensor::cq4(GroupSize groupSize, bool withMin)
+{
+    if (isMapped_ && isQ4Valid_)
+        return mappedQ4;
+
+    detach();
+    ensureQ4(groupSize, withMin);
+    return detail::view(q4Tensor);
+}
+
+HalfView Tensor::ch() const
+{
+    if (!isHalfValid_)
+        throw std::runtime_error("Trying to access invalid 16-bit tensor");
+    return isMapped_ ? mappedHalf : HalfView{halfIsBFloat16, halfTensor};
+}
+
+HalfView Tensor::ch(bool bfloat16)
+{
+    if (isMapped_ && isHalfValid_)
+        return mappedHalf;
+
+    detach();
+    ensureHalf(bfloat16);
+    return {halfIsBFloat16, halfTensor};
 }
 
 void Tensor::ensureQuantized(GroupSize groupSize)
 {
     if (!isQuantizedValid_)
     {
+        // 4-bit and 16-bit values are converted through float
+        if (isQ4Valid_ || isHalfValid_)
+            ensureFloat();
+
         quantizedTensor.q.resize(size_);
         quantizedTensor.s.resize(size_ / groupSize);
         quantizedTensor.groupSize = groupSize;
 
         if (isFloatValid_)
-            detail::quantize(quantizedTensor, floatTensor, groupSize);
+        {
+            tracer.countConversion(Tracer::QUANTIZE, size_);
+            kernels::quantizeQ8(quantizedTensor.q.data(), quantizedTensor.s.data(), floatTensor.data(), size_,
+                                groupSize);
+        }
         isQuantizedValid_ = true;
     }
 }
 
+void Tensor::ensureQ4(GroupSize groupSize, bool withMin)
+{
+    if (!isQ4Valid_)
+    {
+        if (0 != groupSize % 32 || 0 != size_ % groupSize)
+            throw std::runtime_error("The group size of 4-bit values must be a multiple of 32");
+
+        ensureFloat();
+        tracer.countConversion(Tracer::QUANTIZE, size_);
+        kernels::quantizeQ4(q4Tensor, floatTensor, groupSize, withMin);
+        isQ4Valid_ = true;
+    }
+}
+
+void Tensor::ensureHalf(bool bfloat16)
+{
+    if (!isHalfValid_)
+    {
+        ensureFloat();
+        tracer.countConversion(Tracer::QUANTIZE, size_);
+        halfTensor.resize(size_);
+        halfIsBFloat16 = bfloat16;
+        for (size_t i = 0; i < size_; i++)
+            halfTensor[i] = bfloat16 ? kernels::toBFloat16(floatTensor[i]) : kernels::toFloat16(floatTensor[i]);
+        isHalfValid_ = true;
+    }
+}
+
 size_t Tensor::size() const { return size_; }
 
+void Tensor::resize(size_t size)
+{
+    if (size == size_)
+        return;
+
+    // used for buffers whose number of rows changes, the contents are not kept
+    detach();
+    size_ = size;
+    if (isFloatValid_)
+        floatTensor.resize(size_);
+    isQuantizedValid_ = false;
+    isQ4Valid_ = false;
+    isHalfValid_ = false;
+}
+
 bool Tensor::isQuantizedValid() const { return isQuantizedValid_; }
 
-void Tensor::readFromFile(std::ifstream &inputStream)
+bool Tensor::isQ4Valid() const { return isQ4Valid_; }
+
+bool Tensor::isHalfValid() const { return isHalfValid_; }
+
+bool Tensor::isMapped() const { return isMapped_; }
+
+void Tensor::readFromFile(CheckpointReader &reader)
+{
+    GroupSize field = reader.read<GroupSize>();
+    GroupSize groupSize = field & ((1u << formatShift) - 1);
+
+    if (0 == field)
+        readFloatFromFile(reader);
+    else if (Q8 == field >> formatShift)
+        readQuantizedFromFile(reader, groupSize);
+    else if (Q4 == field >> formatShift || Q4_MIN == field >> formatShift)
+        readQ4FromFile(reader, groupSize, Q4_MIN == field >> formatShift);
+    else if (F16 == field >> formatShift || BF16 == field >> formatShift)
+        readHalfFromFile(reader, BF16 == field >> formatShift);
+    else
+        throw std::runtime_error("Unknown tensor format " + std::to_string(field >> formatShift));
+}
+
+void Tensor::appendRows(Tensor const &source, size_t first, size_t n, size_t rowLength)
 {
-    GroupSize groupSize;
-    inputStream.read((char *)&groupSize, sizeof(groupSize));
+    // the formats are taken in the order Linear::forward() prefers them
+    if (0 == size_ && !isFloatValid_ && !isQuantizedValid_ && !isQ4Valid_ && !isHalfValid_)
+    {
+        if (source.isQuantizedValid_)
+            quantizedTensor = {source.cq().groupSize, {}, {}};
+        else if (source.isQ4Valid_)
+            q4Tensor = {source.cq4().groupSize, {}, {}, {}};
+        else if (source.isHalfValid_)
+            halfIsBFloat16 = source.ch().bfloat16;
+
+        isQuantizedValid_ = source.isQuantizedValid_;
+        isQ4Valid_ = !isQuantizedValid_ && source.isQ4Valid_;
+        isHalfValid_ = !isQuantizedValid_ && !isQ4Valid_ && source.isHalfValid_;
+        isFloatValid_ = !isQuantizedValid_ && !isQ4Valid_ && !isHalfValid_;
+    }
+
+    detach();
 
-    if (0 == groupSize)
-        readFloatFromFile(inputStream);
+    size_t begin = first * rowLength;
+    size_t count = n * rowLength;
+    auto append = [](auto &dest, auto const &values, size_t begin, size_t count)
+    { dest.insert(dest.end(), values.begin() + begin, values.begin() + begin + count); };
+
+    if (isQuantizedValid_)
+    {
+        if (!source.isQuantizedValid_ || source.cq().groupSize != quantizedTensor.groupSize)
+            throw std::runtime_error("Only tensors of the same format can be appended");
+
+        auto w = source.cq();
+        append(quantizedTensor.q, w.q, begin, count);
+        append(quantizedTensor.s, w.s, begin / w.groupSize, count / w.groupSize);
+    }
+    else if (isQ4Valid_)
+    {
+        if (!source.isQ4Valid_ || source.cq4().groupSize != q4Tensor.groupSize ||
+            (0 < size_ && source.cq4().min.empty() != q4Tensor.min.empty()))
+            throw std::runtime_error("Only tensors of the same format can be appended");
+
+        auto w = source.cq4();
+        append(q4Tensor.q, w.q, begin / 2, count / 2);
+        append(q4Tensor.s, w.s, begin / w.groupSize, count / w.groupSize);
+        if (!w.min.empty())
+            append(q4Tensor.min, w.min, begin / w.groupSize, count / w.groupSize);
+    }
+    else if (isHalfValid_)
+    {
+        if (!source.isHalfValid_ || source.ch().bfloat16 != halfIsBFloat16)
+            throw std::runtime_error("Only tensors of the same format can be appended");
+
+        append(halfTensor, source.ch().h, begin, count);
+    }
     else
-        readQuantizedFromFile(inputStream, groupSize);
+    {
+        if (source.isQuantizedValid_ || source.isQ4Valid_ || source.isHalfValid_)
+            throw std::runtime_error("Only tensors of the same format can be appended");
+
+        append(floatTensor, source.cf(), begin, count);
+    }
+
+    size_ += count;
 }
 
-void Tensor::readFloatFromFile(std::ifstream &inputStream)
+void Tensor::readFloatFromFile(CheckpointReader &reader)
 {
-    floatTensor.resize(size_);
-    inputStream.read((char *)floatTensor.data(), size_ * sizeof(float));
+    if (reader.canView<float>())
+    {
+        mappedFloat = reader.view<float>(size_);
+        isMapped_ = true;
+    }
+    else
+    {
+        floatTensor.resize(size_);
+        reader.read(floatTensor.data(), size_ * sizeof(float));
+    }
 
     isFloatValid_ = true;
     isQuantizedValid_ = false;
+    isQ4Valid_ = false;
+    isHalfValid_ = false;
 }
 
-void Tensor::readQuantizedFromFile(std::ifstream &inputStream, GroupSize groupSize)
+void Tensor::readQuantizedFromFile(CheckpointReader &reader, GroupSize groupSize)
 {
-    quantizedTensor.groupSize = groupSize;
-    quantizedTensor.q.resize(size_);
-    quantizedTensor.s.resize(size_ / groupSize);
+    // the scaling factors follow the int8 values
+    if (reader.canView<float>(size_))
+    {
+        mappedQuantized.groupSize = groupSize;
+        mappedQuantized.q = reader.view<int8_t>(size_);
+        mappedQuantized.s = reader.view<float>(size_ / groupSize);
+        isMapped_ = true;
+    }
+    else
+    {
+        quantizedTensor.groupSize = groupSize;
+        quantizedTensor.q.resize(size_);
+        quantizedTensor.s.resize(size_ / groupSize);
 
-    inputStream.read((char *)quantizedTensor.q.data(), size_ * sizeof(*quantizedTensor.q.data()));
-    inputStream.read((char *)quantizedTensor.s.data(), size_ / groupSize * sizeof(*quantizedTensor.s.data()));
+        reader.read(quantizedTensor.q.data(), size_ * sizeof(*quantizedTensor.q.data()));
+        reader.read(quantizedTensor.s.data(), size_ / groupSize * sizeof(*quantizedTensor.s.data()));
+    }
 
     isFloatValid_ = false;
     isQuantizedValid_ = true;
+    isQ4Valid_ = false;
+    isHalfValid_ = false;
+}
+
+void Tensor::readQ4FromFile(CheckpointReader &reader, GroupSize groupSize, bool withMin)
+{
+    if (0 == groupSize || 0 != groupSize % 32 || 0 != size_ % groupSize)
+        throw std::runtime_error("Bad group size of 4-bit tensor " + std::to_string(groupSize));
+
+    size_t nGroups = size_ / groupSize;
+
+    // the scales and mins follow the packed values
+    if (reader.canView<uint16_t>(size_ / 2))
+    {
+        mappedQ4.groupSize = groupSize;
+        mappedQ4.q = reader.view<uint8_t>(size_ / 2);
+        mappedQ4.s = reader.view<uint16_t>(nGroups);
+        mappedQ4.min = withMin ? reader.view<uint16_t>(nGroups) : std::span<uint16_t const>();
+        isMapped_ = true;
+    }
+    else
+    {
+        q4Tensor.groupSize = groupSize;
+        q4Tensor.q.resize(size_ / 2);
+        q4Tensor.s.resize(nGroups);
+        q4Tensor.min.resize(withMin ? nGroups : 0);
+
+        reader.read(q4Tensor.q.data(), q4Tensor.q.size() * sizeof(*q4Tensor.q.data()));
+        reader.read(q4Tensor.s.data(), q4Tensor.s.size() * sizeof(*q4Tensor.s.data()));
+        reader.read(q4Tensor.min.data(), q4Tensor.min.size() * sizeof(*q4Tensor.min.data()));
+    }
+
+    isFloatValid_ = false;
+    isQuantizedValid_ = false;
+    isQ4Valid_ = true;
+    isHalfValid_ = false;
+}
+
+void Tensor::readHalfFromFile(CheckpointReader &reader, bool bfloat16)
+{
+    if (reader.canView<uint16_t>())
+    {
+        mappedHalf = {bfloat16, reader.view<uint16_t>(size_)};
+        isMapped_ = true;
+    }
+    else
+    {
+        halfIsBFloat16 = bfloat16;
+        halfTensor.resize(size_);
+        reader.read(halfTensor.data(), size_ * sizeof(*halfTensor.data()));
+    }
+
+    isFloatValid_ = false;
+    isQuantizedValid_ = false;
+    isQ4Valid_ = false;
+    isHalfValid_ = true;
 }
 
 void Tensor::operator=(FloatTensor const &ft)
@@ -164,6 +450,9 @@ void Tensor::operator=(FloatTensor const &ft)
     floatTensor = ft;
     isFloatValid_ = true;
     isQuantizedValid_ = false;
+    isQ4Valid_ = false;
+    isHalfValid_ = false;
+    isMapped_ = false;
 }
 
 void Tensor::operator=(QuantizedTensor const &qt)
@@ -172,4 +461,7 @@ void Tensor::operator=(QuantizedTensor const &qt)
     quantizedTensor = qt;
     isFloatValid_ = false;
     isQuantizedValid_ = true;
+    isQ4Valid_ = false;
+    isHalfValid_ = false;
+    isMapped_ = false;
 }
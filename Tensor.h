@@ -2,10 +2,12 @@
 
 #include <fstream>
 #include <mutex>
+#include <span>
 #include <vector>
 
 #include <iostream>
 
+#include "CheckpointReader.h"
 #include "Logger.h"
 
 template <typename T> struct LoggingAllocator : std::allocator<T>
@@ -23,8 +25,39 @@ template <typename T> struct LoggingAllocator : std::allocator<T>
     }
 };
 
+// allocator for buffers that are streamed by the SIMD loops, aligned to the
+// cache line size
+template <typename T, std::size_t Alignment = 64> struct AlignedAllocator
+{
+    using value_type = T;
+
+    template <typename U> struct rebind
+    {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+    template <typename U> AlignedAllocator(AlignedAllocator<U, Alignment> const &) {}
+
+    T *allocate(std::size_t n)
+    {
+        logger(Logger::DEBUG) << "Allocating " << n << " aligned elements" << std::endl;
+        return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+    }
+
+    void deallocate(T *p, std::size_t n)
+    {
+        logger(Logger::DEBUG) << "Deallocating " << n << " aligned elements" << std::endl;
+        ::operator delete(p, std::align_val_t(Alignment));
+    }
+
+    template <typename U> bool operator==(AlignedAllocator<U, Alignment> const &) const { return true; }
+};
+
 using FloatTensor = std::vector<float, LoggingAllocator<float>>;
 using Int8Tensor = std::vector<int8_t, LoggingAllocator<int8_t>>;
+using UInt8Tensor = std::vector<uint8_t, LoggingAllocator<uint8_t>>;
+using Float16Tensor = std::vector<uint16_t, LoggingAllocator<uint16_t>>;
 
 using GroupSize = unsigned int;
 
@@ -35,40 +68,138 @@ struct QuantizedTensor
     FloatTensor s; // scaling factors
 };
 
+// read-only view of quantized values, which are either owned by a
+// QuantizedTensor or live in a memory mapped checkpoint
+struct QuantizedView
+{
+    GroupSize groupSize;
+    std::span<int8_t const> q;
+    std::span<float const> s;
+};
+
+// 4-bit quantized weights, two values per byte: in every block of 32 values
+// byte j holds value j in its low and value j + 16 in its high nibble, so a
+// block unpacks into one register of 32 values in order. Every group has an
+// fp16 scale, and optionally an fp16 min: a value is (nibble - 8) * scale, or
+// nibble * scale + min with mins. Group sizes are multiples of 32.
+struct Q4Tensor
+{
+    GroupSize groupSize;
+    UInt8Tensor q;     // packed nibbles
+    Float16Tensor s;   // scaling factors
+    Float16Tensor min; // offsets, empty for symmetric groups
+};
+
+struct Q4View
+{
+    GroupSize groupSize;
+    std::span<uint8_t const> q;
+    std::span<uint16_t const> s;
+    std::span<uint16_t const> min;
+};
+
+// float weights stored in 16 bits, as IEEE half precision or as bfloat16,
+// the upper half of a float32
+struct HalfView
+{
+    bool bfloat16;
+    std::span<uint16_t const> h;
+};
+
 class Tensor
 {
+public:
+    // The checkpoint stores the group size of a tensor in front of it, 0 for
+    // float32. Its upper bits select the format of the quantized values, or
+    // of 16-bit floats, which have no group size.
+    enum Format
+    {
+        Q8,
+        Q4,
+        Q4_MIN,
+        F16,
+        BF16,
+    };
+
+    static constexpr int formatShift = 16;
+
 public:
     Tensor(size_t size);
     Tensor(size_t size, bool initFloat);
 
+    // The values are accessed through write views, f() and q(), or read
+    // views, the c-prefixed ones. A write view makes its format the only
+    // valid one, so it is meant for producers only. A read view converts the
+    // values into its format if it is not valid yet and keeps the other
+    // formats valid, consumers use read views even on non-const tensors.
     FloatTensor &f();
-    FloatTensor const &cf();
+    std::span<float const> cf();
+    std::span<float const> cf() const;
 
     QuantizedTensor &q(GroupSize groupSize);
-    QuantizedTensor const &cq() const;
-    QuantizedTensor const &cq(GroupSize groupSize);
+    QuantizedView cq() const;
+    QuantizedView cq(GroupSize groupSize);
+
+    // 4-bit weights are read-only, they are loaded from a checkpoint or
+    // quantized from the float values
+    Q4View cq4() const;
+    Q4View cq4(GroupSize groupSize, bool withMin);
+
+    // 16-bit float weights are read-only as well
+    HalfView ch() const;
+    HalfView ch(bool bfloat16);
 
     size_t size() const;
+    void resize(size_t size);
+
     bool isQuantizedValid() const;
+    bool isQ4Valid() const;
+    bool isHalfValid() const;
+    bool isMapped() const;
 
-    void readFromFile(std::ifstream &inputStream);
+    void readFromFile(CheckpointReader &reader);
+
+    // appends the n rows of rowLength values of source from row first on,
+    // used to fuse weight matrices. An empty tensor takes the format of
+    // source, otherwise the formats have to agree.
+    void appendRows(Tensor const &source, size_t first, size_t n, size_t rowLength);
 
     void operator=(FloatTensor const &ft);
     void operator=(QuantizedTensor const &qt);
 
 private:
-    void readFloatFromFile(std::ifstream &inputStream);
-    void readQuantizedFromFile(std::ifstream &inputStream, GroupSize groupSize);
+    void readFloatFromFile(CheckpointReader &reader);
+    void readQuantizedFromFile(CheckpointReader &reader, GroupSize groupSize);
+    void readQ4FromFile(CheckpointReader &reader, GroupSize groupSize, bool withMin);
+    void readHalfFromFile(CheckpointReader &reader, bool bfloat16);
 
+    void detach();
     void ensureFloat();
     void ensureQuantized(GroupSize groupSize);
+    void ensureQ4(GroupSize groupSize, bool withMin);
+    void ensureHalf(bool bfloat16);
 
 private:
     size_t size_;
 
     bool isFloatValid_;
     bool isQuantizedValid_;
+    bool isQ4Valid_;
+    bool isHalfValid_;
+
+    // a mapped tensor is read-only and references the checkpoint
+    // directly, it is copied into the owned tensors on the first non-const
+    // access
+    bool isMapped_;
 
     FloatTensor floatTensor;
     QuantizedTensor quantizedTensor;
+    Q4Tensor q4Tensor;
+    Float16Tensor halfTensor;
+    bool halfIsBFloat16;
+
+    std::span<float const> mappedFloat;
+    QuantizedView mappedQuantized;
+    Q4View mappedQ4;
+    HalfView mappedHalf;
 };
\ No newline at end of file
@@ -0,0 +1,229 @@
+#include <algorithm>
+#include <chrono>
+
+#include <pthread.h>
+#include <sched.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "Logger.h"
+#include "ThreadPool.h"
+
+ThreadPool threadPool;
+
+namespace detail
+{
+
+// How long a waiting thread spins before it parks: longer than the gaps
+// between the regions of a token, short enough not to keep an idle CPU busy.
+// It is bounded by time because a pause takes from about 10 to 140 cycles,
+// depending on the CPU. The clock is read every spinCheck polls.
+constexpr auto spinTime = std::chrono::microseconds(100);
+constexpr size_t spinCheck = 64;
+
+// the pool and the index of the thread inside the region it is running
+thread_local ThreadPool const *currentPool = nullptr;
+thread_local size_t currentThread = 0;
+
+inline void pause()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#endif
+}
+
+// waits until the value differs from old, spinning first, then parking
+template <typename T> T waitWhileEqual(std::atomic<T> const &value, T old)
+{
+    std::chrono::steady_clock::time_point deadline;
+    for (size_t i = 1;; i++)
+    {
+        T v = value.load(std::memory_order_acquire);
+        if (v != old)
+            return v;
+        pause();
+
+        // short waits end before the clock is read
+        if (0 == i % spinCheck)
+        {
+            auto now = std::chrono::steady_clock::now();
+            if (spinCheck == i)
+                deadline = now + spinTime;
+            else if (deadline < now)
+                break;
+        }
+    }
+
+    T v;
+    while ((v = value.load(std::memory_order_acquire)) == old)
+        value.wait(old, std::memory_order_acquire);
+    return v;
+}
+
+inline void pin(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (0 != pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+        logger(Logger::INFO) << "could not pin thread to cpu " << cpu << std::endl;
+}
+
+// the CPUs the process may run on
+inline std::vector<int> availableCpus()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    if (0 == sched_getaffinity(0, sizeof(set), &set))
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+    }
+
+    if (cpus.empty())
+        for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); cpu++)
+            cpus.push_back(cpu);
+
+    return cpus;
+}
+
+} // namespace detail
+
+ThreadPool::ThreadPool()
+    : nThreads(1),
+      job(nullptr),
+      context(nullptr),
+      result(nullptr),
+      stopping(false),
+      generation(0),
+      pending(0),
+      barrierCount(0),
+      barrierPhase(0)
+{
+}
+
+ThreadPool::~ThreadPool() { stop(); }
+
+void ThreadPool::resize(size_t n, bool pin)
+{
+    std::lock_guard<std::mutex> lock(runMutex);
+
+    stop();
+
+    auto available = detail::availableCpus();
+    nThreads = 0 == n ? available.size() : n;
+
+    cpus.clear();
+    if (pin)
+    {
+        for (size_t i = 0; i < nThreads; i++)
+            cpus.push_back(available[i % available.size()]);
+        detail::pin(cpus[0]);
+    }
+
+    stopping = false;
+    for (size_t i = 1; i < nThreads; i++)
+        workers.emplace_back(&ThreadPool::worker, this, i, generation.load());
+
+    logger(Logger::DEBUG) << "thread pool: " << nThreads << " threads" << (pin ? ", pinned" : "") << std::endl;
+}
+
+size_t ThreadPool::size() const { return nThreads; }
+
+bool ThreadPool::inRegion() const { return this == detail::currentPool; }
+
+size_t ThreadPool::threadIndex() const { return detail::currentThread; }
+
+void ThreadPool::stop()
+{
+    if (workers.empty())
+        return;
+
+    stopping = true;
+    generation.fetch_add(1, std::memory_order_release);
+    generation.notify_all();
+
+    for (auto &w : workers)
+        w.join();
+
+    workers.clear();
+}
+
+void ThreadPool::worker(size_t thread, uint64_t seen)
+{
+    if (!cpus.empty())
+        detail::pin(cpus[thread]);
+
+    detail::currentPool = this;
+    detail::currentThread = thread;
+
+    while (true)
+    {
+        seen = detail::waitWhileEqual(generation, seen);
+
+        if (stopping)
+            return;
+
+        job(context, thread, nThreads);
+
+        if (1 == pending.fetch_sub(1, std::memory_order_acq_rel))
+            pending.notify_one();
+    }
+}
+
+void ThreadPool::runJob(Job j, void const *c)
+{
+    if (1 == nThreads)
+    {
+        // nothing is shared, regions of different threads run side by side
+        detail::currentPool = this;
+        detail::currentThread = 0;
+        j(c, 0, 1);
+        detail::currentPool = nullptr;
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(runMutex);
+
+    job = j;
+    context = c;
+
+    pending.store(nThreads - 1, std::memory_order_relaxed);
+    generation.fetch_add(1, std::memory_order_release);
+    generation.notify_all();
+
+    detail::currentPool = this;
+    detail::currentThread = 0;
+
+    job(context, 0, nThreads);
+
+    detail::currentPool = nullptr;
+
+    // wait for the workers to finish their part
+    size_t p;
+    while (0 != (p = pending.load(std::memory_order_acquire)))
+        detail::waitWhileEqual(pending, p);
+}
+
+void ThreadPool::barrier()
+{
+    if (1 == nThreads)
+        return;
+
+    uint64_t phase = barrierPhase.load(std::memory_order_acquire);
+
+    if (nThreads == barrierCount.fetch_add(1, std::memory_order_acq_rel) + 1)
+    {
+        // the last thread to arrive releases the others
+        barrierCount.store(0, std::memory_order_relaxed);
+        barrierPhase.fetch_add(1, std::memory_order_release);
+        barrierPhase.notify_all();
+    }
+    else
+        detail::waitWhileEqual(barrierPhase, phase);
+}
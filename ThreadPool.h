@@ -0,0 +1,149 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// ----------------------------------------------------------------------------
+// Persistent pool of inference threads, used instead of one OpenMP region
+// per loop. The workers stay alive between regions: after a region they spin
+// for a while, so the next one starts without a context switch, and only then
+// park on a futex. Workers can be pinned to the CPUs of the process.
+//
+// run() executes a function on all threads of the pool, the calling thread
+// being thread 0. Inside such a region the threads synchronize with
+// barrier(), and parallelFor() shares the iterations of a loop among them
+// followed by an implicit barrier, like an "omp for" inside "omp parallel".
+// Outside of a region parallelFor() opens its own region. This way a whole
+// layer can run as one region with barriers between its steps, while the
+// same kernels can still be called on their own. All threads have to reach
+// the same barriers, and the functions run in a region must not throw.
+//
+// single() runs a function on thread 0 of a region while the others wait,
+// and hands its result to all of them. It is meant for the steps that change
+// shared state, such as resizing a buffer or converting a Tensor, between
+// the parallel steps of a region.
+
+class ThreadPool
+{
+public:
+    ThreadPool();
+    ~ThreadPool();
+
+    ThreadPool(ThreadPool const &) = delete;
+    ThreadPool &operator=(ThreadPool const &) = delete;
+
+    // restarts the pool with nThreads threads including the calling thread,
+    // 0 uses all CPUs available to the process. With pin every thread is bound
+    // to one CPU, the calling thread to the first one.
+    void resize(size_t nThreads, bool pin);
+
+    size_t size() const;
+
+    template <typename F> void run(F const &f);
+    template <typename F> void parallelFor(size_t n, F const &f);
+    template <typename F> auto single(F const &f) -> decltype(f());
+
+    void barrier();
+
+    // the index of the calling thread in the region it runs, 0 outside of
+    // regions, e.g. to do something once per region
+    size_t threadIndex() const;
+
+private:
+    using Job = void (*)(void const *context, size_t thread, size_t nThreads);
+
+    template <typename F> static void invoke(void const *context, size_t thread, size_t nThreads);
+
+    void runJob(Job job, void const *context);
+    void worker(size_t thread, uint64_t seen);
+    void stop();
+
+    bool inRegion() const;
+
+private:
+    size_t nThreads;
+    std::vector<std::thread> workers;
+    std::vector<int> cpus; // the CPU of each thread when pinned, empty otherwise
+
+    // the regions started by different threads run one after the other, so
+    // concurrent callers do not gain from the pool, unless it is single
+    // threaded and every region runs on its caller
+    std::mutex runMutex;
+
+    Job job;
+    void const *context;
+    void const *result; // the result of single(), read by the other threads
+    bool stopping;
+
+    std::atomic<uint64_t> generation;   // incremented to start a region
+    std::atomic<size_t> pending;        // workers still running the current region
+    std::atomic<size_t> barrierCount;   // threads arrived at the current barrier
+    std::atomic<uint64_t> barrierPhase; // incremented when all threads arrived
+};
+
+extern ThreadPool threadPool;
+
+template <typename F> void ThreadPool::invoke(void const *context, size_t thread, size_t nThreads)
+{
+    (*static_cast<F const *>(context))(thread, nThreads);
+}
+
+template <typename F> void ThreadPool::run(F const &f)
+{
+    if (inRegion())
+    {
+        // already running on all threads of the pool
+        f(threadIndex(), nThreads);
+        barrier();
+    }
+    else
+        runJob(&invoke<F>, &f);
+}
+
+template <typename F> void ThreadPool::parallelFor(size_t n, F const &f)
+{
+    run(
+        [&f, n](size_t thread, size_t nThreads)
+        {
+            for (size_t i = n * thread / nThreads; i < n * (thread + 1) / nThreads; i++)
+                f(i);
+        });
+}
+
+template <typename F> auto ThreadPool::single(F const &f) -> decltype(f())
+{
+    using R = decltype(f());
+
+    if (!inRegion() || 1 == nThreads)
+        return f();
+
+    if constexpr (std::is_void_v<R>)
+    {
+        if (0 == threadIndex())
+            f();
+        barrier();
+    }
+    else
+    {
+        // thread 0 keeps its copy alive until all threads made theirs
+        std::optional<R> value;
+        if (0 == threadIndex())
+        {
+            value.emplace(f());
+            result = &*value;
+        }
+        barrier();
+
+        if (0 != threadIndex())
+            value.emplace(*static_cast<R const *>(result));
+        barrier();
+
+        return std::move(*value);
+    }
+}
@@ -1,7 +1,17 @@
 #include <algorithm>
+#include <array>
+#include <bit>
+#include <cctype>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
-#include <numeric>
+#include <queue>
+#include <stdexcept>
 
+#include <unistd.h>
+
+#include "CheckpointReader.h"
 #include "Tokenizer.h"
 
 void TokenQueue::push(int token) { std::list<int>::push_back(token); }
@@ -12,57 +22,265 @@ int TokenQueue::pop()
     return token;
 }
 
-bool Tokenizer::TokenIndex::operator<(Tokenizer::TokenIndex const &second) const { return *str < *second.str; }
-bool Tokenizer::TokenIndex::operator==(Tokenizer::TokenIndex const &second) const { return *str == *second.str; }
+namespace detail
+{
+
+// FNV-1a
+inline uint64_t hash(std::string_view str)
+{
+    uint64_t h = 0xcbf29ce484222325;
+    for (char c : str)
+    {
+        h ^= static_cast<unsigned char>(c);
+        h *= 0x100000001b3;
+    }
+    return h;
+}
+
+// the byte of a token of the form <0xXX>
+inline std::optional<uint8_t> parseByteToken(std::string_view piece)
+{
+    if (6 != piece.size() || !piece.starts_with("<0x") || '>' != piece[5])
+        return std::nullopt;
+
+    uint8_t value;
+    auto [end, error] = std::from_chars(piece.data() + 3, piece.data() + 5, value, 16);
+    if (std::errc() != error || piece.data() + 5 != end)
+        return std::nullopt;
+    return value;
+}
+
+// the length of the text without an incomplete UTF-8 sequence at its end,
+// invalid bytes count as complete so they can not stall the stream
+inline size_t completeUtf8(std::string_view text)
+{
+    // a sequence has at most 4 bytes, look for the start of the last one
+    size_t n = text.size();
+    for (size_t i = n; 0 < i && n - i < 4; i--)
+    {
+        auto c = static_cast<unsigned char>(text[i - 1]);
+        if (0x80 == (c & 0xc0))
+            continue;
+
+        size_t length = 0xc0 == (c & 0xe0) ? 2 : 0xe0 == (c & 0xf0) ? 3 : 0xf0 == (c & 0xf8) ? 4 : 1;
+        return n - (i - 1) < length ? i - 1 : n;
+    }
+    return n;
+}
+
+// the length of the longest end of the text that begins one of the strings
+inline size_t partialMatch(std::string_view text, std::vector<std::string> const &strings)
+{
+    size_t longest = 0;
+    for (auto const &s : strings)
+        for (size_t length = std::min(text.size(), s.size() - 1); longest < length; length--)
+            if (text.ends_with(std::string_view(s).substr(0, length)))
+            {
+                longest = length;
+                break;
+            }
+    return longest;
+}
+
+} // namespace detail
 
 Tokenizer::Tokenizer(std::string path, int vocabSize)
-    : vocabSize(vocabSize),
-      vocabScores(vocabSize)
+    : vocabSize(vocabSize)
 {
     for (int i = 0; i < 256; i++)
+        bytePieces[i] = static_cast<char>(i);
+
+    if (isCache(path))
     {
-        bytePieces[i * 2] = (unsigned char)i;
-        bytePieces[i * 2 + 1] = '\0';
+        auto mapping = std::make_shared<MappedFile>(path, false);
+        attach(reinterpret_cast<uint8_t const *>(mapping->data()), mapping->size());
+        storage = mapping;
     }
+    else
+    {
+        auto buffer = std::make_shared<std::vector<uint8_t>>(buildCache(path, vocabSize));
+        attach(buffer->data(), buffer->size());
+        storage = buffer;
+    }
+}
+
+bool Tokenizer::isCache(std::string const &path)
+{
+    uint32_t magic = 0;
+    std::ifstream(path, std::ios::binary).read(reinterpret_cast<char *>(&magic), sizeof(magic));
+    return cacheMagic == magic;
+}
+
+std::array<size_t, 5> Tokenizer::cacheLayout(CacheHeader const &header)
+{
+    auto align = [](size_t offset) { return (offset + cacheAlignment - 1) / cacheAlignment * cacheAlignment; };
+
+    std::array<size_t, 5> layout;
+    layout[0] = align(sizeof(CacheHeader));
+    layout[1] = align(layout[0] + header.vocabSize * sizeof(float));
+    layout[2] = align(layout[1] + (header.vocabSize + 1) * sizeof(uint32_t));
+    layout[3] = align(layout[2] + header.nSlots * sizeof(int));
+    layout[4] = layout[3] + header.arenaSize;
+    return layout;
+}
 
+std::vector<uint8_t> Tokenizer::buildCache(std::string const &path, int vocabSize)
+{
     std::ifstream inputStream(path, std::ios::binary);
+    if (!inputStream.is_open())
+        throw std::runtime_error("Can not open tokenizer " + path);
+
+    CacheHeader header{cacheMagic, cacheVersion, static_cast<uint32_t>(vocabSize), 0, 0, 0};
+    inputStream.read((char *)(&header.maxTokenLength), sizeof(header.maxTokenLength));
 
-    inputStream.read((char *)(&maxTokenLength), sizeof(maxTokenLength));
+    std::vector<float> scores(vocabSize);
+    std::vector<uint32_t> offsets{0};
+    std::vector<char> arena;
 
     for (int i = 0; i < vocabSize; i++)
     {
-        inputStream.read((char *)(&vocabScores[i]), sizeof(vocabScores[i]));
+        inputStream.read((char *)(&scores[i]), sizeof(scores[i]));
 
         int len;
         inputStream.read((char *)(&len), sizeof(len));
 
-        std::string str(len, ' ');
-        inputStream.read((char *)(&str[0]), len * sizeof(str[0]));
+        arena.resize(arena.size() + len);
+        inputStream.read(arena.data() + arena.size() - len, len);
 
-        vocab.push_back(str);
+        offsets.push_back(static_cast<uint32_t>(arena.size()));
     }
 
+    if (!inputStream)
+        throw std::runtime_error("Unexpected end of tokenizer " + path);
+
+    auto piece = [&](int token)
+    { return std::string_view(arena.data() + offsets[token], offsets[token + 1] - offsets[token]); };
+
+    // at most half of the slots are used, so the probe sequences stay short
+    size_t nSlots = std::bit_ceil(2 * static_cast<size_t>(vocabSize));
+    std::vector<int> index(nSlots, -1);
+
     for (int i = 0; i < vocabSize; i++)
-        sortedVocab.insert({&(vocab[i]), i});
+    {
+        size_t slot = detail::hash(piece(i)) & (nSlots - 1);
+
+        // of duplicate strings the first token is kept
+        while (0 <= index[slot] && piece(index[slot]) != piece(i))
+            slot = (slot + 1) & (nSlots - 1);
+
+        if (index[slot] < 0)
+            index[slot] = i;
+    }
+
+    header.arenaSize = static_cast<uint32_t>(arena.size());
+    header.nSlots = static_cast<uint32_t>(nSlots);
+
+    auto layout = cacheLayout(header);
+    std::vector<uint8_t> cache(layout[4], 0);
+
+    std::memcpy(cache.data(), &header, sizeof(header));
+    std::memcpy(cache.data() + layout[0], scores.data(), scores.size() * sizeof(float));
+    std::memcpy(cache.data() + layout[1], offsets.data(), offsets.size() * sizeof(uint32_t));
+    std::memcpy(cache.data() + layout[2], index.data(), index.size() * sizeof(int));
+    std::memcpy(cache.data() + layout[3], arena.data(), arena.size());
+
+    return cache;
 }
 
-std::optional<std::string> Tokenizer::decode(int token) const
+void Tokenizer::attach(uint8_t const *data, size_t size)
 {
-    std::string piece = vocab[token];
+    CacheHeader header;
+    if (size < sizeof(header))
+        throw std::runtime_error("Truncated tokenizer cache");
+    std::memcpy(&header, data, sizeof(header));
+
+    if (cacheMagic != header.magic || cacheVersion != header.version)
+        throw std::runtime_error("Unsupported tokenizer cache version " + std::to_string(header.version));
+
+    if (static_cast<uint32_t>(vocabSize) != header.vocabSize)
+        throw std::runtime_error("The tokenizer has " + std::to_string(header.vocabSize) + " tokens, the model " +
+                                 std::to_string(vocabSize));
+
+    // the lookups probe until an empty slot, with the slot taken modulo the
+    // power of two
+    if (!std::has_single_bit(header.nSlots))
+        throw std::runtime_error("Bad tokenizer cache: " + std::to_string(header.nSlots) + " index slots");
+
+    auto layout = cacheLayout(header);
+    if (size < layout[4])
+        throw std::runtime_error("Truncated tokenizer cache");
+
+    // the pieces and the index are used without bounds checks, a corrupt
+    // cache is rejected here, so that it is rebuilt
+    auto offsets = reinterpret_cast<uint32_t const *>(data + layout[1]);
+    for (uint32_t i = 0; i < header.vocabSize; i++)
+        if (offsets[i + 1] < offsets[i])
+            throw std::runtime_error("Bad tokenizer cache: the pieces are out of order");
+    if (header.arenaSize < offsets[header.vocabSize])
+        throw std::runtime_error("Bad tokenizer cache: the pieces exceed the arena");
+
+    auto index = reinterpret_cast<int const *>(data + layout[2]);
+    bool emptySlot = false;
+    for (uint32_t slot = 0; slot < header.nSlots; slot++)
+    {
+        if (index[slot] < -1 || vocabSize <= index[slot])
+            throw std::runtime_error("Bad tokenizer cache: index slot " + std::to_string(slot) + " holds token " +
+                                     std::to_string(index[slot]));
+        emptySlot = emptySlot || -1 == index[slot];
+    }
+    if (!emptySlot)
+        throw std::runtime_error("Bad tokenizer cache: the index has no empty slot");
 
-    // careful, some tokens designate raw bytes, and look like e.g. '<0x01>'
-    // parse this and convert and return the actual byte
-    unsigned char byte_val;
-    if (sscanf(piece.c_str(), "<0x%02hhX>", &byte_val) == 1)
-        piece = (char *)bytePieces + byte_val * 2;
+    maxTokenLength = header.maxTokenLength;
+    vocabScores = {reinterpret_cast<float const *>(data + layout[0]), header.vocabSize};
+    vocabOffsets = {reinterpret_cast<uint32_t const *>(data + layout[1]), header.vocabSize + 1};
+    vocabIndex = {reinterpret_cast<int const *>(data + layout[2]), header.nSlots};
+    vocabArena = {reinterpret_cast<char const *>(data + layout[3]), header.arenaSize};
 
-    if (piece[0] == '\0')
-        return std::nullopt;
+    byteTokens.assign(vocabSize, -1);
+    for (int i = 0; i < vocabSize; i++)
+        if (auto byte = detail::parseByteToken(piece(i)))
+            byteTokens[i] = *byte;
+}
 
-    if (piece[1] == '\0' && !(isprint(piece[0]) || isspace(piece[0])))
-        return std::nullopt;
+void Tokenizer::writeCache(std::string const &path) const
+{
+    auto layout = cacheLayout({cacheMagic, cacheVersion, static_cast<uint32_t>(vocabSize), maxTokenLength,
+                               static_cast<uint32_t>(vocabArena.size()), static_cast<uint32_t>(vocabIndex.size())});
+
+    // the sections are contiguous in the storage, starting at the header
+    auto data = reinterpret_cast<char const *>(vocabScores.data()) - layout[0];
+
+    // other processes may be reading the old file, write a new one and
+    // rename it over the old one
+    std::string tmpPath = path + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream out(tmpPath, std::ios::binary);
+        out.write(data, layout[4]);
+        if (!out)
+        {
+            std::remove(tmpPath.c_str());
+            throw std::runtime_error("Can not write tokenizer cache " + tmpPath);
+        }
+    }
 
-    return piece;
+    if (0 != std::rename(tmpPath.c_str(), path.c_str()))
+    {
+        std::remove(tmpPath.c_str());
+        throw std::runtime_error("Can not write tokenizer cache " + path);
+    }
+}
+
+std::string_view Tokenizer::piece(int token) const
+{
+    return {vocabArena.data() + vocabOffsets[token], vocabOffsets[token + 1] - vocabOffsets[token]};
+}
+
+std::string_view Tokenizer::bytes(int token) const
+{
+    if (0 <= byteTokens[token])
+        return {bytePieces + byteTokens[token], 1};
+    return piece(token);
 }
 
 TokenQueue Tokenizer::encode(std::string text, bool bos, bool eos) const
@@ -117,54 +335,231 @@ TokenQueue Tokenizer::encode(std::string text, bool bos, bool eos) const
     return tokens;
 }
 
-std::optional<int> Tokenizer::strLookUp(std::string str) const
+std::optional<int> Tokenizer::strLookUp(std::string_view str) const
 {
-    auto it = sortedVocab.find(TokenIndex{&str, -1});
-    if (it == sortedVocab.end())
-        return std::nullopt;
-    return it->id;
+    size_t mask = vocabIndex.size() - 1;
+
+    for (size_t slot = detail::hash(str) & mask; 0 <= vocabIndex[slot]; slot = (slot + 1) & mask)
+        if (piece(vocabIndex[slot]) == str)
+            return vocabIndex[slot];
+
+    return std::nullopt;
 }
 
 void Tokenizer::merge(TokenQueue &tokens) const
 {
-    struct MergeInfo
+    // The tokens are kept as a linked list over an array of symbols. A merge
+    // replaces the first symbol by the merged token and unlinks the others,
+    // so the order of the indices stays the order of the sequence.
+    struct Symbol
+    {
+        int token;
+        int prev;
+        int next;
+        unsigned version; // changes when the symbol is merged or unlinked
+    };
+
+    // a possible merge of length symbols starting at first, it is outdated
+    // as soon as the version of one of its symbols changes
+    struct Candidate
     {
         float score;
-        TokenQueue::iterator start;
+        int first;
         int length;
-        int newToken;
+        int token;
+        std::array<unsigned, 3> versions;
+
+        // the best merge has the highest score, ties go to the leftmost one
+        bool operator<(Candidate const &second) const
+        {
+            return score < second.score || (score == second.score && first > second.first);
+        }
     };
 
-    while (true)
+    using Queue = std::priority_queue<Candidate>;
+
+    if (tokens.empty())
+        return;
+
+    std::vector<Symbol> symbols;
+    symbols.reserve(tokens.size());
+    for (int token : tokens)
     {
-        std::optional<MergeInfo> mergeInfo;
+        int i = static_cast<int>(symbols.size());
+        symbols.push_back({token, i - 1, i + 1, 0});
+    }
+    symbols.back().next = -1;
+
+    std::string merged;
 
-        // merge the best consecutive pair or triple each iteration, according to the scores in vocab_scores
-        for (int l = 2; l <= 3 && !mergeInfo.has_value(); ++l)
+    // queues the merge of the length symbols from first, if it is a token
+    auto push = [&](Queue &queue, int first, int length)
+    {
+        Candidate candidate{0.0f, first, length, 0, {}};
+        merged.clear();
+
+        for (int k = 0, i = first; k < length; k++, i = symbols[i].next)
         {
-            auto it = tokens.begin();
-            for (int i = 0; i < static_cast<int>(tokens.size()) + 1 - l; i++, ++it)
-            {
-                // check if we can merge the sequence (tokens[i], tokens[i+l-1])
-                std::string merged =
-                    std::accumulate(std::next(it), std::next(it, l), vocab[*it],
-                                    [this](auto const &s, auto const &token) { return s + vocab[token]; });
+            if (i < 0)
+                return;
+            merged += piece(symbols[i].token);
+            candidate.versions[k] = symbols[i].version;
+        }
 
-                auto token = strLookUp(merged);
+        if (auto token = strLookUp(merged))
+        {
+            candidate.token = *token;
+            candidate.score = vocabScores[*token];
+            queue.push(candidate);
+        }
+    };
 
-                if (token && (!mergeInfo.has_value() || vocabScores[*token] > mergeInfo->score))
-                    // this merge sequence exists in vocab! record its score and position
-                    mergeInfo = {vocabScores[*token], it, l, *token};
-            }
+    // queues the merges of length symbols that contain the symbol i
+    auto pushAround = [&](Queue &queue, int i, int length)
+    {
+        int first = i;
+        for (int k = 1; k < length && 0 <= symbols[first].prev; k++)
+            first = symbols[first].prev;
+
+        for (; 0 <= first; first = symbols[first].next)
+        {
+            push(queue, first, length);
+            if (first == i)
+                break;
         }
-        if (mergeInfo.has_value())
+    };
+
+    // the best merge of the queue that is still valid
+    auto best = [&](Queue &queue) -> std::optional<Candidate>
+    {
+        while (!queue.empty())
         {
-            *(mergeInfo->start) = mergeInfo->newToken;
-            // delete token(s) at position best_idx+1 (and optionally best_idx+2),
-            // shift the entire sequence back
-            tokens.erase(std::next(mergeInfo->start), std::next(mergeInfo->start, mergeInfo->length));
+            Candidate candidate = queue.top();
+            queue.pop();
+
+            bool valid = true;
+            for (int k = 0, i = candidate.first; valid && k < candidate.length; k++, i = symbols[i].next)
+                valid = 0 <= i && symbols[i].version == candidate.versions[k];
+
+            if (valid)
+                return candidate;
         }
-        else
+        return std::nullopt;
+    };
+
+    Queue pairs;
+    Queue triples;
+    bool triplesQueued = false;
+
+    for (int i = 0; 0 <= i; i = symbols[i].next)
+        push(pairs, i, 2);
+
+    // merge the best consecutive pair each iteration, according to the
+    // scores in vocab_scores, and only when no pair is left the best triple
+    while (true)
+    {
+        auto merge = best(pairs);
+
+        if (!merge.has_value())
+        {
+            if (!triplesQueued)
+            {
+                for (int i = 0; 0 <= i; i = symbols[i].next)
+                    push(triples, i, 3);
+                triplesQueued = true;
+            }
+
+            merge = best(triples);
+        }
+
+        if (!merge.has_value())
             break;
+
+        // replace the first symbol by the merged token and unlink the others
+        Symbol &first = symbols[merge->first];
+        int next = first.next;
+        for (int k = 1; k < merge->length; k++, next = symbols[next].next)
+            symbols[next].version++;
+
+        first.token = merge->token;
+        first.version++;
+        first.next = next;
+        if (0 <= next)
+            symbols[next].prev = merge->first;
+
+        // the merged token forms new pairs and triples with its neighbours
+        pushAround(pairs, merge->first, 2);
+        if (triplesQueued)
+            pushAround(triples, merge->first, 3);
     }
+
+    tokens.clear();
+    for (int i = 0; 0 <= i; i = symbols[i].next)
+        tokens.push_back(symbols[i].token);
+}
+
+// ----------------------------------------------------------------------------
+// StreamDecoder
+
+StreamDecoder::StreamDecoder(Tokenizer const &tokenizer, std::vector<std::string> stopStrings)
+    : tokenizer(tokenizer),
+      stopStrings(std::move(stopStrings)),
+      stopped(false)
+{
+    std::erase_if(this->stopStrings, [](std::string const &s) { return s.empty(); });
+
+    // held back are at most a stop string and a character
+    size_t longest = 0;
+    for (auto const &s : this->stopStrings)
+        longest = std::max(longest, s.size());
+    pending.reserve(longest + 256);
+}
+
+bool StreamDecoder::decode(int token, std::string &out)
+{
+    if (stopped)
+        return true;
+
+    auto bytes = tokenizer.bytes(token);
+    if (1 == bytes.size())
+    {
+        auto c = static_cast<unsigned char>(bytes[0]);
+        if (c < 0x80 && !(isprint(c) || isspace(c)))
+            return false;
+    }
+    pending.append(bytes);
+
+    // the pending text was held back because it may begin a stop string, so
+    // a stop string can only start in it
+    size_t stop = std::string::npos;
+    for (auto const &s : stopStrings)
+        stop = std::min(stop, pending.find(s));
+
+    if (std::string::npos != stop)
+    {
+        out.append(pending, 0, stop);
+        pending.clear();
+        stopped = true;
+        return true;
+    }
+
+    size_t complete = detail::completeUtf8(pending);
+    size_t ready = complete - detail::partialMatch(std::string_view(pending).substr(0, complete), stopStrings);
+
+    out.append(pending, 0, ready);
+    pending.erase(0, ready);
+    return false;
+}
+
+void StreamDecoder::flush(std::string &out)
+{
+    if (!stopped)
+        out.append(pending);
+    pending.clear();
+}
+
+void StreamDecoder::reset()
+{
+    pending.clear();
+    stopped = false;
 }
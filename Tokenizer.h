@@ -1,15 +1,22 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <list>
+#include <memory>
 #include <optional>
-#include <set>
+#include <span>
 #include <string>
+#include <string_view>
 #include <vector>
 
-#include "Tensor.h"
-
 // ----------------------------------------------------------------------------
 // The Byte Pair Encoding (BPE) Tokenizer that translates strings <-> tokens
+//
+// The vocabulary is kept in a precompiled layout: the scores, the offsets of
+// the token strings in one arena, and the hash index of the strings. It is
+// either built when reading a tokenizer.bin, or mapped zero-copy from a file
+// written by writeCache(), the format is told apart by its magic number.
 
 class TokenQueue : public std::list<int>
 {
@@ -23,30 +30,100 @@ class Tokenizer
 public:
     Tokenizer(std::string path, int vocabSize);
 
-    std::optional<std::string> decode(int token) const;
     TokenQueue encode(std::string text, bool bos, bool eos) const;
 
+    // writes the precompiled tokenizer, the file is replaced atomically
+    void writeCache(std::string const &path) const;
+
+    static bool isCache(std::string const &path);
+
+    // the bytes a token stands for, the byte tokens like <0x0A> are resolved
+    // to their byte
+    std::string_view bytes(int token) const;
+
 private:
-    struct TokenIndex
+    struct CacheHeader
     {
-        std::string const *str;
-        int id;
-
-        bool operator<(Tokenizer::TokenIndex const &second) const;
-        bool operator==(Tokenizer::TokenIndex const &second) const;
+        uint32_t magic;
+        uint32_t version;
+        uint32_t vocabSize;
+        uint32_t maxTokenLength;
+        uint32_t arenaSize;
+        uint32_t nSlots;
     };
 
-    std::optional<int> strLookUp(std::string str) const;
+    static constexpr uint32_t cacheMagic = 0x746b3432; // "tk42"
+    static constexpr uint32_t cacheVersion = 1;
+    static constexpr size_t cacheAlignment = 64;
+
+    // the offsets of the sections of the precompiled tokenizer, each aligned
+    // to cacheAlignment: scores, string offsets, hash index, string arena, end
+    static std::array<size_t, 5> cacheLayout(CacheHeader const &header);
+
+    // reads a tokenizer.bin into the precompiled layout
+    static std::vector<uint8_t> buildCache(std::string const &path, int vocabSize);
+
+    // points the vocabulary into the precompiled layout
+    void attach(uint8_t const *data, size_t size);
+
+    std::string_view piece(int token) const;
+    std::optional<int> strLookUp(std::string_view str) const;
 
     void merge(TokenQueue &tokens) const;
 
 private:
     int vocabSize;
-    FloatTensor vocabScores;
 
-    unsigned char bytePieces[512];
+    char bytePieces[256];
+
+    // the byte of the tokens of the form <0xXX>, -1 for the other tokens
+    std::vector<int16_t> byteTokens;
     unsigned int maxTokenLength;
 
-    std::vector<std::string> vocab;
-    std::set<TokenIndex> sortedVocab;
-};
\ No newline at end of file
+    // keeps the precompiled tokenizer alive, either the mapped cache file or
+    // the buffer built from tokenizer.bin
+    std::shared_ptr<void const> storage;
+
+    std::span<float const> vocabScores;
+
+    // the token strings one after the other, token i is
+    // vocabArena[vocabOffsets[i], vocabOffsets[i + 1])
+    std::span<char const> vocabArena;
+    std::span<uint32_t const> vocabOffsets;
+
+    // open addressing hash table of the token ids by their string (FNV-1a),
+    // with linear probing, -1 marks an empty slot
+    std::span<int const> vocabIndex;
+};
+
+// ----------------------------------------------------------------------------
+// Turns the generated tokens into text as they come. The bytes of the tokens
+// are appended to a buffer of the caller, except for a UTF-8 character split
+// over several tokens, which is held back until its last byte arrives, and for
+// text that may be the beginning of a stop string, which is held back until
+// the following tokens tell whether it is one. Lone control characters are
+// dropped.
+
+class StreamDecoder
+{
+public:
+    StreamDecoder(Tokenizer const &tokenizer, std::vector<std::string> stopStrings = {});
+
+    // appends the text completed by token to out. Returns true once a stop
+    // string is complete, the text in front of it is the last one appended.
+    bool decode(int token, std::string &out);
+
+    // appends the text held back at the end of the stream, an incomplete
+    // UTF-8 character as is
+    void flush(std::string &out);
+
+    // starts a new stream
+    void reset();
+
+private:
+    Tokenizer const &tokenizer;
+    std::vector<std::string> stopStrings;
+
+    std::string pending; // the text held back
+    bool stopped;
+};
@@ -0,0 +1,231 @@
+#include <algorithm>
+#include <bit>
+#include <iomanip>
+
+#include "Tracer.h"
+
+Tracer tracer;
+
+namespace detail
+{
+
+// the layer of the ops traced by this thread
+thread_local int currentLayer = -1;
+
+} // namespace detail
+
+size_t Tracer::Histogram::bucket(uint64_t ns)
+{
+    if (ns < 8)
+        return ns;
+
+    size_t exponent = std::bit_width(ns) - 1;
+    return 8 + (exponent - 3) * 8 + ((ns >> (exponent - 3)) & 7);
+}
+
+uint64_t Tracer::Histogram::lowerBound(size_t bucket)
+{
+    if (bucket < 8)
+        return bucket;
+
+    size_t exponent = (bucket - 8) / 8 + 3;
+    return (8 + (bucket - 8) % 8) << (exponent - 3);
+}
+
+void Tracer::Histogram::add(uint64_t ns)
+{
+    buckets[bucket(ns)]++;
+    count++;
+    total += ns;
+    max = std::max(max, ns);
+}
+
+uint64_t Tracer::Histogram::percentile(double p) const
+{
+    // the middle of the bucket holding the p-th percentile
+    uint64_t rank = static_cast<uint64_t>(p * count);
+    uint64_t seen = 0;
+
+    for (size_t b = 0; b < nBuckets; b++)
+    {
+        seen += buckets[b];
+        if (rank < seen)
+            return std::min(max, (lowerBound(b) + (b + 1 < nBuckets ? lowerBound(b + 1) : max)) / 2);
+    }
+
+    return max;
+}
+
+Tracer::Tracer()
+    : enabled(false),
+      recordEvents(false),
+      maxEvents(0),
+      epoch(Clock::now()),
+      conversions{},
+      convertedValues{},
+      tokens(0)
+{
+}
+
+void Tracer::enable(bool events, size_t max)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    enabled = true;
+    recordEvents = events;
+    maxEvents = max;
+}
+
+void Tracer::disable() { enabled = false; }
+
+bool Tracer::isEnabled() const { return enabled; }
+
+void Tracer::setLayer(int l) { detail::currentLayer = l; }
+
+void Tracer::record(Op op, Clock::time_point start, Clock::time_point end)
+{
+    uint64_t duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    histograms[op].add(duration);
+
+    if (recordEvents && events.size() < maxEvents)
+    {
+        uint64_t offset = std::chrono::duration_cast<std::chrono::nanoseconds>(start - epoch).count();
+        events.push_back({op, detail::currentLayer, offset, duration});
+    }
+}
+
+void Tracer::reset()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    histograms = {};
+    events.clear();
+
+    for (size_t c = 0; c < N_CONVERSIONS; c++)
+    {
+        conversions[c] = 0;
+        convertedValues[c] = 0;
+    }
+    tokens = 0;
+}
+
+void Tracer::countConversion(Conversion conversion, size_t n)
+{
+    if (!enabled)
+        return;
+
+    conversions[conversion].fetch_add(1, std::memory_order_relaxed);
+    convertedValues[conversion].fetch_add(n, std::memory_order_relaxed);
+}
+
+void Tracer::countTokens(size_t n)
+{
+    if (enabled)
+        tokens.fetch_add(n, std::memory_order_relaxed);
+}
+
+void Tracer::writeSummary(std::ostream &out) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto flags = out.flags();
+
+    out << std::left << std::setw(16) << "op" << std::right << std::setw(10) << "calls" << std::setw(12) << "total ms"
+        << std::setw(10) << "mean us" << std::setw(10) << "p50 us" << std::setw(10) << "p90 us" << std::setw(10)
+        << "p99 us" << std::setw(10) << "max us" << std::endl;
+
+    out << std::fixed << std::setprecision(1);
+    for (size_t op = 0; op < N_OPS; op++)
+    {
+        Histogram const &h = histograms[op];
+        if (0 == h.count)
+            continue;
+
+        out << std::left << std::setw(16) << name(static_cast<Op>(op)) << std::right << std::setw(10) << h.count
+            << std::setw(12) << h.total * 1e-6 << std::setw(10) << h.total * 1e-3 / h.count << std::setw(10)
+            << h.percentile(0.5) * 1e-3 << std::setw(10) << h.percentile(0.9) * 1e-3 << std::setw(10)
+            << h.percentile(0.99) * 1e-3 << std::setw(10) << h.max * 1e-3 << std::endl;
+    }
+
+    // the activations should be quantized once per matmul input, anything
+    // beyond shows a format conversion in the hot path
+    if (0 < tokens)
+    {
+        out << std::endl
+            << std::left << std::setw(16) << "conversion" << std::right << std::setw(14) << "calls/token"
+            << std::setw(14) << "values/token" << std::endl;
+        for (size_t c = 0; c < N_CONVERSIONS; c++)
+            out << std::left << std::setw(16) << (QUANTIZE == c ? "quantize" : "dequantize") << std::right
+                << std::setw(14) << static_cast<double>(conversions[c]) / tokens << std::setw(14)
+                << static_cast<double>(convertedValues[c]) / tokens << std::endl;
+    }
+
+    out.flags(flags);
+}
+
+void Tracer::writeChromeTrace(std::ostream &out) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto flags = out.flags();
+
+    // complete events ("ph": "X") with timestamps in microseconds
+    out << "{\"traceEvents\": [" << std::fixed << std::setprecision(3);
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        Event const &e = events[i];
+
+        out << (0 < i ? "," : "") << "\n{\"name\": \"" << name(e.op) << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": 0"
+            << ", \"ts\": " << e.start * 1e-3 << ", \"dur\": " << e.duration * 1e-3;
+        if (0 <= e.layer && LAYER <= e.op && e.op <= W2)
+            out << ", \"args\": {\"layer\": " << e.layer << "}";
+        out << "}";
+    }
+    out << "\n]}" << std::endl;
+
+    out.flags(flags);
+}
+
+char const *Tracer::name(Op op)
+{
+    switch (op)
+    {
+    case FORWARD:
+        return "forward";
+    case EMBED:
+        return "embed";
+    case LAYER:
+        return "layer";
+    case ATTENTION_NORM:
+        return "attention_norm";
+    case QKV:
+        return "qkv";
+    case ROPE:
+        return "rope";
+    case ATTENTION:
+        return "attention";
+    case WO:
+        return "wo";
+    case FFN_NORM:
+        return "ffn_norm";
+    case W1_W3:
+        return "w1_w3";
+    case SWIGLU:
+        return "swiglu";
+    case W2:
+        return "w2";
+    case FINAL_NORM:
+        return "final_norm";
+    case CLASSIFIER:
+        return "classifier";
+    case SAMPLING:
+        return "sampling";
+    case N_OPS:
+        break;
+    }
+
+    return "unknown";
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// The tracer is compiled in unless LLAMA3_TRACING is defined to 0, in which
+// case Tracer::Scope is empty and the instrumentation costs nothing. When
+// compiled in, it is off until enabled at runtime and a scope then costs a
+// single branch.
+#ifndef LLAMA3_TRACING
+#define LLAMA3_TRACING 1
+#endif
+
+// ----------------------------------------------------------------------------
+// Records the duration of the operations of a forward pass: every op gets a
+// histogram of its durations, summarized by writeSummary(), and optionally
+// every single call is kept as an event for a Chrome trace (chrome://tracing
+// or https://ui.perfetto.dev). The scopes are opened by the thread driving
+// the inference, inside a parallel region only by its thread 0, which
+// passes the same barriers as the others.
+
+class Tracer
+{
+public:
+    enum Op
+    {
+        FORWARD, // a forwardBatch call
+        EMBED,
+        LAYER,
+        ATTENTION_NORM,
+        QKV,
+        ROPE,
+        ATTENTION,
+        WO,
+        FFN_NORM,
+        W1_W3,
+        SWIGLU,
+        W2,
+        FINAL_NORM,
+        CLASSIFIER,
+        SAMPLING,
+        N_OPS,
+    };
+
+    // conversions of the values of a Tensor between its formats
+    enum Conversion
+    {
+        QUANTIZE,   // float32 to int8 groups, 4 bits or 16-bit floats
+        DEQUANTIZE, // back to float32
+        N_CONVERSIONS,
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+#if LLAMA3_TRACING
+    // times the enclosing block as op, if tracing is enabled and active
+    class Scope
+    {
+    public:
+        Scope(Op op, bool active = true);
+        ~Scope();
+
+        Scope(Scope const &) = delete;
+        Scope &operator=(Scope const &) = delete;
+
+    private:
+        Op op;
+        bool active;
+        Clock::time_point start;
+    };
+#else
+    class Scope
+    {
+    public:
+        Scope(Op, bool = true) {}
+    };
+#endif
+
+public:
+    Tracer();
+
+    // records the op durations, and with events also every single call for
+    // the Chrome trace, up to maxEvents calls
+    void enable(bool events, size_t maxEvents = 1 << 20);
+    void disable();
+    bool isEnabled() const;
+
+    // the layer the following ops of the calling thread belong to, -1 outside
+    // of the layers
+    void setLayer(int layer);
+
+    void record(Op op, Clock::time_point start, Clock::time_point end);
+    void reset();
+
+    // counts a conversion of n values and the tokens forwarded, the summary
+    // reports the conversions per token. Both only count while enabled.
+    void countConversion(Conversion conversion, size_t n);
+    void countTokens(size_t n);
+
+    void writeSummary(std::ostream &out) const;
+    void writeChromeTrace(std::ostream &out) const;
+
+    static char const *name(Op op);
+
+private:
+    // durations in nanoseconds in buckets of 8 per power of two, so every
+    // bucket covers at most 12.5% of its lower bound
+    struct Histogram
+    {
+        static constexpr size_t nBuckets = 8 + 61 * 8;
+
+        std::array<uint64_t, nBuckets> buckets{};
+        uint64_t count = 0;
+        uint64_t total = 0;
+        uint64_t max = 0;
+
+        void add(uint64_t ns);
+        uint64_t percentile(double p) const;
+
+        static size_t bucket(uint64_t ns);
+        static uint64_t lowerBound(size_t bucket);
+    };
+
+    struct Event
+    {
+        Op op;
+        int layer;
+        uint64_t start; // ns since the epoch of the tracer
+        uint64_t duration;
+    };
+
+private:
+    bool enabled;
+    bool recordEvents;
+    size_t maxEvents;
+
+    Clock::time_point epoch;
+    std::array<Histogram, N_OPS> histograms;
+    std::vector<Event> events;
+
+    // calls and values of every conversion, counted by any thread
+    std::array<std::atomic<uint64_t>, N_CONVERSIONS> conversions;
+    std::array<std::atomic<uint64_t>, N_CONVERSIONS> convertedValues;
+    std::atomic<uint64_t> tokens;
+
+    mutable std::mutex mutex;
+};
+
+extern Tracer tracer;
+
+#if LLAMA3_TRACING
+inline Tracer::Scope::Scope(Op op, bool active)
+    : op(op),
+      active(active && tracer.isEnabled())
+{
+    if (this->active)
+        start = Clock::now();
+}
+
+inline Tracer::Scope::~Scope()
+{
+    if (active)
+        tracer.record(op, start, Clock::now());
+}
+#endif
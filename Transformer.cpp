@@ -1,69 +1,318 @@
 #include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <numeric>
 
+#include <unistd.h>
+
+#include "Tracer.h"
 #include "Transformer.h"
+#include "kernels.h"
+
+// ----------------------------------------------------------------------------
+// Sequence
+
+Sequence::Sequence(Config const &config, KVCache::Type kvType)
+    : config(config),
+      caches(config.nLayers, KVCache(config.seqLength, config.nKVHeads, config.dim / config.nHeads, kvType))
+{
+}
+
+size_t Sequence::position() const { return caches.front().position(); }
+
+size_t Sequence::nLayers() const { return caches.size(); }
+
+KVCache &Sequence::cache(size_t layer) { return caches[layer]; }
+
+KVCache const &Sequence::cache(size_t layer) const { return caches[layer]; }
+
+void Sequence::save(std::string const &path, std::span<int const> tokens, KVCache::Type type) const
+{
+    // the positions still in the caches
+    size_t pos = position();
+    size_t first = 0 < pos ? caches.front().windowStart(pos - 1) : 0;
+
+    SessionHeader header{sessionMagic,    sessionVersion, config.dim, config.nLayers, config.nHeads, config.nKVHeads,
+                         uint32_t(type),  0,              pos,        first,          tokens.size()};
+
+    // the header, the tokens and the rows of every layer, each aligned
+    auto align = [](size_t n) { return (n + sessionAlignment - 1) / sessionAlignment * sessionAlignment; };
+    size_t tokensOffset = align(sizeof(header));
+    size_t rowsOffset = align(tokensOffset + tokens.size_bytes());
+    size_t layerBytes = caches.front().bytes(pos - first, type);
+
+    std::vector<uint8_t> data(rowsOffset + caches.size() * layerBytes);
+    std::memcpy(data.data(), &header, sizeof(header));
+    std::memcpy(data.data() + tokensOffset, tokens.data(), tokens.size_bytes());
+    for (size_t l = 0; l < caches.size(); l++)
+        caches[l].copyRows(first, pos - first, data.data() + rowsOffset + l * layerBytes, type);
+
+    // write a new file and rename it over the old one, which stays intact
+    // if anything fails
+    std::string tmpPath = path + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream out(tmpPath, std::ios::binary);
+        out.write(reinterpret_cast<char const *>(data.data()), data.size());
+        if (!out)
+        {
+            std::remove(tmpPath.c_str());
+            throw std::runtime_error("Can not write session " + tmpPath);
+        }
+    }
+
+    if (0 != std::rename(tmpPath.c_str(), path.c_str()))
+    {
+        std::remove(tmpPath.c_str());
+        throw std::runtime_error("Can not write session " + path);
+    }
+}
+
+std::vector<int> Sequence::load(std::string const &path)
+{
+    if (0 != position())
+        throw std::runtime_error("A session can only be loaded into an empty sequence");
+
+    MappedFile file(path, false);
+
+    SessionHeader header;
+    if (file.size() < sizeof(header))
+        throw std::runtime_error("Truncated session " + path);
+    std::memcpy(&header, file.data(), sizeof(header));
+
+    if (sessionMagic != header.magic || sessionVersion != header.version)
+        throw std::runtime_error("Not a session file " + path);
+    if (header.dim != config.dim || header.nLayers != config.nLayers || header.nHeads != config.nHeads ||
+        header.nKVHeads != config.nKVHeads)
+        throw std::runtime_error("The session " + path + " belongs to a different model");
+    if (KVCache::Q8 < header.kvType || header.position < header.first)
+        throw std::runtime_error("Bad session " + path);
+
+    auto type = static_cast<KVCache::Type>(header.kvType);
+    auto align = [](size_t n) { return (n + sessionAlignment - 1) / sessionAlignment * sessionAlignment; };
+    size_t tokensOffset = align(sizeof(header));
+    size_t nRows = header.position - header.first;
+
+    // the counts are bounded by the file size first, so that the sizes
+    // computed from them can not overflow, every row takes at least a byte
+    if (file.size() < tokensOffset || (file.size() - tokensOffset) / sizeof(int) < header.nTokens ||
+        file.size() < nRows)
+        throw std::runtime_error("Truncated session " + path);
+
+    size_t rowsOffset = align(tokensOffset + header.nTokens * sizeof(int));
+    size_t layerBytes = caches.front().bytes(nRows, type);
+
+    if (file.size() < rowsOffset + caches.size() * layerBytes)
+        throw std::runtime_error("Truncated session " + path);
+
+    std::vector<int> tokens(header.nTokens);
+    std::memcpy(tokens.data(), file.data() + tokensOffset, tokens.size() * sizeof(int));
+
+    // a shorter context keeps the last positions only
+    size_t skip = nRows - std::min<size_t>(nRows, config.seqLength);
+    for (size_t l = 0; l < caches.size(); l++)
+    {
+        auto rows = reinterpret_cast<uint8_t const *>(file.data()) + rowsOffset + l * layerBytes;
+        caches[l].reset(header.first + skip);
+        caches[l].appendRows(rows + caches[l].bytes(skip, type), nRows - skip, type);
+    }
+
+    return tokens;
+}
+
+// ----------------------------------------------------------------------------
+// InferenceContext
+
+InferenceContext::InferenceContext(Config const &config, KVCache::Type kvType)
+    : config(config),
+      kvType(kvType),
+      layers(config.seqLength, config.dim, config.nHeads, config.nKVHeads, config.hiddenDim, config.rope),
+      x(config.dim, true),
+      xb(config.dim, true),
+      xLast(config.dim),
+      xbLast(config.dim)
+{
+}
+
+Sequence &InferenceContext::sequence()
+{
+    if (!sequence_)
+        sequence_ = std::make_unique<Sequence>(config, kvType);
+    return *sequence_;
+}
+
+// ----------------------------------------------------------------------------
+// Transformer
 
 Transformer::Transformer(Config config)
     : config(std::move(config)),
       tokenEmbeddingTable(config.vocabSize * config.dim),
-      layers(config.nLayers,
-             TransformerBlock(config.seqLength, config.dim, config.nHeads, config.nKVHeads, config.hiddenDim)),
+      layers(config.nLayers, TransformerBlock(config.dim, config.nHeads, config.nKVHeads, config.hiddenDim)),
       finalNorm(config.dim),
-      output(config.dim, config.vocabSize),
-      x(config.dim),
-      xb(config.dim),
-      logits(config.vocabSize)
+      output(config.dim, config.vocabSize)
 {
 }
 
-void Transformer::loadWeights(std::ifstream &inputStream)
+void Transformer::loadWeights(CheckpointReader &reader)
 {
-    // Read tokenEmbeddingTable which might serve as the weights of
-    // the classifier when sharedClassifier is true.
-    Tensor tet(config.vocabSize * config.dim);
-    tet.readFromFile(inputStream);
+    mapping = reader.mapping();
 
-    // We always use f32 for tokenEmbeddingTable, but we might use the
-    // quantized values for the classifier so keep them valid by
-    // using the const version of f().
-    this->tokenEmbeddingTable = tet.cf();
+    // Read tokenEmbeddingTable which might serve as the weights of
+    // the classifier when sharedClassifier is true. It is kept in the
+    // format of the checkpoint, quantized rows are converted to f32
+    // one token at a time in forward().
+    tokenEmbeddingTable.readFromFile(reader);
 
     for (int i = 0; i < config.nLayers; ++i)
-        layers[i].loadWeights(inputStream);
+        layers[i].loadWeights(reader);
 
-    finalNorm.loadWeights(inputStream);
+    finalNorm.loadWeights(reader);
 
     if (config.sharedClassifier)
-        if (tet.isQuantizedValid())
-            output.setWeights(tet.cq());
-        else
-            output.setWeights(tet.f());
+        output.setWeights(tokenEmbeddingTable);
     else
-        output.loadWeights(inputStream);
+        output.loadWeights(reader);
+}
+
+void Transformer::forward(InferenceContext &context, int token, Tensor &logits) const
+{
+    forwardBatch(context, std::span<int const>(&token, 1), logits);
+}
+
+void Transformer::forwardBatch(InferenceContext &context, std::span<int const> tokens, Tensor &logits) const
+{
+    if (tokens.empty())
+        throw std::runtime_error("No tokens to forward");
+
+    Tracer::Scope trace(Tracer::FORWARD);
+
+    // the rows of a chunk are multiplied with every weight matrix in one
+    // pass, larger chunks only cost activation memory
+    size_t chunkSize = std::min<size_t>(maxBatchSize, config.seqLength);
+
+    // only the last position of the last chunk is needed for the logits
+    for (size_t first = 0; first < tokens.size(); first += chunkSize)
+    {
+        SequenceInput input{&context.sequence(), tokens.subspan(first, std::min(chunkSize, tokens.size() - first))};
+        forwardLayers(context, std::span(&input, 1));
+    }
+
+    classify(context, logits);
 }
 
-void Transformer::forward(int token, Tensor &logits)
+void Transformer::forward(InferenceContext &context, std::span<SequenceInput const> inputs, Tensor &logits) const
 {
-    // copy the token embedding into x
-    std::copy(tokenEmbeddingTable.data() + token * config.dim, tokenEmbeddingTable.data() + (1 + token) * config.dim,
-              x.f().data());
+    // the positions of an input attend to each other before they are
+    // appended to the cache, more than seqLength would overwrite each other
+    for (auto const &input : inputs)
+    {
+        if (input.tokens.empty())
+            throw std::runtime_error("No tokens to forward");
+        if (input.tokens.size() > static_cast<size_t>(config.seqLength))
+            throw std::runtime_error("More tokens to forward than the sequence length");
+    }
+
+    Tracer::Scope trace(Tracer::FORWARD);
+
+    forwardLayers(context, inputs);
+    classify(context, logits);
+}
+
+void Transformer::forwardLayers(InferenceContext &context, std::span<SequenceInput const> inputs) const
+{
+    auto &positions = context.positions;
+    auto &segments = context.layers.segments;
+
+    // every input is a segment of consecutive rows, with its own positions
+    positions.clear();
+    segments.clear();
+    for (auto const &input : inputs)
+    {
+        segments.push_back({nullptr, positions.size(), input.tokens.size()});
+        for (size_t i = 0; i < input.tokens.size(); i++)
+            positions.push_back(input.sequence->position() + i);
+    }
+
+    size_t nTokens = positions.size();
+    tracer.countTokens(nTokens);
+    context.x.resize(nTokens * config.dim);
+    context.xb.resize(nTokens * config.dim);
+
+    // copy the token embeddings into x
+    {
+        Tracer::Scope trace(Tracer::EMBED);
+        auto xf = context.x.f().data();
+        for (size_t i = 0; i < inputs.size(); i++)
+            for (size_t j = 0; j < inputs[i].tokens.size(); j++)
+                embed(inputs[i].tokens[j], xf + (segments[i].first + j) * config.dim);
+    }
+
+    // the rotations of these positions are shared by all layers
+    context.layers.rope.setPositions(positions);
 
-    std::reference_wrapper<Tensor> t1 = x;
-    std::reference_wrapper<Tensor> t2 = xb;
+    std::reference_wrapper<Tensor> t1 = context.x;
+    std::reference_wrapper<Tensor> t2 = context.xb;
 
     // forward all the layers
     for (int l = 0; l < config.nLayers; l++)
     {
-        layers[l].forward(t1, t2);
+        for (size_t i = 0; i < inputs.size(); i++)
+            segments[i].cache = &inputs[i].sequence->cache(l);
+
+        tracer.setLayer(l);
+        Tracer::Scope trace(Tracer::LAYER);
+        layers[l].forward(t1, t2, context.layers);
         std::swap(t1, t2);
     }
+    tracer.setLayer(-1);
+
+    // keep the last position of every input for the logits
+    context.xLast.resize(inputs.size() * config.dim);
+    context.xbLast.resize(inputs.size() * config.dim);
+    auto xf = t1.get().cf();
+    auto lastf = context.xLast.f().data();
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+        auto last = xf.subspan((segments[i].first + segments[i].nTokens - 1) * config.dim, config.dim);
+        std::copy(last.begin(), last.end(), lastf + i * config.dim);
+    }
+}
 
+void Transformer::classify(InferenceContext &context, Tensor &logits) const
+{
     // final rmsnorm
-    finalNorm.forward(t1, xb);
+    {
+        Tracer::Scope trace(Tracer::FINAL_NORM);
+        finalNorm.forward(context.xLast, context.xbLast);
+    }
 
-    // classifier into logits
-    output.forward(xb, logits);
+    // classifier into logits, a row per input
+    Tracer::Scope classifierTrace(Tracer::CLASSIFIER);
+    logits.resize(context.xbLast.size() / config.dim * config.vocabSize);
+    output.forward(context.xbLast, logits);
+}
+
+void Transformer::embed(int token, float *dest) const
+{
+    if (tokenEmbeddingTable.isQuantizedValid())
+    {
+        auto table = tokenEmbeddingTable.cq();
+        for (int i = 0; i < config.dim; i++)
+        {
+            size_t j = static_cast<size_t>(token) * config.dim + i;
+            dest[i] = table.q[j] * table.s[j / table.groupSize];
+        }
+    }
+    else if (tokenEmbeddingTable.isQ4Valid())
+        kernels::dequantizeQ4(dest, tokenEmbeddingTable.cq4(), static_cast<size_t>(token) * config.dim, config.dim);
+    else if (tokenEmbeddingTable.isHalfValid())
+        kernels::widen(dest, tokenEmbeddingTable.ch(), static_cast<size_t>(token) * config.dim, config.dim);
+    else
+    {
+        auto table = tokenEmbeddingTable.cf();
+        std::copy(table.data() + token * config.dim, table.data() + (1 + token) * config.dim, dest);
+    }
 }
 
-Config const &Transformer::getConfig() { return config; }
+Config const &Transformer::getConfig() const { return config; }
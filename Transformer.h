@@ -1,9 +1,13 @@
 #pragma once
 
 #include <cstdint>
-#include <fstream>
+#include <memory>
+#include <span>
+#include <string>
 #include <vector>
 
+#include "CheckpointReader.h"
+#include "KVCache.h"
 #include "Tensor.h"
 #include "layers.h"
 
@@ -18,6 +22,107 @@ struct Config
     int seqLength; // max sequence length
     uint8_t sharedClassifier;
     uint8_t padding[3];
+    RopeConfig rope; // all zeros in checkpoints written before it was added
+};
+
+// ----------------------------------------------------------------------------
+// The state of one sequence fed through the model: the KV caches of all its
+// layers. It is kept apart from the weights, so that one Transformer can
+// serve many sequences, even in the same batch.
+//
+// A sequence can be saved to a session file together with its tokens, and
+// restored later instead of feeding the tokens again. The file holds the
+// keys and values of the positions still in the caches, optionally converted
+// to a smaller type, and is mapped to restore them.
+
+class Sequence
+{
+public:
+    Sequence(Config const &config, KVCache::Type kvType);
+
+    // the position of the next token
+    size_t position() const;
+
+    size_t nLayers() const;
+    KVCache &cache(size_t layer);
+    KVCache const &cache(size_t layer) const;
+
+    // writes the keys and values, stored as type, and the tokens of the
+    // sequence, which are usually all tokens fed so far
+    void save(std::string const &path, std::span<int const> tokens, KVCache::Type type) const;
+
+    // restores a session file into this empty sequence, returns its tokens
+    std::vector<int> load(std::string const &path);
+
+private:
+    struct SessionHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        int32_t dim;
+        int32_t nLayers;
+        int32_t nHeads;
+        int32_t nKVHeads;
+        uint32_t kvType; // of the stored rows
+        uint32_t padding;
+        uint64_t position;
+        uint64_t first; // the first stored position
+        uint64_t nTokens;
+    };
+
+    static constexpr uint32_t sessionMagic = 0x73733432; // "ss42"
+    static constexpr uint32_t sessionVersion = 1;
+    static constexpr size_t sessionAlignment = 64;
+
+private:
+    Config config;
+    std::vector<KVCache> caches;
+};
+
+// tokens to append to a sequence in a batch
+struct SequenceInput
+{
+    Sequence *sequence;
+    std::span<int const> tokens;
+};
+
+// ----------------------------------------------------------------------------
+// All mutable state of running a Transformer: the activation buffers of a
+// batch and the sequence of forward() and forwardBatch(). The Transformer
+// itself only holds the weights and is immutable once loaded, so several
+// threads can run it concurrently with one context each.
+//
+// There is only one thread pool, though. With more than one thread (-T > 1),
+// its parallel regions run one at a time, so the forward passes of
+// concurrent contexts take turns instead of running in parallel: two threads
+// with a context each take about as long as one thread running both. Several
+// sequences are run faster as one batch through a single context with
+// forward(inputs), as the server does. With -T 1 every region runs on its
+// calling thread, and the contexts of different threads do run in parallel.
+
+class InferenceContext
+{
+public:
+    InferenceContext(Config const &config, KVCache::Type kvType = KVCache::F32);
+
+    // the sequence of forward() and forwardBatch(), created on first use
+    Sequence &sequence();
+
+private:
+    friend class Transformer;
+
+    Config config;
+    KVCache::Type kvType;
+    std::unique_ptr<Sequence> sequence_;
+
+    LayerContext layers;
+
+    Tensor x;
+    Tensor xb;
+    Tensor xLast;
+    Tensor xbLast;
+
+    std::vector<size_t> positions; // of the rows of a batch
 };
 
 class Transformer
@@ -25,21 +130,41 @@ class Transformer
 public:
     Transformer(Config config);
 
-    void loadWeights(std::ifstream &inputStream);
-    void forward(int token, Tensor &logits);
+    void loadWeights(CheckpointReader &reader);
+    void forward(InferenceContext &context, int token, Tensor &logits) const;
 
-    Config const &getConfig();
+    // feeds all tokens through the model at once, e.g. the prompt, and
+    // computes the logits of the last position only
+    void forwardBatch(InferenceContext &context, std::span<int const> tokens, Tensor &logits) const;
+
+    // feeds the tokens of several sequences through the model as one batch,
+    // every weight matrix is read once for all of them. The logits of the
+    // last token of every input are written as one row per input. The inputs
+    // are not split, each of them holds at most seqLength tokens.
+    void forward(InferenceContext &context, std::span<SequenceInput const> inputs, Tensor &logits) const;
+
+    Config const &getConfig() const;
+
+    // the upper limit of the number of positions processed together
+    static constexpr size_t maxBatchSize = 128;
+
+private:
+    // feeds the inputs through the layers, leaves the activations of their
+    // last tokens in xLast
+    void forwardLayers(InferenceContext &context, std::span<SequenceInput const> inputs) const;
+    void classify(InferenceContext &context, Tensor &logits) const;
+
+    void embed(int token, float *dest) const;
 
 private:
     Config config;
 
-    FloatTensor tokenEmbeddingTable; // (vocab_size, dim)
+    // keeps the weights alive when they are referenced from the mapped checkpoint
+    std::shared_ptr<MappedFile> mapping;
+
+    Tensor tokenEmbeddingTable; // (vocab_size, dim)
 
     std::vector<TransformerBlock> layers;
     RMSNorm finalNorm;
     Linear output;
-
-    Tensor x;
-    Tensor xb;
-    Tensor logits;
 };
\ No newline at end of file
@@ -0,0 +1,681 @@
+/* Benchmarks of the kernels and of end-to-end inference with a synthetic model */
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#define TESTING
+#include "main.cpp"
+
+#include "ThreadPool.h"
+#include "kernels.h"
+#include "layers.h"
+
+// ----------------------------------------------------------------------------
+// utilities: timing and JSON output
+
+using Clock = std::chrono::steady_clock;
+
+double secondsSince(Clock::time_point start) { return std::chrono::duration<double>(Clock::now() - start).count(); }
+
+// seconds per call of f, repeated until minSeconds have passed
+template <typename F> double measure(F &&f, double minSeconds)
+{
+    // warm up the caches and the thread pool
+    f();
+
+    size_t iterations = 0;
+    auto start = Clock::now();
+    double elapsed;
+
+    do
+    {
+        f();
+        iterations++;
+        elapsed = secondsSince(start);
+    } while (elapsed < minSeconds);
+
+    return elapsed / iterations;
+}
+
+// a flat JSON object, the values are added in order
+class JsonObject
+{
+public:
+    JsonObject &add(std::string const &key, std::string const &value)
+    {
+        field(key) << '"' << value << '"';
+        return *this;
+    }
+
+    JsonObject &add(std::string const &key, char const *value) { return add(key, std::string(value)); }
+
+    template <typename T> JsonObject &add(std::string const &key, T value)
+    {
+        field(key) << value;
+        return *this;
+    }
+
+    std::string str() const
+    {
+        std::string s = "{";
+        s.append(stream.str()).append("}");
+        return s;
+    }
+
+private:
+    std::ostream &field(std::string const &key)
+    {
+        if (0 < stream.tellp())
+            stream << ", ";
+        return stream << '"' << key << "\": ";
+    }
+
+private:
+    std::ostringstream stream;
+};
+
+std::vector<int> parseList(std::string const &list)
+{
+    std::vector<int> values;
+    std::istringstream stream(list);
+    std::string item;
+
+    while (std::getline(stream, item, ','))
+        values.push_back(std::stoi(item));
+
+    if (values.empty())
+        throw std::runtime_error("Empty list: " + list);
+
+    return values;
+}
+
+// ----------------------------------------------------------------------------
+// synthetic model
+
+Tensor randomTensor(size_t size, float scale, std::mt19937 &rng)
+{
+    std::uniform_real_distribution<float> uniform(-scale, scale);
+
+    Tensor t(size, true);
+    for (auto &v : t.f())
+        v = uniform(rng);
+
+    return t;
+}
+
+void writeTensor(std::ofstream &out, Tensor &t, int groupSize, Tensor::Format format = Tensor::Q8)
+{
+    bool half = Tensor::F16 == format || Tensor::BF16 == format;
+    int field = half ? format << Tensor::formatShift : 0 == groupSize ? 0 : groupSize | format << Tensor::formatShift;
+    out.write(reinterpret_cast<char const *>(&field), sizeof(field));
+
+    if (half)
+    {
+        auto h = t.ch(Tensor::BF16 == format);
+        out.write(reinterpret_cast<char const *>(h.h.data()), h.h.size_bytes());
+    }
+    else if (0 == groupSize)
+    {
+        auto f = t.cf();
+        out.write(reinterpret_cast<char const *>(f.data()), f.size_bytes());
+    }
+    else if (Tensor::Q4 == format || Tensor::Q4_MIN == format)
+    {
+        auto q = t.cq4(groupSize, Tensor::Q4_MIN == format);
+        out.write(reinterpret_cast<char const *>(q.q.data()), q.q.size_bytes());
+        out.write(reinterpret_cast<char const *>(q.s.data()), q.s.size_bytes());
+        out.write(reinterpret_cast<char const *>(q.min.data()), q.min.size_bytes());
+    }
+    else
+    {
+        auto q = t.cq(groupSize);
+        out.write(reinterpret_cast<char const *>(q.q.data()), q.q.size_bytes());
+        out.write(reinterpret_cast<char const *>(q.s.data()), q.s.size_bytes());
+    }
+}
+
+// writes a checkpoint with random weights, the norms are kept at 1 so the
+// activations stay in a realistic range
+void writeSyntheticModel(std::string const &path, Config const &config, int groupSize, Tensor::Format format)
+{
+    std::ofstream out(path, std::ios::binary);
+    if (!out)
+        throw std::runtime_error("Couldn't create " + path);
+
+    uint32_t magic = 0x616b3432;
+    int version = 1;
+    out.write(reinterpret_cast<char const *>(&magic), sizeof(magic));
+    out.write(reinterpret_cast<char const *>(&version), sizeof(version));
+    out.write(reinterpret_cast<char const *>(&config), sizeof(config));
+
+    std::vector<char> padding(256 - out.tellp(), 0);
+    out.write(padding.data(), padding.size());
+
+    std::mt19937 rng(42);
+    size_t dim = config.dim;
+    size_t kvDim = dim * config.nKVHeads / config.nHeads;
+    size_t hiddenDim = config.hiddenDim;
+
+    auto weights = [&](size_t inDim, size_t outDim)
+    {
+        Tensor t = randomTensor(inDim * outDim, 1.0f / std::sqrt(static_cast<float>(inDim)), rng);
+        writeTensor(out, t, groupSize, format);
+    };
+    auto norm = [&]()
+    {
+        Tensor t(dim, true);
+        std::fill(t.f().begin(), t.f().end(), 1.0f);
+        writeTensor(out, t, 0);
+    };
+
+    Tensor embeddings = randomTensor(config.vocabSize * dim, 1.0f, rng);
+    writeTensor(out, embeddings, groupSize, format);
+
+    for (int l = 0; l < config.nLayers; l++)
+    {
+        norm();
+        weights(dim, dim);
+        weights(dim, kvDim);
+        weights(dim, kvDim);
+        weights(dim, dim);
+        norm();
+        weights(dim, hiddenDim);
+        weights(hiddenDim, dim);
+        weights(dim, hiddenDim);
+    }
+
+    norm();
+
+    if (!out)
+        throw std::runtime_error("Couldn't write " + path);
+}
+
+// ----------------------------------------------------------------------------
+// benchmarks
+
+struct Bench
+{
+    Config config;
+    int groupSize;
+    KVCache::Type kvType;
+    double minSeconds;
+    std::vector<std::string> results;
+
+    void matmul(size_t inDim, size_t outDim, size_t nTokens, std::mt19937 &rng)
+    {
+        Tensor x = randomTensor(nTokens * inDim, 1.0f, rng);
+        Tensor w = randomTensor(inDim * outDim, 1.0f, rng);
+        FloatTensor out(nTokens * outDim);
+
+        double flops = 2.0 * inDim * outDim * nTokens;
+        std::string shape = std::to_string(outDim) + "x" + std::to_string(inDim);
+
+        double s = measure([&]() { kernels::matmulFloat(out, x.cf(), w.cf(), nTokens); }, minSeconds);
+        results.push_back(JsonObject()
+                              .add("name", "matmulFloat")
+                              .add("shape", shape)
+                              .add("tokens", nTokens)
+                              .add("threads", threadPool.size())
+                              .add("us", s * 1e6)
+                              .add("gflops", flops / s * 1e-9)
+                              .str());
+
+        for (bool bfloat16 : {false, true})
+        {
+            auto wh = w.ch(bfloat16);
+
+            s = measure([&]() { kernels::matmulFloat(out, x.cf(), wh, nTokens); }, minSeconds);
+            results.push_back(JsonObject()
+                                  .add("name", bfloat16 ? "matmulBF16" : "matmulF16")
+                                  .add("kernel", kernels::matmulHalfKernel(bfloat16))
+                                  .add("shape", shape)
+                                  .add("tokens", nTokens)
+                                  .add("threads", threadPool.size())
+                                  .add("us", s * 1e6)
+                                  .add("gflops", flops / s * 1e-9)
+                                  .str());
+        }
+
+        if (0 < groupSize)
+        {
+            auto xq = x.cq(groupSize);
+            auto wq = w.cq(groupSize);
+
+            s = measure([&]() { kernels::matmulQuantized(out, xq, wq, nTokens); }, minSeconds);
+            results.push_back(JsonObject()
+                                  .add("name", "matmulQuantized")
+                                  .add("kernel", kernels::matmulQuantizedKernel(groupSize))
+                                  .add("shape", shape)
+                                  .add("tokens", nTokens)
+                                  .add("threads", threadPool.size())
+                                  .add("us", s * 1e6)
+                                  .add("gflops", flops / s * 1e-9)
+                                  .str());
+        }
+
+        if (0 < groupSize && 0 == groupSize % 32)
+        {
+            auto xq = x.cq(groupSize);
+            auto wq = w.cq4(groupSize, false);
+
+            s = measure([&]() { kernels::matmulQ4(out, xq, wq, nTokens); }, minSeconds);
+            results.push_back(JsonObject()
+                                  .add("name", "matmulQ4")
+                                  .add("kernel", kernels::matmulQ4Kernel(groupSize, inDim))
+                                  .add("shape", shape)
+                                  .add("tokens", nTokens)
+                                  .add("threads", threadPool.size())
+                                  .add("us", s * 1e6)
+                                  .add("gflops", flops / s * 1e-9)
+                                  .str());
+        }
+    }
+
+    void softmax(size_t n, std::mt19937 &rng)
+    {
+        Tensor scores = randomTensor(n, 10.0f, rng);
+        FloatTensor work(n);
+
+        double s = measure(
+            [&]()
+            {
+                std::copy(scores.cf().begin(), scores.cf().end(), work.begin());
+                kernels::softmax(work.data(), work.data() + n);
+            },
+            minSeconds);
+
+        results.push_back(JsonObject().add("name", "softmax").add("size", n).add("us", s * 1e6).str());
+    }
+
+    void sampling(size_t vocabSize, std::mt19937 &rng)
+    {
+        // a few likely tokens on top of a flat tail, like the logits of a
+        // language model
+        Tensor logits = randomTensor(vocabSize, 5.0f, rng);
+        for (size_t i = 0; i < std::min<size_t>(8, vocabSize); i++)
+            logits.f()[i * 997 % vocabSize] += 10.0f + i;
+
+        NucleusSampler nucleus(vocabSize, 1.0f, 0.9f, 1);
+
+        // a typical chain, none of these processors modifies the logits
+        SamplerChain chain(vocabSize, 1);
+        chain.add(std::make_shared<TopK>(40))
+            .add(std::make_shared<Temperature>(0.8f))
+            .add(std::make_shared<TopP>(0.9f))
+            .add(std::make_shared<MinP>(0.05f));
+
+        for (auto [name, sampler] : {std::pair<char const *, Sampler *>{"top-p", &nucleus}, {"chain", &chain}})
+        {
+            double s = measure([&]() { sampler->sample(logits.f()); }, minSeconds);
+
+            results.push_back(JsonObject()
+                                  .add("name", "sampling")
+                                  .add("sampler", name)
+                                  .add("size", vocabSize)
+                                  .add("us", s * 1e6)
+                                  .str());
+        }
+    }
+
+    void rmsNorm(size_t nTokens, std::mt19937 &rng)
+    {
+        RMSNorm norm(config.dim);
+        Tensor x = randomTensor(nTokens * config.dim, 1.0f, rng);
+        Tensor out(nTokens * config.dim, true);
+
+        double s = measure([&]() { norm.forward(x, out); }, minSeconds);
+
+        results.push_back(
+            JsonObject().add("name", "RMSNorm").add("dim", config.dim).add("tokens", nTokens).add("us", s * 1e6).str());
+    }
+
+    // the attention of all heads of one layer for one new token over a
+    // filled KV cache, without the projections
+    void attention(size_t contextLength, std::mt19937 &rng)
+    {
+        size_t nHeads = config.nHeads;
+        size_t nKVHeads = config.nKVHeads;
+        size_t headSize = config.dim / nHeads;
+
+        KVCache cache(contextLength, nKVHeads, headSize, kvType);
+        Tensor rows = randomTensor(contextLength * nKVHeads * headSize, 1.0f, rng);
+        cache.append(rows.cf().data(), rows.cf().data(), contextLength);
+
+        Tensor query = randomTensor(config.dim, 1.0f, rng);
+        float const *q = query.cf().data();
+        FloatTensor att(nHeads * contextLength);
+        FloatTensor out(config.dim);
+        float scale = 1.0f / std::sqrt(headSize);
+        size_t first = cache.windowStart(contextLength - 1);
+
+        double s = measure(
+            [&]()
+            {
+                threadPool.parallelFor(nHeads,
+                                       [&](size_t h)
+                                       {
+                                           float *attf = att.data() + h * contextLength;
+                                           float *xb = out.data() + h * headSize;
+                                           size_t kvHead = h / (nHeads / nKVHeads);
+
+                                           cache.scores(kvHead, first, contextLength, q + h * headSize, scale,
+                                                        attf);
+                                           kernels::softmax(attf, attf + contextLength - first);
+                                           std::fill(xb, xb + headSize, 0.0f);
+                                           cache.accumulate(kvHead, first, contextLength, attf, xb);
+                                       });
+            },
+            minSeconds);
+
+        results.push_back(JsonObject()
+                              .add("name", "attention")
+                              .add("context", contextLength)
+                              .add("heads", nHeads)
+                              .add("kvHeads", nKVHeads)
+                              .add("threads", threadPool.size())
+                              .add("us", s * 1e6)
+                              .str());
+    }
+
+    void tokenizer(std::string const &path, size_t textBytes)
+    {
+        if (!std::filesystem::exists(path))
+        {
+            std::cerr << "skipping Tokenizer::encode, " << path << " not found" << std::endl;
+            return;
+        }
+
+        Tokenizer tokenizer(path, 128256);
+
+        std::string paragraph = "The quick brown fox jumps over the lazy dog. Llamas are domesticated South American "
+                                "camelids, widely used as meat and pack animals by Andean cultures since the "
+                                "pre-Columbian era. ";
+        std::string text;
+        while (text.size() < textBytes)
+            text += paragraph;
+        text.resize(textBytes);
+
+        size_t nTokens = 0;
+        double s = measure([&]() { nTokens = tokenizer.encode(text, true, false).size(); }, minSeconds);
+
+        results.push_back(JsonObject()
+                              .add("name", "Tokenizer::encode")
+                              .add("bytes", textBytes)
+                              .add("tokens", nTokens)
+                              .add("us", s * 1e6)
+                              .add("MBps", textBytes / s * 1e-6)
+                              .str());
+    }
+
+    void endToEnd(std::string const &model, size_t promptLength, size_t decodeSteps)
+    {
+        Transformer const transformer = build_transformer(model, CheckpointReader::READ, 0);
+        InferenceContext context(transformer.getConfig(), kvType);
+        Tensor logits(transformer.getConfig().vocabSize);
+        int vocabSize = transformer.getConfig().vocabSize;
+
+        std::vector<int> prompt(promptLength);
+        for (size_t i = 0; i < promptLength; i++)
+            prompt[i] = static_cast<int>((i * 7919 + 13) % vocabSize);
+
+        auto start = Clock::now();
+        transformer.forwardBatch(context, prompt, logits);
+        double prefill = secondsSince(start);
+
+        start = Clock::now();
+        for (size_t i = 0; i < decodeSteps; i++)
+            transformer.forward(context, static_cast<int>((i * 104729 + 7) % vocabSize), logits);
+        double decode = secondsSince(start);
+
+        results.push_back(JsonObject()
+                              .add("name", "endToEnd")
+                              .add("threads", threadPool.size())
+                              .add("prompt", promptLength)
+                              .add("prefillMs", prefill * 1e3)
+                              .add("prefillTokPerS", promptLength / prefill)
+                              .add("decode", decodeSteps)
+                              .add("decodeMs", decode * 1e3)
+                              .add("decodeTokPerS", 0 < decodeSteps ? decodeSteps / decode : 0.0)
+                              .str());
+    }
+
+    // decodes several sequences together as the server does, one token of
+    // each per forward pass
+    void batchedDecode(std::string const &model, size_t nSequences, size_t promptLength, size_t decodeSteps)
+    {
+        Transformer const transformer = build_transformer(model, CheckpointReader::READ, 0);
+        Config const &config = transformer.getConfig();
+        InferenceContext context(config, kvType);
+        Tensor logits(config.vocabSize);
+
+        std::vector<Sequence> sequences;
+        std::vector<std::vector<int>> prompts(nSequences);
+        std::vector<SequenceInput> inputs;
+        for (size_t s = 0; s < nSequences; s++)
+        {
+            sequences.emplace_back(config, kvType);
+            for (size_t i = 0; i < promptLength; i++)
+                prompts[s].push_back(static_cast<int>((i * 7919 + s * 31 + 13) % config.vocabSize));
+        }
+        for (size_t s = 0; s < nSequences; s++)
+        {
+            inputs.push_back({&sequences[s], prompts[s]});
+            transformer.forward(context, std::span(&inputs.back(), 1), logits);
+        }
+
+        std::vector<int> tokens(nSequences);
+        auto start = Clock::now();
+        for (size_t i = 0; i < decodeSteps; i++)
+        {
+            for (size_t s = 0; s < nSequences; s++)
+            {
+                tokens[s] = static_cast<int>((i * 104729 + s * 7 + 7) % config.vocabSize);
+                inputs[s].tokens = std::span<int const>(&tokens[s], 1);
+            }
+            transformer.forward(context, inputs, logits);
+        }
+        double decode = secondsSince(start);
+
+        results.push_back(JsonObject()
+                              .add("name", "batchedDecode")
+                              .add("threads", threadPool.size())
+                              .add("sequences", nSequences)
+                              .add("prompt", promptLength)
+                              .add("decode", decodeSteps)
+                              .add("decodeMs", decode * 1e3)
+                              .add("tokPerS", 0 < decodeSteps ? nSequences * decodeSteps / decode : 0.0)
+                              .str());
+    }
+};
+
+// ----------------------------------------------------------------------------
+// CLI
+
+struct BenchArgs : public argparse::Args
+{
+    std::string &model = kwarg("model", "checkpoint to benchmark instead of a synthetic model").set_default("");
+    int &dim = kwarg("dim", "synthetic model: transformer dimension").set_default(2048);
+    int &hiddenDim = kwarg("hidden-dim", "synthetic model: ffn dimension").set_default(8192);
+    int &nLayers = kwarg("layers", "synthetic model: number of layers").set_default(2);
+    int &nHeads = kwarg("heads", "synthetic model: number of query heads").set_default(32);
+    int &nKVHeads = kwarg("kv-heads", "synthetic model: number of key/value heads").set_default(8);
+    int &vocabSize = kwarg("vocab", "synthetic model: vocabulary size").set_default(32000);
+    int &groupSize = kwarg("group-size", "quantization group size, 0 = float32").set_default(64);
+    std::string &weights = kwarg("weights", "synthetic model: weights q8|q4|q4min|f16|bf16").set_default("q8");
+    std::string &kvType = kwarg("k", "KV cache type: f32|f16|q8").set_default("f32");
+    std::string &threads = kwarg("T", "comma separated thread counts, 0 = all CPUs").set_default("0");
+    std::string &prompts = kwarg("prompts", "comma separated prompt lengths").set_default("32,128");
+    int &decodeSteps = kwarg("decode", "number of decoded tokens").set_default(32);
+    std::string &sequences =
+        kwarg("sequences", "comma separated numbers of sequences decoded together").set_default("4");
+    int &context = kwarg("context", "context length of the attention benchmark").set_default(1024);
+    std::string &tokenizerPath = kwarg("z", "tokenizer for the encode benchmark").set_default("tokenizer.bin");
+    int &textBytes = kwarg("text-bytes", "length of the text for the encode benchmark").set_default(1024);
+    float &minTime = kwarg("min-time", "minimum time per microbenchmark in seconds").set_default(0.2f);
+    std::string &suite = kwarg("suite", "benchmarks to run: all|micro|e2e").set_default("all");
+    std::string &output = kwarg("o", "JSON output file, default stdout").set_default("");
+    bool &noPin = flag("no-pin", "do not pin the threads to CPUs");
+};
+
+int main(int argc, char *argv[])
+{
+    auto args = argparse::parse<BenchArgs>(argc, argv);
+
+    Bench bench;
+    bench.groupSize = args.groupSize;
+    bench.minSeconds = args.minTime;
+
+    if (args.kvType == "f32")
+        bench.kvType = KVCache::F32;
+    else if (args.kvType == "f16")
+        bench.kvType = KVCache::F16;
+    else if (args.kvType == "q8")
+        bench.kvType = KVCache::Q8;
+    else
+    {
+        std::cerr << "unknown KV cache type: " << args.kvType << std::endl;
+        return 1;
+    }
+
+    Tensor::Format weightFormat;
+    if (args.weights == "q8")
+        weightFormat = Tensor::Q8;
+    else if (args.weights == "q4")
+        weightFormat = Tensor::Q4;
+    else if (args.weights == "q4min")
+        weightFormat = Tensor::Q4_MIN;
+    else if (args.weights == "f16")
+        weightFormat = Tensor::F16;
+    else if (args.weights == "bf16")
+        weightFormat = Tensor::BF16;
+    else
+    {
+        std::cerr << "unknown weight quantization: " << args.weights << std::endl;
+        return 1;
+    }
+
+    bool micro = args.suite == "all" || args.suite == "micro";
+    bool e2e = args.suite == "all" || args.suite == "e2e";
+    auto threadCounts = parseList(args.threads);
+    auto promptLengths = parseList(args.prompts);
+    auto sequenceCounts = parseList(args.sequences);
+
+    // the end-to-end runs use a synthetic checkpoint in the temp directory
+    // unless a model is given
+    std::string model = args.model;
+    bool synthetic = model.empty();
+
+    if (synthetic)
+    {
+        Config &config = bench.config;
+        config = Config{};
+        config.dim = args.dim;
+        config.hiddenDim = args.hiddenDim;
+        config.nLayers = args.nLayers;
+        config.nHeads = args.nHeads;
+        config.nKVHeads = args.nKVHeads;
+        config.vocabSize = args.vocabSize;
+        config.seqLength = *std::max_element(promptLengths.begin(), promptLengths.end()) + args.decodeSteps;
+        config.sharedClassifier = 1;
+
+        if (e2e)
+        {
+            model = (std::filesystem::temp_directory_path() / ("llama3-bench-" + std::to_string(getpid()) + ".bin"))
+                        .string();
+            writeSyntheticModel(model, config, args.groupSize, weightFormat);
+        }
+    }
+    else
+    {
+        CheckpointReader reader(model, CheckpointReader::READ);
+        check_header(reader);
+        bench.config = reader.read<Config>();
+    }
+
+    std::mt19937 rng(1);
+    size_t dim = bench.config.dim;
+    size_t kvDim = dim * bench.config.nKVHeads / bench.config.nHeads;
+    size_t hiddenDim = bench.config.hiddenDim;
+
+    try
+    {
+        for (int t : threadCounts)
+        {
+            threadPool.resize(t, !args.noPin);
+
+            if (micro)
+            {
+                for (size_t nTokens : {size_t(1), size_t(32)})
+                {
+                    bench.matmul(dim, dim, nTokens, rng);
+                    bench.matmul(dim, kvDim, nTokens, rng);
+                    bench.matmul(dim, hiddenDim, nTokens, rng);
+                    bench.matmul(hiddenDim, dim, nTokens, rng);
+
+                    // the fused wq, wk, wv and w1, w3 of the layers
+                    bench.matmul(dim, dim + 2 * kvDim, nTokens, rng);
+                    bench.matmul(dim, 2 * hiddenDim, nTokens, rng);
+                }
+
+                bench.softmax(args.context, rng);
+                bench.sampling(bench.config.vocabSize, rng);
+                bench.rmsNorm(1, rng);
+                bench.attention(args.context, rng);
+            }
+
+            if (e2e)
+            {
+                for (int p : promptLengths)
+                    bench.endToEnd(model, p, args.decodeSteps);
+                for (int n : sequenceCounts)
+                    bench.batchedDecode(model, n, promptLengths.front(), args.decodeSteps);
+            }
+        }
+
+        if (micro)
+            bench.tokenizer(args.tokenizerPath, args.textBytes);
+    }
+    catch (...)
+    {
+        if (synthetic && e2e)
+            std::filesystem::remove(model);
+        throw;
+    }
+
+    if (synthetic && e2e)
+        std::filesystem::remove(model);
+
+    JsonObject config;
+    config.add("dim", bench.config.dim)
+        .add("hiddenDim", bench.config.hiddenDim)
+        .add("layers", bench.config.nLayers)
+        .add("heads", bench.config.nHeads)
+        .add("kvHeads", bench.config.nKVHeads)
+        .add("vocab", bench.config.vocabSize)
+        .add("groupSize", args.groupSize)
+        .add("weights", args.weights)
+        .add("kvType", args.kvType)
+        .add("model", synthetic ? "synthetic" : args.model);
+
+    std::ostringstream json;
+    json << "{\n  \"config\": " << config.str() << ",\n  \"results\": [";
+    for (size_t i = 0; i < bench.results.size(); i++)
+        json << (0 < i ? "," : "") << "\n    " << bench.results[i];
+    json << "\n  ]\n}\n";
+
+    if (args.output.empty())
+        std::cout << json.str();
+    else
+        std::ofstream(args.output) << json.str();
+
+    return 0;
+}
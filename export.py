@@ -48,6 +48,22 @@ def serialize_int8(file, tensor):
     file.write(b)
 
 
+def serialize_uint8(file, tensor):
+    """writes one uint8 tensor to file that is open in wb mode"""
+    file.write(tensor.detach().cpu().view(-1).numpy().astype(np.uint8).tobytes())
+
+
+def serialize_fp16(file, tensor):
+    """writes one fp16 tensor to file that is open in wb mode"""
+    file.write(tensor.detach().cpu().view(-1).to(torch.float16).numpy().tobytes())
+
+
+def serialize_bf16(file, tensor):
+    """writes one bf16 tensor to file that is open in wb mode"""
+    d = tensor.detach().cpu().view(-1).to(torch.bfloat16).view(torch.int16)
+    file.write(d.numpy().tobytes())
+
+
 def quantize_q80(w, group_size):
     """
     takes a tensor and returns the Q8_0 quantized version
@@ -74,10 +90,53 @@ def quantize_q80(w, group_size):
     maxerr = err.max().item()
     return int8val, scale, maxerr
 
-def version1_export(model, filepath, group_size):
+
+def quantize_q40(w, group_size, with_min):
+    """
+    takes a tensor and returns the Q4 quantized version: groups of 4-bit
+    values with fp16 scales, symmetric in [-8, 7] * scale, or with fp16 mins
+    nibble * scale + min. In every block of 32 values byte j holds value j
+    in its low and value j + 16 in its high nibble.
+    """
+    assert w.numel() % group_size == 0 and group_size % 32 == 0
+    w = w.float().reshape(-1, group_size)
+    if with_min:
+        # the values are quantized with the rounded scale and min
+        wmin = w.min(dim=1).values.to(torch.float16).float()
+        scale = ((w.max(dim=1).values - wmin) / 15.0).to(torch.float16).float()
+        offset = 0
+    else:
+        # the value of the largest magnitude maps to -8
+        extreme = w.gather(1, torch.abs(w).argmax(dim=1, keepdim=True)).squeeze(1)
+        scale = (extreme / -8.0).to(torch.float16).float()
+        wmin = torch.zeros_like(scale)
+        offset = 8
+    inverse = torch.where(scale != 0, 1.0 / scale, torch.zeros_like(scale))
+    quant = torch.round((w - wmin[:, None]) * inverse[:, None]) + offset
+    quant = quant.clamp(0, 15).to(torch.uint8)
+    # dequantize by rescaling and find the max error
+    fp32val = (quant.float() - offset) * scale[:, None] + wmin[:, None]
+    maxerr = torch.abs(fp32val - w).max().item()
+    # pack the blocks of 32 values
+    blocks = quant.reshape(-1, 2, 16)
+    packed = blocks[:, 0, :] | (blocks[:, 1, :] << 4)
+    return packed, scale.to(torch.float16), wmin.to(torch.float16) if with_min else None, maxerr
+
+# the format of a quantized or half precision tensor, stored above the group size
+TENSOR_FORMATS = {"q8": 0, "q4": 1, "q4min": 2, "fp16": 3, "bf16": 4}
+TENSOR_FORMAT_SHIFT = 16
+QUANTIZATIONS = ["q8", "q4", "q4min"]
+DTYPES = ["fp32", "fp16", "bf16"]
+
+
+def version1_export(model, filepath, group_size, quantization="q8", dtype="fp32"):
     """
     Export the model weights in full float32 .bin file to be read from C.
     This is same as legacy_export, but with a proper header.
+    With a group size, the weights are quantized to Q8_0, or to 4 bits with
+    the q4 and q4min quantizations, which keep the norms in float32.
+    Without one, the dtype fp16 or bf16 stores the weights in half precision,
+    the norms again in float32.
     """
     version = 1
 
@@ -105,6 +164,18 @@ def version1_export(model, filepath, group_size):
     # 4) write some other flags
     shared_classifier = torch.equal(model.tok_embeddings.weight, model.output.weight)
     out_file.write(struct.pack("B", int(shared_classifier)))
+    out_file.write(b"\0" * 3)
+    # 5) write the RoPE parameters: theta and the llama3 frequency scaling,
+    # zeros select the defaults
+    rope_scaling = p.rope_scaling or {}
+    out_file.write(struct.pack(
+        "ffffi",
+        p.rope_theta or 0.0,
+        rope_scaling.get("factor", 0.0),
+        rope_scaling.get("low_freq_factor", 0.0),
+        rope_scaling.get("high_freq_factor", 0.0),
+        rope_scaling.get("original_max_position_embeddings", 0),
+    ))
     pad = 256 - out_file.tell()  # pad rest with zeros; tell returns current pos
     assert pad >= 0
     out_file.write(b"\0" * pad)
@@ -130,6 +201,32 @@ def version1_export(model, filepath, group_size):
     
     ew = []
     for i, (w, q) in enumerate(weights):
+        if group_size <= 0 and dtype != "fp32" and q:
+            out_file.write(struct.pack('i', TENSOR_FORMATS[dtype] << TENSOR_FORMAT_SHIFT))
+            if dtype == "fp16":
+                serialize_fp16(out_file, w)
+            else:
+                serialize_bf16(out_file, w)
+            print(f"{i+1}/{len(weights)} wrote {tuple(w.shape)} as {dtype}")
+            continue
+
+        if group_size > 0 and quantization != "q8":
+            if not q:
+                out_file.write(struct.pack('i', 0))
+                serialize_fp32(out_file, w)
+                continue
+            out_file.write(struct.pack('i', group_size | TENSOR_FORMATS[quantization] << TENSOR_FORMAT_SHIFT))
+            packed, s, m, err = quantize_q40(w, group_size, quantization == "q4min")
+            serialize_uint8(out_file, packed)
+            serialize_fp16(out_file, s)
+            if m is not None:
+                serialize_fp16(out_file, m)
+            ew.append((err, w.shape))
+            print(
+                f"{i+1}/{len(weights)} quantized {tuple(w.shape)} to {quantization} with max error {err}"
+            )
+            continue
+
         out_file.write(struct.pack('i', group_size))
 
         if group_size <= 0:
@@ -211,6 +308,16 @@ def load_meta_model(model_path):
     config.vocab_size = state_dict["tok_embeddings.weight"].shape[0]
     config.max_seq_len = 2048
 
+    # Llama 3.1 and later scale the RoPE frequencies with fixed parameters
+    config.rope_theta = params.get("rope_theta")
+    if params.get("use_scaled_rope"):
+        config.rope_scaling = {
+            "factor": params.get("rope_scaling_factor", 8.0),
+            "low_freq_factor": 1.0,
+            "high_freq_factor": 4.0,
+            "original_max_position_embeddings": 8192,
+        }
+
     # create a new Transformer object and set weights
     model = Transformer(config)
 
@@ -274,6 +381,10 @@ def load_hf_model(model_path):
     config.hidden_dim = hf_model.config.intermediate_size
     config.norm_eps = hf_model.config.rms_norm_eps
     config.max_seq_len = hf_model.config.max_position_embeddings
+    config.rope_theta = getattr(hf_model.config, "rope_theta", None)
+    rope_scaling = getattr(hf_model.config, "rope_scaling", None)
+    if rope_scaling and rope_scaling.get("rope_type", rope_scaling.get("type")) == "llama3":
+        config.rope_scaling = rope_scaling
 
     # create a new Transformer object and set weights
     model = Transformer(config)
@@ -334,17 +445,23 @@ def load_hf_model(model_path):
 # API entrypoint
 
 
-def model_export(model, filepath, version, quantize, dtype=torch.float32):
+def model_export(model, filepath, version, quantize, dtype="fp32", group_size=None):
     """
     Versions docs:
     v-1:huggingface export, i.e. intended for use outside of this repo, in HF
     v1: float32 export
     v2: int8 quantized Q8_0 export, similar to llama.cpp, in groups
     # TODO: add dtype export support for other versions (?)
+    quantize is None, "q8", "q4" or "q4min", the group size defaults to 64
+    for q8 and to 32 for the 4-bit ones. Without quantization the dtype
+    "fp32", "fp16" or "bf16" selects the precision of the weights.
     """
-    group_size = 64 if quantize else 0
+    if quantize and dtype != "fp32":
+        raise ValueError(f"the weights can't be both quantized and stored as {dtype}")
+    if group_size is None:
+        group_size = 0 if not quantize else 64 if quantize == "q8" else 32
     if version == 1:
-        version1_export(model, filepath, group_size)
+        version1_export(model, filepath, group_size if quantize else 0, quantize or "q8", dtype)
     else:
         raise ValueError(f"unknown version {version}")
 
@@ -361,9 +478,16 @@ if __name__ == "__main__":
     parser.add_argument(
         "--version", default=1, type=int, help="the version to export with"
     )
-    parser.add_argument('--quantize', action='store_true')
     parser.add_argument(
-        "--dtype", type=str, help="dtype of the model (fp16, fp32)", default="fp32"
+        "--quantize", nargs="?", const="q8", choices=QUANTIZATIONS,
+        help="quantize the weights: q8 (the default), q4, or q4 with mins (q4min)",
+    )
+    parser.add_argument(
+        "--group-size", type=int, help="quantization group size, default 64 for q8 and 32 for q4"
+    )
+    parser.add_argument(
+        "--dtype", choices=DTYPES, default="fp32",
+        help="dtype of the weights without --quantize: fp32, fp16 or bf16",
     )
 
     group = parser.add_mutually_exclusive_group(required=True)
@@ -371,7 +495,8 @@ if __name__ == "__main__":
     group.add_argument("--meta-llama", type=str, help="meta llama model path")
     group.add_argument("--hf", type=str, help="huggingface model path")
     args = parser.parse_args()
-    dtype = {"fp16": torch.float16, "fp32": torch.float32}[args.dtype]
+    if args.quantize and args.dtype != "fp32":
+        parser.error("--dtype can't be combined with --quantize")
 
     if args.checkpoint:
         model = load_checkpoint(args.checkpoint)
@@ -384,4 +509,4 @@ if __name__ == "__main__":
         parser.error("Can't load input model!")
 
     # export
-    model_export(model, args.filepath, args.version, args.quantize, args.dtype)
+    model_export(model, args.filepath, args.version, args.quantize, args.dtype, args.group_size)
@@ -0,0 +1,928 @@
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "ThreadPool.h"
+#include "kernels.h"
+
+namespace kernels
+{
+
+namespace
+{
+
+// the widest instruction set dispatched to, see limitInstructionSet()
+InstructionSet widest = AVX512;
+
+// Number of output rows computed together: every block of x is loaded once
+// and multiplied with ROWS rows of W.
+constexpr size_t ROWS = 4;
+
+// The pairs of rows of gated products have to be computed by the same call.
+static_assert(0 == ROWS % 2);
+
+// computes xout[row..row+R) for a kernel processing R rows per call
+using RowsKernel = void (*)(float *xout, QuantizedView const &x, QuantizedView const &w, size_t row);
+
+struct QuantizedKernel
+{
+    char const *name;
+    RowsKernel rows;   // ROWS rows per call
+    RowsKernel single; // one row per call, for the remainder
+};
+
+using FloatRowsKernel = void (*)(float *xout, std::span<float const> x, std::span<float const> w, size_t row);
+
+struct FloatKernel
+{
+    char const *name;
+    FloatRowsKernel rows;
+    FloatRowsKernel single;
+};
+
+using Q4RowsKernel = void (*)(float *xout, QuantizedView const &x, Q4View const &w, size_t row);
+
+using HalfRowsKernel = void (*)(float *xout, std::span<float const> x, HalfView const &w, size_t row);
+
+struct HalfKernel
+{
+    char const *name;
+    HalfRowsKernel rows;
+    HalfRowsKernel single;
+};
+
+struct Q4Kernel
+{
+    char const *name;
+    Q4RowsKernel rows;
+    Q4RowsKernel single;
+};
+
+void rowReference(float *xout, QuantizedView const &x, QuantizedView const &w, size_t row)
+{
+    int groupSize = x.groupSize;
+
+    int n = x.q.size();
+    int in = row * n;
+    float val = 0.0f;
+
+    // do the matmul in groups of GS
+    for (int j = 0; j <= n - groupSize; j += groupSize)
+    {
+        float ival = static_cast<float>(
+            std::inner_product(x.q.data() + j, x.q.data() + j + groupSize, w.q.data() + in + j,
+                               static_cast<int32_t>(0), std::plus<int32_t>(), [](int8_t x, int8_t w)
+                               { return static_cast<int32_t>(x) * static_cast<int32_t>(w); }));
+
+        val += (ival)*w.s[(in + j) / groupSize] * x.s[j / groupSize];
+    }
+
+    xout[row] = val;
+}
+
+void rowsReference(float *xout, QuantizedView const &x, QuantizedView const &w, size_t row)
+{
+    for (size_t r = 0; r < ROWS; r++)
+        rowReference(xout, x, w, row + r);
+}
+
+template <size_t R> void rowsFloat(float *xout, std::span<float const> x, std::span<float const> w, size_t row)
+{
+    size_t n = x.size();
+    for (size_t r = 0; r < R; r++)
+        xout[row + r] = std::inner_product(x.begin(), x.end(), w.begin() + (row + r) * n, 0.0f);
+}
+
+template <bool BFloat16> inline float widen(uint16_t h) { return BFloat16 ? fromBFloat16(h) : fromFloat16(h); }
+
+template <size_t R, bool BFloat16>
+void rowsHalfReference(float *xout, std::span<float const> x, HalfView const &w, size_t row)
+{
+    size_t n = x.size();
+    for (size_t r = row; r < row + R; r++)
+    {
+        uint16_t const *wr = w.h.data() + r * n;
+        float val = 0.0f;
+        for (size_t j = 0; j < n; j++)
+            val += widen<BFloat16>(wr[j]) * x[j];
+        xout[r] = val;
+    }
+}
+
+// the nibble of value j of a row of packed blocks
+inline int nibble(uint8_t const *q, size_t j)
+{
+    uint8_t byte = q[j / 32 * 16 + j % 16];
+    return j % 32 < 16 ? byte & 0x0f : byte >> 4;
+}
+
+// the weights of a group are (nibble - 8) * scale, or nibble * scale + min,
+// so a group of the product only needs sum(nibble * x) and sum(x)
+void rowQ4Reference(float *xout, QuantizedView const &x, Q4View const &w, size_t row)
+{
+    size_t n = x.q.size();
+    size_t groupSize = w.groupSize;
+    size_t nGroups = n / groupSize;
+    uint8_t const *wq = w.q.data() + row * n / 2;
+
+    float val = 0.0f;
+    for (size_t g = 0; g < nGroups; g++)
+    {
+        int32_t sumi = 0;
+        int32_t sumx = 0;
+        for (size_t j = g * groupSize; j < (g + 1) * groupSize; j++)
+        {
+            sumi += nibble(wq, j) * x.q[j];
+            sumx += x.q[j];
+        }
+
+        float scale = fromFloat16(w.s[row * nGroups + g]);
+        if (w.min.empty())
+            val += scale * x.s[g] * static_cast<float>(sumi - 8 * sumx);
+        else
+            val += x.s[g] * (scale * sumi + fromFloat16(w.min[row * nGroups + g]) * sumx);
+    }
+
+    xout[row] = val;
+}
+
+void rowsQ4Reference(float *xout, QuantizedView const &x, Q4View const &w, size_t row)
+{
+    for (size_t r = 0; r < ROWS; r++)
+        rowQ4Reference(xout, x, w, row + r);
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2,fma"))) inline float horizontalSum(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+// 32 int8 products per step: maddubs needs an unsigned operand, so |x| is
+// multiplied with w carrying the sign of x, then the int16 pairs are widened
+// by madd. Group sizes have to be multiples of 32.
+template <size_t R>
+__attribute__((target("avx2,fma"))) void rowsAVX2(float *xout, QuantizedView const &x, QuantizedView const &w,
+                                                 size_t row)
+{
+    size_t n = x.q.size();
+    size_t groupSize = x.groupSize;
+    size_t nGroups = n / groupSize;
+
+    int8_t const *wq[R];
+    float const *ws[R];
+    __m256 acc[R];
+    for (size_t r = 0; r < R; r++)
+    {
+        wq[r] = w.q.data() + (row + r) * n;
+        ws[r] = w.s.data() + (row + r) * nGroups;
+        acc[r] = _mm256_setzero_ps();
+    }
+
+    __m256i const ones = _mm256_set1_epi16(1);
+
+    for (size_t g = 0; g < nGroups; g++)
+    {
+        __m256i isum[R];
+        for (size_t r = 0; r < R; r++)
+            isum[r] = _mm256_setzero_si256();
+
+        for (size_t j = g * groupSize; j < (g + 1) * groupSize; j += 32)
+        {
+            __m256i xv = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(x.q.data() + j));
+            __m256i ax = _mm256_sign_epi8(xv, xv);
+
+            for (size_t r = 0; r < R; r++)
+            {
+                __m256i wv = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(wq[r] + j));
+                __m256i products = _mm256_maddubs_epi16(ax, _mm256_sign_epi8(wv, xv));
+                isum[r] = _mm256_add_epi32(isum[r], _mm256_madd_epi16(products, ones));
+            }
+        }
+
+        // scale the integer sums of the group while accumulating
+        float xs = x.s[g];
+        for (size_t r = 0; r < R; r++)
+            acc[r] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(isum[r]), _mm256_set1_ps(ws[r][g] * xs), acc[r]);
+    }
+
+    for (size_t r = 0; r < R; r++)
+        xout[row + r] = horizontalSum(acc[r]);
+}
+
+// The maskz forms of the intrinsics are used below, the unmasked ones trip
+// -Wuninitialized on _mm512_undefined_* in GCC 12.
+__attribute__((target("avx512f,avx512dq"))) inline float horizontalSum(__m512 v)
+{
+    __m256 s = _mm256_add_ps(_mm512_maskz_extractf32x8_ps(0xff, v, 0), _mm512_maskz_extractf32x8_ps(0xff, v, 1));
+    __m128 s4 = _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+    s4 = _mm_add_ps(s4, _mm_movehl_ps(s4, s4));
+    s4 = _mm_add_ss(s4, _mm_movehdup_ps(s4));
+    return _mm_cvtss_f32(s4);
+}
+
+// 64 int8 products per step with vpdpbusd, which also takes an unsigned and a
+// signed operand. AVX-512 has no sign instruction, so w is negated under the
+// mask of the negative x values. Group sizes have to be multiples of 64.
+template <size_t R>
+__attribute__((target("avx512f,avx512bw,avx512dq,avx512vnni"))) void rowsVNNI(float *xout, QuantizedView const &x,
+                                                                     QuantizedView const &w, size_t row)
+{
+    size_t n = x.q.size();
+    size_t groupSize = x.groupSize;
+    size_t nGroups = n / groupSize;
+
+    int8_t const *wq[R];
+    float const *ws[R];
+    __m512 acc[R];
+    for (size_t r = 0; r < R; r++)
+    {
+        wq[r] = w.q.data() + (row + r) * n;
+        ws[r] = w.s.data() + (row + r) * nGroups;
+        acc[r] = _mm512_setzero_ps();
+    }
+
+    __m512i const zero = _mm512_setzero_si512();
+
+    for (size_t g = 0; g < nGroups; g++)
+    {
+        __m512i isum[R];
+        for (size_t r = 0; r < R; r++)
+            isum[r] = _mm512_setzero_si512();
+
+        for (size_t j = g * groupSize; j < (g + 1) * groupSize; j += 64)
+        {
+            __m512i xv = _mm512_loadu_si512(x.q.data() + j);
+            __m512i ax = _mm512_abs_epi8(xv);
+            __mmask64 negative = _mm512_movepi8_mask(xv);
+
+            for (size_t r = 0; r < R; r++)
+            {
+                __m512i wv = _mm512_loadu_si512(wq[r] + j);
+                isum[r] = _mm512_dpbusd_epi32(isum[r], ax, _mm512_mask_sub_epi8(wv, negative, zero, wv));
+            }
+        }
+
+        float xs = x.s[g];
+        for (size_t r = 0; r < R; r++)
+            acc[r] = _mm512_fmadd_ps(_mm512_maskz_cvtepi32_ps(0xffff, isum[r]), _mm512_set1_ps(ws[r][g] * xs), acc[r]);
+    }
+
+    for (size_t r = 0; r < R; r++)
+        xout[row + r] = horizontalSum(acc[r]);
+}
+
+// A block of 32 nibbles is unpacked in one register: the low nibbles of its
+// 16 bytes are the values 0..15, the high ones 16..31. The nibbles are
+// unsigned, so maddubs multiplies them with x directly. Group sizes have to
+// be multiples of 32.
+template <size_t R, bool WithMin>
+__attribute__((target("avx2,fma"))) void rowsQ4AVX2(float *xout, QuantizedView const &x, Q4View const &w, size_t row)
+{
+    size_t n = x.q.size();
+    size_t groupSize = w.groupSize;
+    size_t nGroups = n / groupSize;
+
+    uint8_t const *wq[R];
+    uint16_t const *ws[R];
+    uint16_t const *wm[R];
+    __m256 acc[R];
+    for (size_t r = 0; r < R; r++)
+    {
+        wq[r] = w.q.data() + (row + r) * n / 2;
+        ws[r] = w.s.data() + (row + r) * nGroups;
+        wm[r] = WithMin ? w.min.data() + (row + r) * nGroups : nullptr;
+        acc[r] = _mm256_setzero_ps();
+    }
+
+    __m256i const ones = _mm256_set1_epi16(1);
+    __m256i const oneBytes = _mm256_set1_epi8(1);
+    __m256i const lowNibbles = _mm256_set1_epi8(0x0f);
+
+    for (size_t g = 0; g < nGroups; g++)
+    {
+        __m256i isum[R];
+        for (size_t r = 0; r < R; r++)
+            isum[r] = _mm256_setzero_si256();
+        __m256i xsum = _mm256_setzero_si256();
+
+        for (size_t j = g * groupSize; j < (g + 1) * groupSize; j += 32)
+        {
+            __m256i xv = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(x.q.data() + j));
+            xsum = _mm256_add_epi32(xsum, _mm256_madd_epi16(_mm256_maddubs_epi16(oneBytes, xv), ones));
+
+            for (size_t r = 0; r < R; r++)
+            {
+                __m128i packed = _mm_loadu_si128(reinterpret_cast<__m128i const *>(wq[r] + j / 2));
+                __m256i wv = _mm256_and_si256(_mm256_set_m128i(_mm_srli_epi16(packed, 4), packed), lowNibbles);
+                isum[r] = _mm256_add_epi32(isum[r], _mm256_madd_epi16(_mm256_maddubs_epi16(wv, xv), ones));
+            }
+        }
+
+        float xs = x.s[g];
+        for (size_t r = 0; r < R; r++)
+        {
+            __m256 scale = _mm256_set1_ps(fromFloat16(ws[r][g]) * xs);
+            if constexpr (WithMin)
+            {
+                acc[r] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(isum[r]), scale, acc[r]);
+                acc[r] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(xsum), _mm256_set1_ps(fromFloat16(wm[r][g]) * xs), acc[r]);
+            }
+            else
+            {
+                __m256i centered = _mm256_sub_epi32(isum[r], _mm256_slli_epi32(xsum, 3));
+                acc[r] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(centered), scale, acc[r]);
+            }
+        }
+    }
+
+    for (size_t r = 0; r < R; r++)
+        xout[row + r] = horizontalSum(acc[r]);
+}
+
+// 64 values per step with vpdpbusd, which takes the unsigned nibbles and the
+// signed x as they are. The two blocks of a step may belong to different
+// groups, so the scales are applied per step, each half of the lanes with
+// the scale of its block. Rows have to be multiples of 64 values long.
+__attribute__((target("avx512f,avx512dq"))) inline __m512 halves(uint16_t low, uint16_t high)
+{
+    return _mm512_maskz_cvtph_ps(0xffff, _mm256_set_m128i(_mm_set1_epi16(high), _mm_set1_epi16(low)));
+}
+
+template <size_t R, bool WithMin>
+__attribute__((target("avx512f,avx512bw,avx512dq,avx512vnni"))) void rowsQ4VNNI(float *xout, QuantizedView const &x,
+                                                                       Q4View const &w, size_t row)
+{
+    size_t n = x.q.size();
+    size_t groupSize = w.groupSize;
+    size_t nGroups = n / groupSize;
+
+    uint8_t const *wq[R];
+    uint16_t const *ws[R];
+    uint16_t const *wm[R];
+    __m512 acc[R];
+    for (size_t r = 0; r < R; r++)
+    {
+        wq[r] = w.q.data() + (row + r) * n / 2;
+        ws[r] = w.s.data() + (row + r) * nGroups;
+        wm[r] = WithMin ? w.min.data() + (row + r) * nGroups : nullptr;
+        acc[r] = _mm512_setzero_ps();
+    }
+
+    __m512i const zero = _mm512_setzero_si512();
+    __m512i const oneBytes = _mm512_set1_epi8(1);
+    __m512i const lowNibbles = _mm512_set1_epi8(0x0f);
+    int64_t const high = 0x0004000400040004; // shift every int16 by 4
+    __m512i const nibbleShifts = _mm512_set_epi64(high, high, 0, 0, high, high, 0, 0);
+
+    for (size_t j = 0; j < n; j += 64)
+    {
+        size_t g0 = j / groupSize;
+        size_t g1 = (j + 32) / groupSize;
+
+        __m512i xv = _mm512_loadu_si512(x.q.data() + j);
+        __m512i xsum = _mm512_dpbusd_epi32(zero, oneBytes, xv);
+        __m512 xs = _mm512_maskz_insertf32x8(0xffff, _mm512_set1_ps(x.s[g0]), _mm256_set1_ps(x.s[g1]), 1);
+
+        for (size_t r = 0; r < R; r++)
+        {
+            // the bytes of block 0 twice, then the ones of block 1 twice, of
+            // which the low and then the high nibbles are kept
+            __m512i packed = _mm512_castsi256_si512(
+                _mm256_loadu_si256(reinterpret_cast<__m256i const *>(wq[r] + j / 2)));
+            packed = _mm512_maskz_shuffle_i64x2(0xff, packed, packed, _MM_SHUFFLE(1, 1, 0, 0));
+            __m512i wv = _mm512_and_si512(_mm512_srlv_epi16(packed, nibbleShifts), lowNibbles);
+
+            __m512i isum = _mm512_dpbusd_epi32(zero, wv, xv);
+            __m512 scale = _mm512_mul_ps(halves(ws[r][g0], ws[r][g1]), xs);
+            if constexpr (WithMin)
+            {
+                acc[r] = _mm512_fmadd_ps(_mm512_maskz_cvtepi32_ps(0xffff, isum), scale, acc[r]);
+                acc[r] = _mm512_fmadd_ps(_mm512_maskz_cvtepi32_ps(0xffff, xsum),
+                                         _mm512_mul_ps(halves(wm[r][g0], wm[r][g1]), xs), acc[r]);
+            }
+            else
+            {
+                __m512i centered = _mm512_sub_epi32(isum, _mm512_maskz_slli_epi32(0xffff, xsum, 3));
+                acc[r] = _mm512_fmadd_ps(_mm512_maskz_cvtepi32_ps(0xffff, centered), scale, acc[r]);
+            }
+        }
+    }
+
+    for (size_t r = 0; r < R; r++)
+        xout[row + r] = horizontalSum(acc[r]);
+}
+
+// 8 weights per step, converted by F16C, or for bfloat16 widened to 32 bits
+// and shifted into the upper half
+template <bool BFloat16> __attribute__((target("avx2,fma,f16c"))) inline __m256 load8(uint16_t const *h)
+{
+    __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(h));
+    if constexpr (BFloat16)
+        return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(v), 16));
+    else
+        return _mm256_cvtph_ps(v);
+}
+
+template <size_t R, bool BFloat16>
+__attribute__((target("avx2,fma,f16c"))) void rowsHalfAVX2(float *xout, std::span<float const> x, HalfView const &w,
+                                                          size_t row)
+{
+    size_t n = x.size();
+
+    uint16_t const *wr[R];
+    __m256 acc[R];
+    for (size_t r = 0; r < R; r++)
+    {
+        wr[r] = w.h.data() + (row + r) * n;
+        acc[r] = _mm256_setzero_ps();
+    }
+
+    size_t j = 0;
+    for (; j + 8 <= n; j += 8)
+    {
+        __m256 xv = _mm256_loadu_ps(x.data() + j);
+        for (size_t r = 0; r < R; r++)
+            acc[r] = _mm256_fmadd_ps(load8<BFloat16>(wr[r] + j), xv, acc[r]);
+    }
+
+    for (size_t r = 0; r < R; r++)
+    {
+        float val = horizontalSum(acc[r]);
+        for (size_t k = j; k < n; k++)
+            val += widen<BFloat16>(wr[r][k]) * x[k];
+        xout[row + r] = val;
+    }
+}
+
+template <bool BFloat16> __attribute__((target("avx512f"))) inline __m512 load16(uint16_t const *h)
+{
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(h));
+    if constexpr (BFloat16)
+        return _mm512_castsi512_ps(_mm512_maskz_slli_epi32(0xffff, _mm512_maskz_cvtepu16_epi32(0xffff, v), 16));
+    else
+        return _mm512_maskz_cvtph_ps(0xffff, v);
+}
+
+template <size_t R, bool BFloat16>
+__attribute__((target("avx512f,avx512dq"))) void rowsHalfAVX512(float *xout, std::span<float const> x,
+                                                               HalfView const &w, size_t row)
+{
+    size_t n = x.size();
+
+    uint16_t const *wr[R];
+    __m512 acc[R];
+    for (size_t r = 0; r < R; r++)
+    {
+        wr[r] = w.h.data() + (row + r) * n;
+        acc[r] = _mm512_setzero_ps();
+    }
+
+    size_t j = 0;
+    for (; j + 16 <= n; j += 16)
+    {
+        __m512 xv = _mm512_loadu_ps(x.data() + j);
+        for (size_t r = 0; r < R; r++)
+            acc[r] = _mm512_fmadd_ps(load16<BFloat16>(wr[r] + j), xv, acc[r]);
+    }
+
+    for (size_t r = 0; r < R; r++)
+    {
+        float val = horizontalSum(acc[r]);
+        for (size_t k = j; k < n; k++)
+            val += widen<BFloat16>(wr[r][k]) * x[k];
+        xout[row + r] = val;
+    }
+}
+
+#endif
+
+// the quantized activations of a single position
+QuantizedView tokenView(QuantizedView const &x, size_t token, size_t n)
+{
+    return {x.groupSize, x.q.subspan(token * n, n), x.s.subspan(token * n / x.groupSize, n / x.groupSize)};
+}
+
+// the float activations of a single position
+std::span<float const> tokenView(std::span<float const> x, size_t token, size_t n) { return x.subspan(token * n, n); }
+
+size_t valueCount(QuantizedView const &x) { return x.q.size(); }
+size_t valueCount(std::span<float const> x) { return x.size(); }
+
+QuantizedKernel const &selectKernel(GroupSize groupSize)
+{
+    static QuantizedKernel const reference{"reference", rowsReference, rowReference};
+
+#if defined(__x86_64__)
+    static QuantizedKernel const avx2{"avx2", rowsAVX2<ROWS>, rowsAVX2<1>};
+    static QuantizedKernel const vnni{"avx512-vnni", rowsVNNI<ROWS>, rowsVNNI<1>};
+
+    static bool const hasAVX2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    static bool const hasVNNI = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+                                __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vnni");
+
+    if (hasVNNI && AVX512 <= widest && 0 == groupSize % 64)
+        return vnni;
+    if (hasAVX2 && AVX2 <= widest && 0 == groupSize % 32)
+        return avx2;
+#endif
+
+    return reference;
+}
+
+Q4Kernel const &selectQ4Kernel(GroupSize groupSize, bool withMin, size_t n)
+{
+    static Q4Kernel const reference{"reference", rowsQ4Reference, rowQ4Reference};
+
+#if defined(__x86_64__)
+    static Q4Kernel const avx2{"avx2", rowsQ4AVX2<ROWS, false>, rowsQ4AVX2<1, false>};
+    static Q4Kernel const avx2Min{"avx2", rowsQ4AVX2<ROWS, true>, rowsQ4AVX2<1, true>};
+    static Q4Kernel const vnni{"avx512-vnni", rowsQ4VNNI<ROWS, false>, rowsQ4VNNI<1, false>};
+    static Q4Kernel const vnniMin{"avx512-vnni", rowsQ4VNNI<ROWS, true>, rowsQ4VNNI<1, true>};
+
+    static bool const hasAVX2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    static bool const hasVNNI = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+                                __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vnni");
+
+    if (hasVNNI && AVX512 <= widest && 0 == groupSize % 32 && 0 == n % 64)
+        return withMin ? vnniMin : vnni;
+    if (hasAVX2 && AVX2 <= widest && 0 == groupSize % 32)
+        return withMin ? avx2Min : avx2;
+#endif
+
+    return reference;
+}
+
+HalfKernel const &selectHalfKernel(bool bfloat16)
+{
+    static HalfKernel const reference{"reference", rowsHalfReference<ROWS, false>, rowsHalfReference<1, false>};
+    static HalfKernel const referenceBF16{"reference", rowsHalfReference<ROWS, true>, rowsHalfReference<1, true>};
+
+#if defined(__x86_64__)
+    static HalfKernel const avx2{"avx2", rowsHalfAVX2<ROWS, false>, rowsHalfAVX2<1, false>};
+    static HalfKernel const avx2BF16{"avx2", rowsHalfAVX2<ROWS, true>, rowsHalfAVX2<1, true>};
+    static HalfKernel const avx512{"avx512", rowsHalfAVX512<ROWS, false>, rowsHalfAVX512<1, false>};
+    static HalfKernel const avx512BF16{"avx512", rowsHalfAVX512<ROWS, true>, rowsHalfAVX512<1, true>};
+
+    static bool const hasAVX2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+                                __builtin_cpu_supports("f16c");
+    static bool const hasAVX512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq");
+
+    if (hasAVX512 && AVX512 <= widest)
+        return bfloat16 ? avx512BF16 : avx512;
+    if (hasAVX2 && AVX2 <= widest)
+        return bfloat16 ? avx2BF16 : avx2;
+#endif
+
+    return bfloat16 ? referenceBF16 : reference;
+}
+
+FloatKernel const floatKernel{"reference", rowsFloat<ROWS>, rowsFloat<1>};
+
+// gated[i] = silu(products[2i]) * products[2i + 1] for the n / 2 pairs
+inline void swiglu(float *gated, float const *products, size_t n)
+{
+    for (size_t i = 0; i < n / 2; i++)
+    {
+        float val = products[2 * i];
+        val *= (1.0f / (1.0f + std::exp(-val)));
+        gated[i] = val * products[2 * i + 1];
+    }
+}
+
+// W (d,n) @ x (nTokens,n) -> xout (nTokens,d), the blocks of ROWS rows
+// followed by one block of the remaining single rows, and the SwiGLU of the
+// rows of a block if gated is given
+template <typename Kernel, typename X, typename View>
+void matmulRows(FloatTensor &xout, X const &x, View const &w, Kernel const &kernel, size_t nTokens, float *gated)
+{
+    size_t n = valueCount(x) / nTokens;
+    size_t d = xout.size() / nTokens;
+    size_t nBlocks = (d + ROWS - 1) / ROWS;
+
+    if (gated && 0 != d % 2)
+        throw std::runtime_error("Gated products need pairs of rows");
+
+    threadPool.parallelFor(nBlocks,
+                           [&](size_t b)
+                           {
+                               size_t row = b * ROWS;
+                               size_t rows = std::min(ROWS, d - row);
+
+                               for (size_t t = 0; t < nTokens; t++)
+                               {
+                                   float *out = xout.data() + t * d;
+                                   if (ROWS == rows)
+                                       kernel.rows(out, tokenView(x, t, n), w, row);
+                                   else
+                                       for (size_t r = row; r < d; r++)
+                                           kernel.single(out, tokenView(x, t, n), w, r);
+
+                                   if (gated)
+                                       swiglu(gated + (t * d + row) / 2, out + row, rows);
+                               }
+                           });
+}
+
+#if defined(__AVX2__) && defined(__FMA__)
+
+// exp of 8 values with the polynomial of the Cephes expf, the relative error
+// is below 2e-7, values below the smallest normal float become 0
+inline __m256 exp8(__m256 x)
+{
+    __m256 underflow = _mm256_cmp_ps(x, _mm256_set1_ps(-87.3f), _CMP_LT_OQ);
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.3f)), _mm256_set1_ps(88.3f));
+
+    // x = n ln 2 + r with |r| <= ln 2 / 2, ln 2 split in two parts for precision
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)),
+                               _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), r);
+
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+
+    // times 2^n, built in the exponent bits
+    __m256i scale = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_andnot_ps(underflow, _mm256_mul_ps(p, _mm256_castsi256_ps(scale)));
+}
+
+#endif
+
+} // namespace
+
+void limitInstructionSet(InstructionSet set) { widest = set; }
+
+void matmulFloat(FloatTensor &xout, std::span<float const> x, std::span<float const> w, size_t nTokens,
+                 float *gated)
+{
+    matmulRows(xout, x, w, floatKernel, nTokens, gated);
+}
+
+void matmulFloat(FloatTensor &xout, std::span<float const> x, HalfView const &w, size_t nTokens, float *gated)
+{
+    matmulRows(xout, x, w, selectHalfKernel(w.bfloat16), nTokens, gated);
+}
+
+void matmulFloatReference(FloatTensor &xout, std::span<float const> x, HalfView const &w, size_t nTokens)
+{
+    size_t n = x.size() / nTokens;
+    size_t d = xout.size() / nTokens;
+    auto compute = w.bfloat16 ? rowsHalfReference<1, true> : rowsHalfReference<1, false>;
+
+    threadPool.parallelFor(d,
+                           [&](size_t i)
+                           {
+                               for (size_t t = 0; t < nTokens; t++)
+                                   compute(xout.data() + t * d, tokenView(x, t, n), w, i);
+                           });
+}
+
+char const *matmulHalfKernel(bool bfloat16) { return selectHalfKernel(bfloat16).name; }
+
+void matmulQuantized(FloatTensor &xout, QuantizedView const &x, QuantizedView const &w, size_t nTokens,
+                     float *gated)
+{
+    // W (d,n) @ x (nTokens,n) -> xout (nTokens,d)
+    // by far the most amount of time is spent inside this little function
+    // inputs to this function are both quantized
+    matmulRows(xout, x, w, selectKernel(x.groupSize), nTokens, gated);
+}
+
+void matmulQuantizedReference(FloatTensor &xout, QuantizedView const &x, QuantizedView const &w, size_t nTokens)
+{
+    size_t n = x.q.size() / nTokens;
+    size_t d = xout.size() / nTokens;
+
+    threadPool.parallelFor(d,
+                           [&](size_t i)
+                           {
+                               for (size_t t = 0; t < nTokens; t++)
+                                   rowReference(xout.data() + t * d, tokenView(x, t, n), w, i);
+                           });
+}
+
+char const *matmulQuantizedKernel(GroupSize groupSize) { return selectKernel(groupSize).name; }
+
+void matmulQ4(FloatTensor &xout, QuantizedView const &x, Q4View const &w, size_t nTokens, float *gated)
+{
+    if (x.groupSize != w.groupSize)
+        throw std::runtime_error("The activations have to be quantized with the group size of the weights");
+
+    matmulRows(xout, x, w, selectQ4Kernel(w.groupSize, !w.min.empty(), x.q.size() / nTokens), nTokens, gated);
+}
+
+void matmulQ4Reference(FloatTensor &xout, QuantizedView const &x, Q4View const &w, size_t nTokens)
+{
+    size_t n = x.q.size() / nTokens;
+    size_t d = xout.size() / nTokens;
+
+    threadPool.parallelFor(d,
+                           [&](size_t i)
+                           {
+                               for (size_t t = 0; t < nTokens; t++)
+                                   rowQ4Reference(xout.data() + t * d, tokenView(x, t, n), w, i);
+                           });
+}
+
+char const *matmulQ4Kernel(GroupSize groupSize, size_t n) { return selectQ4Kernel(groupSize, false, n).name; }
+
+void quantizeQ8(int8_t *q, float *s, float const *x, size_t n, GroupSize groupSize)
+{
+    for (size_t g = 0; g < n / groupSize; g++, x += groupSize, q += groupSize)
+    {
+        float wmax = 0.0f;
+        for (size_t i = 0; i < groupSize; i++)
+            wmax = std::max(wmax, std::abs(x[i]));
+
+        float scale = wmax / 127.0f;
+        s[g] = scale;
+        for (size_t i = 0; i < groupSize; i++)
+            q[i] = 0.0f == scale ? 0 : static_cast<int8_t>(std::round(x[i] / scale));
+    }
+}
+
+void quantizeQ4(Q4Tensor &dest, std::span<float const> x, GroupSize groupSize, bool withMin)
+{
+    size_t nGroups = x.size() / groupSize;
+
+    dest.groupSize = groupSize;
+    dest.q.assign(x.size() / 2, 0);
+    dest.s.resize(nGroups);
+    dest.min.resize(withMin ? nGroups : 0);
+
+    for (size_t g = 0; g < nGroups; g++)
+    {
+        float const *group = x.data() + g * groupSize;
+
+        // the values are quantized with the rounded scale and min
+        float min = 0.0f;
+        int offset = 0;
+        if (withMin)
+        {
+            auto [lowest, highest] = std::minmax_element(group, group + groupSize);
+            dest.min[g] = toFloat16(*lowest);
+            min = fromFloat16(dest.min[g]);
+            dest.s[g] = toFloat16((*highest - min) / 15.0f);
+        }
+        else
+        {
+            auto extreme = std::max_element(group, group + groupSize,
+                                            [](float a, float b) { return std::abs(a) < std::abs(b); });
+            dest.s[g] = toFloat16(*extreme / -8.0f);
+            offset = 8;
+        }
+
+        float scale = fromFloat16(dest.s[g]);
+        float inverse = 0.0f != scale ? 1.0f / scale : 0.0f;
+
+        for (size_t i = 0; i < groupSize; i++)
+        {
+            int value = std::clamp(static_cast<int>(std::round((group[i] - min) * inverse)) + offset, 0, 15);
+            size_t j = g * groupSize + i;
+            dest.q[j / 32 * 16 + j % 16] |= j % 32 < 16 ? value : value << 4;
+        }
+    }
+}
+
+void widen(float *dest, HalfView const &w, size_t first, size_t n)
+{
+    for (size_t j = first; j < first + n; j++)
+        *dest++ = w.bfloat16 ? fromBFloat16(w.h[j]) : fromFloat16(w.h[j]);
+}
+
+void dequantizeQ4(float *dest, Q4View const &w, size_t first, size_t n)
+{
+    for (size_t j = first; j < first + n; j++)
+    {
+        size_t g = j / w.groupSize;
+        float scale = fromFloat16(w.s[g]);
+        *dest++ = w.min.empty() ? (nibble(w.q.data(), j) - 8) * scale
+                                : nibble(w.q.data(), j) * scale + fromFloat16(w.min[g]);
+    }
+}
+
+float maxValue(float const *x, size_t n)
+{
+    size_t i = 0;
+    float maxVal = -std::numeric_limits<float>::infinity();
+
+#if defined(__AVX2__)
+    __m256 vmax = _mm256_set1_ps(maxVal);
+    for (; i + 8 <= n; i += 8)
+        vmax = _mm256_max_ps(vmax, _mm256_loadu_ps(x + i));
+
+    alignas(32) float lanes[8];
+    _mm256_store_ps(lanes, vmax);
+    maxVal = *std::max_element(lanes, lanes + 8);
+#endif
+
+    for (; i < n; i++)
+        maxVal = std::max(maxVal, x[i]);
+
+    return maxVal;
+}
+
+float softmaxWeights(float const *x, float *y, size_t n, float temperature)
+{
+    // find max value (for numerical stability)
+    float maxVal = maxValue(x, n);
+
+    // exp and sum
+    float scale = 1.0f / temperature;
+    float sum = 0.0f;
+    size_t i = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+    __m256 vsum = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 v = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_set1_ps(maxVal)),
+                                 _mm256_set1_ps(scale));
+        v = exp8(v);
+        _mm256_storeu_ps(y + i, v);
+        vsum = _mm256_add_ps(vsum, v);
+    }
+    sum = horizontalSum(vsum);
+#endif
+    for (; i < n; i++)
+    {
+        y[i] = std::exp((x[i] - maxVal) * scale);
+        sum += y[i];
+    }
+
+    return sum;
+}
+
+void softmax(float *first, float *last)
+{
+    float sum = softmaxWeights(first, first, last - first);
+
+    // normalize
+    float inverse = 1.0f / sum;
+    for (auto it = first; it != last; ++it)
+        *it *= inverse;
+}
+
+size_t indicesAtLeast(float const *x, size_t n, float threshold, uint32_t *indices)
+{
+    size_t i = 0;
+    size_t count = 0;
+
+#if defined(__AVX2__)
+    // usually few values pass, test them 8 at a time
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 ge = _mm256_cmp_ps(_mm256_loadu_ps(x + i), _mm256_set1_ps(threshold), _CMP_GE_OQ);
+        for (unsigned mask = _mm256_movemask_ps(ge); 0 != mask; mask &= mask - 1)
+            indices[count++] = i + std::countr_zero(mask);
+    }
+#endif
+
+    for (; i < n; i++)
+        if (x[i] >= threshold)
+            indices[count++] = i;
+
+    return count;
+}
+
+void rotate(float *x, float const *cos, float const *sin, size_t n)
+{
+    size_t j = 0;
+
+#if defined(__AVX2__) && defined(__FMA__)
+    // x * cos + swapped pairs of x * sin
+    for (; j + 8 <= n; j += 8)
+    {
+        __m256 v = _mm256_loadu_ps(x + j);
+        __m256 swapped = _mm256_permute_ps(v, 0xb1);
+        _mm256_storeu_ps(x + j, _mm256_fmadd_ps(v, _mm256_loadu_ps(cos + j),
+                                                _mm256_mul_ps(swapped, _mm256_loadu_ps(sin + j))));
+    }
+#endif
+
+    for (; j < n; j += 2)
+    {
+        float x0 = x[j];
+        float x1 = x[j + 1];
+        x[j] = x0 * cos[j] + x1 * sin[j];
+        x[j + 1] = x1 * cos[j + 1] + x0 * sin[j + 1];
+    }
+}
+
+} // namespace kernels
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <span>
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+#include "Tensor.h"
+
+// ----------------------------------------------------------------------------
+// Matrix products used by Linear. x holds the activations of nTokens
+// positions, one row each, and every row of W is multiplied with all of them
+// while it is in the cache. The quantized product is dispatched at runtime to
+// the widest kernel the CPU supports. The smaller kernels of the attention
+// live here as well, so that they can be benchmarked on their own.
+//
+// Given gated, the rows of W are the gate and up projections of a SwiGLU,
+// interleaved row by row, and silu(gate) * up of every pair of rows is
+// written to gated (nTokens,d/2) by the thread that computed the pair, while
+// the products are still in its cache.
+
+namespace kernels
+{
+
+// The instruction sets the kernels are written for, AVX512 standing for the
+// AVX-512 kernels with or without VNNI.
+enum InstructionSet
+{
+    REFERENCE,
+    AVX2,
+    AVX512,
+};
+
+// restricts the dispatch to kernels up to the given instruction set, all of
+// them by default. The tests use it to check the narrower kernels on a wider
+// CPU. Not meant to be called while matmuls run.
+void limitInstructionSet(InstructionSet set);
+
+// W (d,n) @ x (nTokens,n) -> xout (nTokens,d)
+void matmulFloat(FloatTensor &xout, std::span<float const> x, std::span<float const> w, size_t nTokens = 1,
+                 float *gated = nullptr);
+
+// W (d,n) @ x (nTokens,n) -> xout (nTokens,d) for 16-bit float weights,
+// which are converted to float32 in registers
+void matmulFloat(FloatTensor &xout, std::span<float const> x, HalfView const &w, size_t nTokens = 1,
+                 float *gated = nullptr);
+
+// plain C++ version of the 16-bit matmulFloat
+void matmulFloatReference(FloatTensor &xout, std::span<float const> x, HalfView const &w, size_t nTokens = 1);
+
+// name of the kernel selected by the 16-bit matmulFloat
+char const *matmulHalfKernel(bool bfloat16);
+
+// W (d,n) @ x (nTokens,n) -> xout (nTokens,d), both inputs quantized with the same group size
+void matmulQuantized(FloatTensor &xout, QuantizedView const &x, QuantizedView const &w, size_t nTokens = 1,
+                     float *gated = nullptr);
+
+// plain C++ version of matmulQuantized, used as fallback and for testing the
+// SIMD kernels
+void matmulQuantizedReference(FloatTensor &xout, QuantizedView const &x, QuantizedView const &w,
+                              size_t nTokens = 1);
+
+// name of the kernel selected by matmulQuantized for the given group size
+char const *matmulQuantizedKernel(GroupSize groupSize);
+
+// W (d,n) @ x (nTokens,n) -> xout (nTokens,d) for 4-bit weights, x quantized
+// with the group size of W. The nibbles are unpacked in registers and
+// multiplied with the int8 values of x.
+void matmulQ4(FloatTensor &xout, QuantizedView const &x, Q4View const &w, size_t nTokens = 1, float *gated = nullptr);
+
+// plain C++ version of matmulQ4
+void matmulQ4Reference(FloatTensor &xout, QuantizedView const &x, Q4View const &w, size_t nTokens = 1);
+
+// name of the kernel selected by matmulQ4 for rows of n values
+char const *matmulQ4Kernel(GroupSize groupSize, size_t n);
+
+// quantizes the n values of x into groups of int8 values q with one scale s
+// per group, the value of the largest magnitude maps to +-127
+void quantizeQ8(int8_t *q, float *s, float const *x, size_t n, GroupSize groupSize);
+
+// packs x into groups of 4-bit values, see Q4Tensor. Symmetric groups map
+// the value of the largest magnitude to -8, groups with mins span [min, max].
+void quantizeQ4(Q4Tensor &dest, std::span<float const> x, GroupSize groupSize, bool withMin);
+
+// dest = the n values of w from index first on
+void dequantizeQ4(float *dest, Q4View const &w, size_t first, size_t n);
+void widen(float *dest, HalfView const &w, size_t first, size_t n);
+
+// the largest of the n values of x, -infinity if there are none
+float maxValue(float const *x, size_t n);
+
+// y = exp((x - max(x)) / temperature) for the n values of x, the softmax
+// before its normalization, returns the sum of y. y may be x.
+float softmaxWeights(float const *x, float *y, size_t n, float temperature = 1.0f);
+
+// in-place softmax of the values in [first, last)
+void softmax(float *first, float *last);
+
+// writes the indices of the values of x that are >= threshold in ascending
+// order, returns their number
+size_t indicesAtLeast(float const *x, size_t n, float threshold, uint32_t *indices);
+
+// rotates the n / 2 pairs (x[2j], x[2j+1]) by the angles given as
+// cos = (c0, c0, c1, c1, ...) and sin = (-s0, s0, -s1, s1, ...)
+void rotate(float *x, float const *cos, float const *sin, size_t n);
+
+// IEEE half precision conversion, rounding to nearest even
+using Float16 = uint16_t;
+
+inline float fromFloat16(Float16 h)
+{
+#if defined(__F16C__)
+    return _cvtsh_ss(h);
+#else
+    uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+
+    if (0 == exponent && 0 == mantissa)
+        return std::bit_cast<float>(sign);
+
+    if (0 == exponent)
+    {
+        // subnormal, normalize it
+        exponent = 127 - 15 + 1;
+        while (!(mantissa & 0x400))
+        {
+            mantissa <<= 1;
+            exponent--;
+        }
+        return std::bit_cast<float>(sign | exponent << 23 | (mantissa & 0x3ff) << 13);
+    }
+
+    if (31 == exponent)
+        return std::bit_cast<float>(sign | 0x7f800000 | mantissa << 13);
+
+    return std::bit_cast<float>(sign | (exponent + 127 - 15) << 23 | mantissa << 13);
+#endif
+}
+
+inline Float16 toFloat16(float f)
+{
+#if defined(__F16C__)
+    return _cvtss_sh(f, _MM_FROUND_TO_NEAREST_INT);
+#else
+    uint32_t x = std::bit_cast<uint32_t>(f);
+    uint32_t sign = (x >> 16) & 0x8000;
+    int32_t exponent = static_cast<int32_t>((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = x & 0x7fffff;
+
+    if (((x >> 23) & 0xff) == 0xff)
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    if (exponent >= 31)
+        return sign | 0x7c00;
+
+    if (exponent <= 0)
+    {
+        // subnormal or zero
+        if (exponent < -10)
+            return sign;
+        mantissa |= 0x800000;
+        uint32_t shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t midpoint = 1u << (shift - 1);
+        if (rest > midpoint || (rest == midpoint && (half & 1)))
+            half++;
+        return sign | half;
+    }
+
+    // a carry out of the mantissa correctly increments the exponent
+    uint32_t half = sign | exponent << 10 | mantissa >> 13;
+    uint32_t rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return half;
+#endif
+}
+
+// bfloat16 conversion, rounding to nearest even
+inline float fromBFloat16(uint16_t h) { return std::bit_cast<float>(static_cast<uint32_t>(h) << 16); }
+
+inline uint16_t toBFloat16(float f)
+{
+    uint32_t x = std::bit_cast<uint32_t>(f);
+    if ((x & 0x7fffffff) > 0x7f800000)
+        return (x >> 16) | 0x40; // quiet NaN
+    return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+} // namespace kernels
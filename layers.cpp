@@ -1,121 +1,112 @@
 #include <algorithm>
 #include <cmath>
 #include <numeric>
+#include <tuple>
 
+#include "ThreadPool.h"
+#include "Tracer.h"
+#include "kernels.h"
 #include "layers.h"
 
-namespace detail
+RotaryEmbedding::RotaryEmbedding(size_t headSize, RopeConfig const &config)
+    : headSize(headSize),
+      frequencies(headSize / 2),
+      cos(headSize),
+      sin(headSize)
 {
+    double theta = 0.0f < config.theta ? config.theta : 500000.0;
 
-inline void matmulFloat(FloatTensor &xout, FloatTensor const &x, FloatTensor const &w)
-{
-    size_t i;
-#pragma omp parallel for private(i)
-    for (i = 0; i < xout.size(); i++)
-        xout[i] = std::inner_product(x.begin(), x.end(), w.begin() + i * x.size(), 0.0f);
-}
-
-inline void matmulQuantized(FloatTensor &xout, QuantizedTensor const &x, QuantizedTensor const &w)
-{
-    // W (d,n) @ x (n,) -> xout (d,)
-    // by far the most amount of time is spent inside this little function
-    // inputs to this function are both quantized
-    int groupSize = x.groupSize;
+    for (size_t j = 0; j < frequencies.size(); j++)
+        frequencies[j] = 1.0 / std::pow(theta, 2.0 * j / headSize);
 
-    int n = x.q.size();
-    int d = xout.size();
-    int i = 0;
-
-#pragma omp parallel for private(i)
-    for (i = 0; i < d; i++)
+    if (0.0f < config.scalingFactor)
     {
-        float val = 0.0f;
-        int in = i * n;
+        if (config.highFreqFactor <= config.lowFreqFactor || config.originalSeqLength <= 0)
+            throw std::runtime_error("Invalid RoPE scaling parameters");
+
+        // Llama 3.1: the low frequencies are divided by the scaling factor,
+        // the high ones are kept, and the ones in between are interpolated
+        double lowFreqWavelength = config.originalSeqLength / config.lowFreqFactor;
+        double highFreqWavelength = config.originalSeqLength / config.highFreqFactor;
 
-        // do the matmul in groups of GS
-        for (int j = 0; j <= n - groupSize; j += groupSize)
+        for (auto &freq : frequencies)
         {
-            float ival = static_cast<float>(
-                std::inner_product(x.q.data() + j, x.q.data() + j + groupSize, w.q.data() + in + j,
-                                   static_cast<int32_t>(0), std::plus<int32_t>(), [](int8_t x, int8_t w)
-                                   { return static_cast<int32_t>(x) * static_cast<int32_t>(w); }));
+            double wavelength = 2.0 * M_PI / freq;
 
-            val += (ival)*w.s[(in + j) / groupSize] * x.s[j / groupSize];
-            ival = 0;
+            if (lowFreqWavelength < wavelength)
+                freq /= config.scalingFactor;
+            else if (highFreqWavelength <= wavelength)
+            {
+                double smooth = (config.originalSeqLength / wavelength - config.lowFreqFactor) /
+                                (config.highFreqFactor - config.lowFreqFactor);
+                freq = (1.0 - smooth) * freq / config.scalingFactor + smooth * freq;
+            }
         }
-
-        xout[i] = val;
     }
 }
 
-inline void applyRotaryEmbedding(FloatTensor &q, FloatTensor &k, size_t pos, size_t nHeads, size_t headSize,
-                                 size_t n_kv_heads)
+void RotaryEmbedding::setPositions(std::span<size_t const> positions)
 {
-    // RoPE relative positional encoding: complex-valued rotate q and k in
-    // each head
-    for (size_t i = 0; i < nHeads; i++)
+    cos.resize(positions.size() * headSize);
+    sin.resize(positions.size() * headSize);
+
+    for (size_t i = 0; i < positions.size(); i++)
     {
-        for (size_t j = 0; j < headSize; j += 2)
+        for (size_t j = 0; j < frequencies.size(); j++)
         {
-            float freq = 1.0f / powf(500000.0f, (float)j / (float)headSize);
-            float val = pos * freq;
-            float fcr = std::cos(val);
-            float fci = std::sin(val);
-            float q0 = q[i * headSize + j];
-            float q1 = q[i * headSize + j + 1];
-            q[i * headSize + j] = q0 * fcr - q1 * fci;
-            q[i * headSize + j + 1] = q0 * fci + q1 * fcr;
-            if (i < n_kv_heads)
-            {
-                float k0 = k[i * headSize + j];
-                float k1 = k[i * headSize + j + 1];
-                k[i * headSize + j] = k0 * fcr - k1 * fci;
-                k[i * headSize + j + 1] = k0 * fci + k1 * fcr;
-            }
+            double angle = static_cast<double>(positions[i]) * frequencies[j];
+            float c = static_cast<float>(std::cos(angle));
+            float s = static_cast<float>(std::sin(angle));
+
+            cos[i * headSize + 2 * j] = c;
+            cos[i * headSize + 2 * j + 1] = c;
+            sin[i * headSize + 2 * j] = -s;
+            sin[i * headSize + 2 * j + 1] = s;
         }
     }
 }
 
-inline void softmax(float *first, float *last)
+void RotaryEmbedding::apply(float *x, size_t nHeads, size_t i) const
 {
-    // find max value (for numerical stability)
-    float maxVal = *std::max_element(first, last);
-
-    // exp and sum
-    float sum = 0.0f;
-    for (auto it = first; it != last; ++it)
-    {
-        *it = std::exp(*it - maxVal);
-        sum += *it;
-    }
-
-    // normalize
-    for (auto it = first; it != last; ++it)
-        *it /= sum;
+    // RoPE relative positional encoding: complex-valued rotate each head
+    for (size_t h = 0; h < nHeads; h++)
+        kernels::rotate(x + h * headSize, cos.data() + i * headSize, sin.data() + i * headSize, headSize);
 }
 
-} // namespace detail
-
 RMSNorm::RMSNorm(size_t dim)
     : dim(dim),
-      weight(dim)
+      weight(dim, true)
 {
 }
 
-void RMSNorm::forward(Tensor &x, Tensor &out)
+void RMSNorm::forward(Tensor &x, Tensor &out) const
 {
-    auto xf = x.cf().data();
-    auto outf = out.f().data();
+    float const *xf;
+    float *outf;
+    std::tie(xf, outf) = threadPool.single([&] { return std::pair(x.cf().data(), out.f().data()); });
     auto wf = weight.cf().data();
 
-    float ss = std::inner_product(xf, xf + dim, xf, 0.0f);
-    ss = 1.0f / std::sqrt(1e-5f + ss / dim);
-
-    // normalize and scale
-    std::transform(xf, xf + dim, wf, outf, [ss](float x, float w) { return w * (ss * x); });
+    // every row of x is normalized separately
+    threadPool.parallelFor(x.size() / dim,
+                           [&](size_t row)
+                           {
+                               auto rowf = xf + row * dim;
+                               float ss = std::inner_product(rowf, rowf + dim, rowf, 0.0f);
+                               ss = 1.0f / std::sqrt(1e-5f + ss / dim);
+
+                               // normalize and scale
+                               std::transform(rowf, rowf + dim, wf, outf + row * dim,
+                                              [ss](float x, float w) { return w * (ss * x); });
+                           });
 }
 
-void RMSNorm::loadWeights(std::ifstream &inputStream) { weight.readFromFile(inputStream); }
+void RMSNorm::loadWeights(CheckpointReader &reader)
+{
+    weight.readFromFile(reader);
+
+    // forward() reads the float values, quantized weights are converted once
+    weight.cf();
+}
 
 Linear::Linear(size_t inDim, size_t outDim)
     : inDim(inDim),
@@ -124,116 +115,277 @@ Linear::Linear(size_t inDim, size_t outDim)
 {
 }
 
-void Linear::forward(Tensor &x, Tensor &out)
+void Linear::forward(Tensor &x, Tensor &out) const { multiply(x, out, nullptr); }
+
+void Linear::forwardGated(Tensor &x, Tensor &products, Tensor &gated) const
+{
+    if (2 * gated.size() != products.size())
+        throw std::runtime_error("Dimension mismatch!");
+
+    multiply(x, products, threadPool.single([&] { return gated.f().data(); }));
+}
+
+void Linear::multiply(Tensor &x, Tensor &out, float *gated) const
 {
-    if (x.size() != inDim || out.size() != outDim)
+    size_t nTokens = x.size() / inDim;
+
+    if (x.size() != nTokens * inDim || out.size() != nTokens * outDim)
         throw std::runtime_error("Dimension mismatch!");
 
+    // x and out are converted by one thread of the region the kernels run in
     if (weight.isQuantizedValid())
     {
         auto groupSize = weight.cq().groupSize;
-        detail::matmulQuantized(out.f(), x.cq(groupSize), weight.cq());
+        auto [xout, xq] = threadPool.single([&] { return std::pair(&out.f(), x.cq(groupSize)); });
+        kernels::matmulQuantized(*xout, xq, weight.cq(), nTokens, gated);
+    }
+    else if (weight.isQ4Valid())
+    {
+        auto groupSize = weight.cq4().groupSize;
+        auto [xout, xq] = threadPool.single([&] { return std::pair(&out.f(), x.cq(groupSize)); });
+        kernels::matmulQ4(*xout, xq, weight.cq4(), nTokens, gated);
     }
     else
-        detail::matmulFloat(out.f(), x.cf(), weight.cf());
+    {
+        auto [xout, xf] = threadPool.single([&] { return std::pair(&out.f(), x.cf()); });
+        if (weight.isHalfValid())
+            kernels::matmulFloat(*xout, xf, weight.ch(), nTokens, gated);
+        else
+            kernels::matmulFloat(*xout, xf, weight.cf(), nTokens, gated);
+    }
 }
 
-void Linear::loadWeights(std::ifstream &inputStream) { weight.readFromFile(inputStream); }
+void Linear::loadWeights(CheckpointReader &reader) { weight.readFromFile(reader); }
 
 template <typename T> void Linear::setWeights(T const &w) { weight = w; }
 template void Linear::setWeights<Tensor>(Tensor const &w);
 template void Linear::setWeights<FloatTensor>(FloatTensor const &w);
 template void Linear::setWeights<QuantizedTensor>(QuantizedTensor const &w);
 
-CausalAttention::CausalAttention(size_t seqLength, size_t dim, size_t nHeads, size_t nKVHeads)
-    : pos(0),
-      dim(dim),
+bool Linear::fuse(std::initializer_list<Linear *> parts, bool interleaved)
+{
+    size_t rows = 0;
+    for (auto part : parts)
+    {
+        // the fused copy would take the memory that mapping saves
+        if (part->weight.isMapped())
+            return false;
+
+        if (part->inDim != inDim || (interleaved && part->outDim != (*parts.begin())->outDim))
+            throw std::runtime_error("The fused weights do not fit together");
+        rows += part->outDim;
+    }
+
+    if (rows != outDim)
+        throw std::runtime_error("Dimension mismatch!");
+
+    weight = Tensor(0);
+    if (interleaved)
+    {
+        for (size_t row = 0; row < (*parts.begin())->outDim; row++)
+            for (auto part : parts)
+                weight.appendRows(part->weight, row, 1, inDim);
+    }
+    else
+    {
+        for (auto part : parts)
+            weight.appendRows(part->weight, 0, part->outDim, inDim);
+    }
+
+    for (auto part : parts)
+        part->weight = Tensor(part->inDim * part->outDim);
+    return true;
+}
+
+LayerContext::LayerContext(size_t seqLength, size_t dim, size_t nHeads, size_t nKVHeads, size_t hiddenDim,
+                           RopeConfig const &ropeConfig)
+    : rope(dim / nHeads, ropeConfig),
+      xb(dim, true),
+      xb2(dim, true),
+      qkv(dim + 2 * ((dim * nKVHeads) / nHeads), true),
+      query(dim, true),
+      key((dim * nKVHeads) / nHeads, true),
+      value((dim * nKVHeads) / nHeads, true),
+      storedKey((dim * nKVHeads) / nHeads * sizeof(float)),
+      storedValue((dim * nKVHeads) / nHeads * sizeof(float)),
+      heads(dim, true),
+      att(nHeads * seqLength),
+      hb(hiddenDim, true),
+      hb2(hiddenDim, true)
+{
+}
+
+CausalAttention::CausalAttention(size_t dim, size_t nHeads, size_t nKVHeads)
+    : dim(dim),
       nHeads(nHeads),
       nKVHeads(nKVHeads),
       wq(dim, dim),
       wk(dim, dim * nKVHeads / nHeads),
       wv(dim, dim * nKVHeads / nHeads),
       wo(dim, dim),
-      query(dim, true),
-      keyCache(seqLength, Tensor((dim * nKVHeads) / nHeads, true)),
-      valueCache(seqLength, Tensor((dim * nKVHeads) / nHeads, true)),
-      att(nHeads, Tensor(seqLength, true)),
-      xb(dim, true)
+      wqkv(dim, dim + 2 * (dim * nKVHeads / nHeads)),
+      fused(false)
 {
 }
 
-void CausalAttention::forward(Tensor &x, Tensor &out)
+void CausalAttention::attend(KVCache const &cache, float const *q, uint8_t const *keys, uint8_t const *values,
+                             size_t kvHead, size_t pos, size_t last, float scale, float *attf, float *xb) const
 {
-    if (pos == keyCache.size())
-    {
-        std::shift_left(keyCache.begin(), keyCache.end(), 1);
-        std::shift_left(valueCache.begin(), valueCache.end(), 1);
-        pos = keyCache.size() - 1;
-    }
+    size_t headSize = dim / nHeads;
 
-    // qkv matmuls for this position
-    wq.forward(x, query);
-    wk.forward(x, keyCache[pos]);
-    wv.forward(x, valueCache[pos]);
+    // the causal mask: position last only attends to itself and the
+    // positions before it, as far as the cache reaches back
+    size_t first = cache.windowStart(last);
 
-    size_t headSize = dim / nHeads;
-    detail::applyRotaryEmbedding(query.f(), keyCache[pos].f(), pos, nHeads, headSize, nKVHeads);
+    // calculate the attention scores as the dot product of q and the keys of
+    // all timesteps, the ones from pos on are not in the cache yet
+    cache.scores(kvHead, first, pos, q, scale, attf);
+    cache.scores(keys, kvHead, last + 1 - pos, q, scale, attf + pos - first);
 
-    size_t kvMul = nHeads / nKVHeads; // integer multiplier of the kv sharing in multiquery
+    // softmax the scores to get attention weights, from first..last
+    // inclusively
+    kernels::softmax(attf, attf + last - first + 1);
 
-    // multihead attention. iterate over all heads
-    size_t h;
+    // weighted sum of the values, store back into xb
+    std::fill(xb, xb + headSize, 0.0f);
+    cache.accumulate(kvHead, first, pos, attf, xb);
+    cache.accumulate(values, kvHead, last + 1 - pos, attf + pos - first, xb);
+}
 
-#pragma omp parallel for private(h)
-    for (h = 0; h < nHeads; h++)
-    {
-        // get the query vector for this head
-        float *q = query.f().data() + h * headSize;
-        auto &attf = att[h].f();
+void CausalAttention::forward(Tensor &x, Tensor &out, LayerContext &context) const
+{
+    size_t nTokens = x.size() / dim;
+    size_t kvDim = (dim * nKVHeads) / nHeads;
 
-        // iterate over all timesteps, including the current one
-        for (size_t t = 0; t <= pos; t++)
-        {
-            // get the key vector for this head and at this timestep
-            float *k = keyCache[t].f().data() + (h / kvMul) * headSize;
-            // calculate the attention score as the dot product of q and k
+    auto &query = context.query;
+    auto &key = context.key;
+    auto &value = context.value;
+    auto &att = context.att;
+    auto const &rope = context.rope;
+    auto const &segments = context.segments;
 
-            float score = std::inner_product(q, q + headSize, k, 0.0f);
+    bool traced = 0 == threadPool.threadIndex();
 
-            // save the score to the attention buffer
-            attf[t] = score / std::sqrt(headSize);
+    threadPool.single(
+        [&]
+        {
+            query.resize(nTokens * dim);
+            key.resize(nTokens * kvDim);
+            value.resize(nTokens * kvDim);
+            context.storedKey.resize(nTokens * kvDim * sizeof(float));
+            context.storedValue.resize(nTokens * kvDim * sizeof(float));
+            context.heads.resize(nTokens * dim);
+            if (fused)
+                context.qkv.resize(nTokens * (dim + 2 * kvDim));
+        });
+
+    // qkv matmuls for these positions
+    {
+        Tracer::Scope trace(Tracer::QKV, traced);
+        if (fused)
+            wqkv.forward(x, context.qkv);
+        else
+        {
+            wq.forward(x, query);
+            wk.forward(x, key);
+            wv.forward(x, value);
         }
+    }
 
-        // softmax the scores to get attention weights, from 0..pos
-        // inclusively
-        detail::softmax(attf.data(), attf.data() + pos + 1);
-
-        // weighted sum of the values, store back into xb
-        float *xb = this->xb.f().data() + h * headSize;
+    size_t headSize = dim / nHeads;
+    float *qf, *kf, *vf, *xbf;
+    float const *qkvf;
+    std::tie(qf, kf, vf, xbf, qkvf) = threadPool.single(
+        [&]
+        {
+            return std::tuple(query.f().data(), key.f().data(), value.f().data(), context.heads.f().data(),
+                              fused ? context.qkv.cf().data() : nullptr);
+        });
+
+    // The new positions are only written into the cache after the
+    // attention: when the cache is full they overwrite positions that the
+    // first rows still attend to. Until then they are read from copies
+    // stored like in the cache, so that the logits do not depend on how the
+    // positions are split into batches. The copies of a sequence start at
+    // the offset of its float rows, which no stored format exceeds.
+    auto storedKey = context.storedKey.data();
+    auto storedValue = context.storedValue.data();
+    size_t kvMul = nHeads / nKVHeads; // integer multiplier of the kv sharing in multiquery
+    float scale = 1.0f / std::sqrt(headSize);
 
-        std::fill(xb, xb + headSize, 0.0f);
-        for (size_t t = 0; t <= pos; t++)
+    // RoPE and the attention of all heads run as one parallel region, or in
+    // the region of the block
+    threadPool.run(
+        [&](size_t thread, size_t)
         {
-            // get the value vector for this head and at this timestep
-            float *v = valueCache[t].f().data() + (h / kvMul) * headSize;
+            {
+                Tracer::Scope trace(Tracer::ROPE, 0 == thread);
+                threadPool.parallelFor(nTokens,
+                                       [&](size_t i)
+                                       {
+                                           // the rows of the fused matmul are split on the way
+                                           if (fused)
+                                           {
+                                               float const *row = qkvf + i * (dim + 2 * kvDim);
+                                               std::copy_n(row, dim, qf + i * dim);
+                                               std::copy_n(row + dim, kvDim, kf + i * kvDim);
+                                               std::copy_n(row + dim + kvDim, kvDim, vf + i * kvDim);
+                                           }
+
+                                           rope.apply(qf + i * dim, nHeads, i);
+                                           rope.apply(kf + i * kvDim, nKVHeads, i);
+
+                                           for (auto const &s : segments)
+                                               if (s.first <= i && i < s.first + s.nTokens)
+                                               {
+                                                   size_t offset = s.first * kvDim * sizeof(float) +
+                                                                   (i - s.first) * s.cache->bytes(1) / 2;
+                                                   s.cache->storeRows(kf + i * kvDim, 1, storedKey + offset);
+                                                   s.cache->storeRows(vf + i * kvDim, 1, storedValue + offset);
+                                               }
+                                       });
+            }
 
-            // accumulate the weighted value into xb
-            for (size_t i = 0; i < headSize; i++)
-                xb[i] += attf[t] * v[i];
-        }
-    }
+            // multihead attention. iterate over all heads
+            Tracer::Scope trace(Tracer::ATTENTION, 0 == thread);
+            threadPool.parallelFor(nHeads,
+                                   [&](size_t h)
+                                   {
+                                       float *attf = att.data() + h * att.size() / nHeads;
+                                       size_t kvHead = h / kvMul;
+
+                                       for (auto const &s : segments)
+                                       {
+                                           size_t pos = s.cache->position();
+                                           size_t offset = s.first * kvDim * sizeof(float);
+                                           for (size_t i = s.first; i < s.first + s.nTokens; i++)
+                                               attend(*s.cache, qf + i * dim + h * headSize, storedKey + offset,
+                                                      storedValue + offset, kvHead, pos, pos + i - s.first, scale,
+                                                      attf, xbf + i * dim + h * headSize);
+                                       }
+                                   });
+        });
+
+    threadPool.single(
+        [&]
+        {
+            for (auto const &s : segments)
+                s.cache->append(kf + s.first * kvDim, vf + s.first * kvDim, s.nTokens);
+        });
 
     // final matmul to get the output of the attention
-    wo.forward(xb, out);
-
-    ++pos;
+    Tracer::Scope trace(Tracer::WO, traced);
+    wo.forward(context.heads, out);
 }
-void CausalAttention::loadWeights(std::ifstream &inputStream)
+
+void CausalAttention::loadWeights(CheckpointReader &reader)
 {
-    wq.loadWeights(inputStream);
-    wk.loadWeights(inputStream);
-    wv.loadWeights(inputStream);
-    wo.loadWeights(inputStream);
+    wq.loadWeights(reader);
+    wk.loadWeights(reader);
+    wv.loadWeights(reader);
+    wo.loadWeights(reader);
+
+    fused = wqkv.fuse({&wq, &wk, &wv}, false);
 }
 
 FFN::FFN(size_t dim, size_t hiddenDim)
@@ -242,73 +394,121 @@ FFN::FFN(size_t dim, size_t hiddenDim)
       w1(dim, hiddenDim),
       w2(hiddenDim, dim),
       w3(dim, hiddenDim),
-      hb(hiddenDim, true),
-      hb2(hiddenDim, true)
+      w1w3(dim, 2 * hiddenDim),
+      fused(false)
 {
 }
 
-void FFN::forward(Tensor &x, Tensor &out)
+void FFN::forward(Tensor &x, Tensor &out, LayerContext &context) const
 {
-    w1.forward(x, hb);
-    w3.forward(x, hb2);
+    size_t nTokens = x.size() / dim;
+    auto &hb = context.hb;
+    auto &hb2 = context.hb2;
+    bool traced = 0 == threadPool.threadIndex();
 
-    auto hbf = hb.f().data();
-    auto hb2f = hb2.f().data();
+    threadPool.single(
+        [&]
+        {
+            hb.resize(nTokens * hiddenDim);
+            hb2.resize(nTokens * hiddenDim * (fused ? 2 : 1));
+        });
 
-    // SwiGLU non-linearity
-    for (size_t i = 0; i < hiddenDim; i++)
+    if (fused)
+    {
+        Tracer::Scope trace(Tracer::W1_W3, traced);
+        w1w3.forwardGated(x, hb2, hb);
+    }
+    else
     {
-        float val = hbf[i];
-        // silu(x)=x*σ(x), where σ(x) is the logistic sigmoid
-        val *= (1.0f / (1.0f + std::exp(-val)));
-        // elementwise multiply with w3(x)
-        val *= hb2f[i];
-        hbf[i] = val;
+        {
+            Tracer::Scope trace(Tracer::W1_W3, traced);
+            w1.forward(x, hb);
+            w3.forward(x, hb2);
+        }
+
+        Tracer::Scope trace(Tracer::SWIGLU, traced);
+        float *hbf;
+        float const *hb2f;
+        std::tie(hbf, hb2f) = threadPool.single([&] { return std::pair(hb.f().data(), hb2.cf().data()); });
+
+        // SwiGLU non-linearity
+        threadPool.parallelFor(hb.size(),
+                               [&](size_t i)
+                               {
+                                   float val = hbf[i];
+                                   // silu(x)=x*σ(x), where σ(x) is the logistic sigmoid
+                                   val *= (1.0f / (1.0f + std::exp(-val)));
+                                   // elementwise multiply with w3(x)
+                                   val *= hb2f[i];
+                                   hbf[i] = val;
+                               });
     }
 
     // final matmul to get the output of the ffn
+    Tracer::Scope trace(Tracer::W2, traced);
     w2.forward(hb, out);
 }
 
-void FFN::loadWeights(std::ifstream &inputStream)
+void FFN::loadWeights(CheckpointReader &reader)
 {
-    w1.loadWeights(inputStream);
-    w2.loadWeights(inputStream);
-    w3.loadWeights(inputStream);
+    w1.loadWeights(reader);
+    w2.loadWeights(reader);
+    w3.loadWeights(reader);
+
+    fused = w1w3.fuse({&w1, &w3}, true);
 }
 
-TransformerBlock::TransformerBlock(size_t seqLength, size_t dim, size_t nHeads, size_t nKVHeads, size_t hiddenDim)
+TransformerBlock::TransformerBlock(size_t dim, size_t nHeads, size_t nKVHeads, size_t hiddenDim)
     : attentionNorm(dim),
-      attention(seqLength, dim, nHeads, nKVHeads),
+      attention(dim, nHeads, nKVHeads),
       ffnNorm(dim),
-      ffn(dim, hiddenDim),
-      xb(dim, true),
-      xb2(dim, true)
+      ffn(dim, hiddenDim)
 {
 }
 
-void TransformerBlock::forward(Tensor &x, Tensor &out)
+void TransformerBlock::forward(Tensor &x, Tensor &out, LayerContext &context) const
 {
-    attentionNorm.forward(x, xb);
-    attention.forward(xb, xb2);
+    auto &xb = context.xb;
+    auto &xb2 = context.xb2;
+
+    // the whole block runs as one parallel region, its steps are separated by
+    // the barriers of the parallel loops instead of starting a region each
+    threadPool.run(
+        [&](size_t thread, size_t)
+        {
+            threadPool.single(
+                [&]
+                {
+                    xb.resize(x.size());
+                    xb2.resize(x.size());
+                });
+
+            {
+                Tracer::Scope trace(Tracer::ATTENTION_NORM, 0 == thread);
+                attentionNorm.forward(x, xb);
+            }
+            attention.forward(xb, xb2, context);
 
-    auto xb2f = xb2.f().data();
-    auto xf = x.f().data();
-    for (size_t i = 0; i < x.size(); i++)
-        xb2f[i] += xf[i];
+            float *xb2f;
+            float const *xf;
+            std::tie(xb2f, xf) = threadPool.single([&] { return std::pair(xb2.f().data(), x.cf().data()); });
+            threadPool.parallelFor(x.size(), [&](size_t i) { xb2f[i] += xf[i]; });
 
-    ffnNorm.forward(xb2, xb);
-    ffn.forward(xb, out);
+            {
+                Tracer::Scope trace(Tracer::FFN_NORM, 0 == thread);
+                ffnNorm.forward(xb2, xb);
+            }
+            ffn.forward(xb, out, context);
 
-    auto outf = out.f().data();
-    for (size_t i = 0; i < x.size(); i++)
-        outf[i] += xb2f[i];
+            auto outf = threadPool.single([&] { return out.f().data(); });
+            threadPool.parallelFor(x.size(), [&](size_t i) { outf[i] += xb2f[i]; });
+        });
 }
 
-void TransformerBlock::loadWeights(std::ifstream &inputStream)
+void TransformerBlock::loadWeights(CheckpointReader &reader)
 {
-    attentionNorm.loadWeights(inputStream);
-    attention.loadWeights(inputStream);
-    ffnNorm.loadWeights(inputStream);
-    ffn.loadWeights(inputStream);
+    attentionNorm.loadWeights(reader);
+    attention.loadWeights(reader);
+    ffnNorm.loadWeights(reader);
+    ffn.loadWeights(reader);
 }
\ No newline at end of file
@@ -1,17 +1,68 @@
 #pragma once
 
-#include <fstream>
+#include <initializer_list>
+#include <span>
 #include <vector>
 
+#include "CheckpointReader.h"
+#include "KVCache.h"
 #include "Tensor.h"
 
+// ----------------------------------------------------------------------------
+// The layers process the activations of one or more positions at once: x and
+// out hold one row per position. The layers only hold the weights and are
+// immutable once loaded, the rotations of the positions and the activation
+// buffers are in a LayerContext, whose buffers grow and shrink with the
+// number of rows. Several threads can run the same layers concurrently, each
+// with its own context.
+//
+// A TransformerBlock runs as one parallel region of the thread pool. The
+// layers it calls work on all threads of that region, their steps that
+// change a Tensor or the context run on one thread through
+// ThreadPool::single(). Called outside of a region, every parallel step
+// opens its own.
+
+// RoPE parameters from the checkpoint header. Zeros select the defaults of
+// Llama 3, theta 500000 without frequency scaling.
+struct RopeConfig
+{
+    float theta;
+    float scalingFactor; // Llama 3.1 frequency scaling, 0 disables it
+    float lowFreqFactor;
+    float highFreqFactor;
+    int originalSeqLength; // context length the model was pretrained with
+};
+
+// Rotary positional embedding. The cos and sin of the positions of a batch
+// are computed once by setPositions() and shared by all layers.
+class RotaryEmbedding
+{
+public:
+    RotaryEmbedding(size_t headSize, RopeConfig const &config);
+
+    // computes the rotations of the positions of the rows of a batch
+    void setPositions(std::span<size_t const> positions);
+
+    // rotates the nHeads heads in x by the position of row i of the batch
+    void apply(float *x, size_t nHeads, size_t i) const;
+
+private:
+    size_t headSize;
+    std::vector<double> frequencies; // (headSize / 2)
+
+    // (nTokens, headSize), every value repeated for the two elements of a
+    // pair, sin negated for the first one
+    FloatTensor cos;
+    FloatTensor sin;
+};
+
 class RMSNorm
 {
 public:
     RMSNorm(size_t dim);
 
-    void forward(Tensor &x, Tensor &out);
-    void loadWeights(std::ifstream &inputStream);
+    void forward(Tensor &x, Tensor &out) const;
+    void loadWeights(CheckpointReader &reader);
 
 private:
     size_t dim;
@@ -23,27 +74,86 @@ class Linear
 public:
     Linear(size_t inDim, size_t outDim);
 
-    void forward(Tensor &x, Tensor &out);
-    void loadWeights(std::ifstream &inputStream);
+    void forward(Tensor &x, Tensor &out) const;
+    void loadWeights(CheckpointReader &reader);
+
+    // forward() of fused gate and up projections, interleaved by fuse():
+    // products receives all rows, gated silu(gate) * up of every pair
+    void forwardGated(Tensor &x, Tensor &products, Tensor &gated) const;
 
     template <typename T> void setWeights(T const &w);
 
+    // replaces the weights by the rows of the parts, which have the same
+    // input dimension and format, and releases those of the parts. The rows
+    // follow each other part by part, or interleaved row by row. Mapped
+    // weights are kept in place, fuse() then returns false.
+    bool fuse(std::initializer_list<Linear *> parts, bool interleaved);
+
+private:
+    void multiply(Tensor &x, Tensor &out, float *gated) const;
+
 private:
     size_t inDim;
     size_t outDim;
     Tensor weight;
 };
 
+// The rows of a batch that belong to one sequence: consecutive positions,
+// appended to the KV cache of the sequence for the layer. A batch can hold
+// the rows of several sequences, e.g. one decoded token of each.
+struct AttentionSegment
+{
+    KVCache *cache;
+    size_t first; // the first row of the segment in the batch
+    size_t nTokens;
+};
+
+// the mutable state of a pass through the layers, shared by all of them
+struct LayerContext
+{
+    LayerContext(size_t seqLength, size_t dim, size_t nHeads, size_t nKVHeads, size_t hiddenDim,
+                 RopeConfig const &ropeConfig);
+
+    // the rotations of the positions of the batch, and its sequences
+    RotaryEmbedding rope;
+    std::vector<AttentionSegment> segments;
+
+    // TransformerBlock
+    Tensor xb;
+    Tensor xb2;
+
+    // CausalAttention
+    Tensor qkv; // the output of the fused wq, wk and wv, (nTokens, dim + 2 kvDim)
+    Tensor query;
+    Tensor key;
+    Tensor value;
+    // key and value stored like in the KV caches, (nTokens, kvDim) floats at most
+    std::vector<uint8_t, AlignedAllocator<uint8_t>> storedKey;
+    std::vector<uint8_t, AlignedAllocator<uint8_t>> storedValue;
+    Tensor heads; // the output of all heads, the input of wo
+    FloatTensor att; // buffer for scores/attention values (n_heads, seq_len)
+
+    // FFN
+    Tensor hb;
+    Tensor hb2; // w3(x), or the products of the fused w1 and w3
+};
+
 class CausalAttention
 {
 public:
-    CausalAttention(size_t seqLength, size_t dim, size_t nHeads, size_t nKVHeads);
+    CausalAttention(size_t dim, size_t nHeads, size_t nKVHeads);
 
-    void forward(Tensor &x, Tensor &out);
-    void loadWeights(std::ifstream &inputStream);
+    void forward(Tensor &x, Tensor &out, LayerContext &context) const;
+    void loadWeights(CheckpointReader &reader);
+
+private:
+    // the attention of one head for the query of the position last, keys and
+    // values hold the positions from pos on as stored by cache.storeRows(),
+    // the ones before are in the cache
+    void attend(KVCache const &cache, float const *q, uint8_t const *keys, uint8_t const *values, size_t kvHead,
+                size_t pos, size_t last, float scale, float *attf, float *xb) const;
 
 private:
-    size_t pos;
     size_t dim;
     size_t nHeads;
     size_t nKVHeads;
@@ -53,13 +163,9 @@ private:
     Linear wv;
     Linear wo;
 
-    Tensor query;
-    std::vector<Tensor> keyCache;
-    std::vector<Tensor> valueCache;
-
-    std::vector<Tensor> att; // buffer for scores/attention values (n_heads, seq_len)
-
-    Tensor xb;
+    // wq, wk and wv fused into one matmul, unless they are mapped
+    Linear wqkv;
+    bool fused;
 };
 
 class FFN
@@ -67,8 +173,8 @@ class FFN
 public:
     FFN(size_t dim, size_t hiddenDim);
 
-    void forward(Tensor &x, Tensor &out);
-    void loadWeights(std::ifstream &inputStream);
+    void forward(Tensor &x, Tensor &out, LayerContext &context) const;
+    void loadWeights(CheckpointReader &reader);
 
 private:
     size_t dim;
@@ -78,24 +184,24 @@ private:
     Linear w2;
     Linear w3;
 
-    Tensor hb;
-    Tensor hb2;
+    // w1 and w3 interleaved into one matmul with the SwiGLU as its epilogue,
+    // unless they are mapped
+    Linear w1w3;
+    bool fused;
 };
 
 class TransformerBlock
 {
 public:
-    TransformerBlock(size_t seqLength, size_t dim, size_t nHeads, size_t nKVHeads, size_t hiddenDim);
+    TransformerBlock(size_t dim, size_t nHeads, size_t nKVHeads, size_t hiddenDim);
 
-    void forward(Tensor &x, Tensor &out);
-    void loadWeights(std::ifstream &inputStream);
+    // the KV caches of the layer are the ones of the segments of the context
+    void forward(Tensor &x, Tensor &out, LayerContext &context) const;
+    void loadWeights(CheckpointReader &reader);
 
 private:
     RMSNorm attentionNorm;
     CausalAttention attention;
     RMSNorm ffnNorm;
     FFN ffn;
-
-    Tensor xb;
-    Tensor xb2;
 };
@@ -1,59 +1,152 @@
 /* Inference for Llama-3 Transformer model in C++ */
 
 #include <chrono>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <string>
 
 #include "argparse/argparse.hpp"
 
+#include "CheckpointReader.h"
+#include "KVCache.h"
 #include "Logger.h"
 #include "Sampler.h"
+#include "Server.h"
+#include "ThreadPool.h"
 #include "Tokenizer.h"
+#include "Tracer.h"
 #include "Transformer.h"
 
-void check_header(std::ifstream &inputStream)
+void check_header(CheckpointReader &reader)
 {
     using namespace std::string_literals;
 
-    uint32_t magic_number;
-    inputStream.read((char *)(&magic_number), sizeof(magic_number));
+    uint32_t magic_number = reader.read<uint32_t>();
 
     // read in magic number (uint32), has to be 0x616b3432, i.e. "ak42" in ASCII
     if (magic_number != 0x616b3432)
         throw std::runtime_error("Bad magic number");
 
-    int version;
-    inputStream.read((char *)(&version), sizeof(version));
+    int version = reader.read<int>();
 
     if (version != 1)
         throw std::runtime_error("Bad version "s + std::to_string(version) + "need version 2"s);
 }
 
-Transformer build_transformer(std::string const &checkpoint_path)
+Transformer build_transformer(std::string const &checkpoint_path, CheckpointReader::Mode mode = CheckpointReader::READ,
+                              int maxSeqLength = 2048)
 {
-    std::ifstream inputStream(checkpoint_path, std::ios::binary);
+    CheckpointReader reader(checkpoint_path, mode);
 
-    if (!inputStream.is_open())
-        throw std::runtime_error("Can not open file!");
-
-    check_header(inputStream);
+    check_header(reader);
 
     // read in the Config and the Weights from the checkpoint
-    Config config;
-    inputStream.read((char *)(&config), sizeof(Config));
+    Config config = reader.read<Config>();
 
     // DeepSeek-R1-Distill-Llama-8B model has sequence-length 131072,
-    config.seqLength = std::min(2048, config.seqLength);
+    // the KV cache is sized for the sequence length, 0 keeps the model's maximum
+    if (0 < maxSeqLength)
+        config.seqLength = std::min(maxSeqLength, config.seqLength);
 
-    inputStream.seekg(256);
+    reader.seek(256);
 
     Transformer transformer(config);
-    transformer.loadWeights(inputStream);
+    transformer.loadWeights(reader);
 
     return transformer;
 }
 
+// The tokenizer is loaded zero-copy from its precompiled cache, path +
+// ".cache", which is written on first use and rewritten when it is older
+// than the tokenizer. The path may also name a cache file directly.
+Tokenizer build_tokenizer(std::string const &path, int vocabSize, bool useCache = true)
+{
+    if (!useCache || Tokenizer::isCache(path))
+        return Tokenizer(path, vocabSize);
+
+    std::string cachePath = path + ".cache";
+    std::error_code error;
+
+    auto cacheTime = std::filesystem::last_write_time(cachePath, error);
+    if (!error && std::filesystem::last_write_time(path) <= cacheTime)
+    {
+        try
+        {
+            return Tokenizer(cachePath, vocabSize);
+        }
+        catch (std::exception const &e)
+        {
+            logger(Logger::WARN) << "ignoring tokenizer cache: " << e.what() << std::endl;
+        }
+    }
+
+    Tokenizer tokenizer(path, vocabSize);
+
+    try
+    {
+        tokenizer.writeCache(cachePath);
+    }
+    catch (std::exception const &e)
+    {
+        logger(Logger::WARN) << e.what() << std::endl;
+    }
+
+    return tokenizer;
+}
+
+// ----------------------------------------------------------------------------
+// sampling
+
+// parses token:bias,token:bias,... the bias may be -inf
+std::vector<std::pair<int, float>> parse_logit_bias(std::string const &list)
+{
+    std::vector<std::pair<int, float>> biases;
+    std::stringstream stream(list);
+    std::string item;
+
+    while (std::getline(stream, item, ','))
+    {
+        auto colon = item.find(':');
+        if (std::string::npos == colon)
+            throw std::runtime_error("logit bias without ':' " + item);
+        biases.emplace_back(std::stoi(item.substr(0, colon)), std::stof(item.substr(colon + 1)));
+    }
+
+    return biases;
+}
+
+// ----------------------------------------------------------------------------
+// sessions
+
+// parses a KV cache type, f32|f16|q8
+KVCache::Type parse_kv_type(std::string const &name)
+{
+    if (name == "f32")
+        return KVCache::F32;
+    if (name == "f16")
+        return KVCache::F16;
+    if (name == "q8")
+        return KVCache::Q8;
+    throw std::runtime_error("unknown KV cache type: " + name);
+}
+
+// restores the sequence and the tokens fed so far from a session file, if it
+// exists, the tokens are also replayed to the sampler for its penalties
+std::vector<int> load_session(std::string const &path, InferenceContext &context, Sampler &sampler)
+{
+    if (path.empty() || !std::filesystem::exists(path))
+        return {};
+
+    std::vector<int> history = context.sequence().load(path);
+    for (int token : history)
+        sampler.accept(token);
+
+    logger(Logger::INFO) << "resuming session " << path << " at position " << history.size() << std::endl;
+    return history;
+}
+
 // ----------------------------------------------------------------------------
 // utilities: time
 
@@ -66,57 +159,114 @@ auto time_in_ms()
 // ----------------------------------------------------------------------------
 // generation loop
 
-void generate(Transformer &transformer, Tokenizer const &tokenizer, Sampler &sampler, std::string const &prompt,
-              size_t numSteps)
+int sample(Sampler &sampler, Tensor &logits)
 {
-    // encode the (string) prompt into tokens sequence
-    auto prompt_tokens = tokenizer.encode(prompt, 1, 0);
+    Tracer::Scope trace(Tracer::SAMPLING);
+    int token = sampler.sample(logits.f());
+    sampler.accept(token);
+    return token;
+}
+
+// history holds the tokens fed to the context before, e.g. by a resumed
+// session, the prompt continues them. The fed tokens are appended to it.
+void generate(Transformer const &transformer, InferenceContext &context, Tokenizer const &tokenizer, Sampler &sampler,
+              std::string const &prompt, size_t numSteps, std::vector<std::string> const &stopStrings,
+              std::vector<int> &history)
+{
+    // encode the (string) prompt into tokens sequence, a continued sequence
+    // already has its BOS
+    int bos = history.empty() ? 1 : 0;
+    auto prompt_tokens = tokenizer.encode(prompt, bos, 0);
     if (prompt_tokens.size() < 1)
         throw std::runtime_error("something is wrong, expected at least 1 prompt token");
 
-    // start the main loop
-    std::optional<std::chrono::milliseconds> start; // used to time our code, only initialized after first iteration
-    size_t steps = 0;
+    // print the prompt, the BOS token is not printed
+    std::string text;
+    StreamDecoder promptDecoder(tokenizer);
+    for (auto it = std::next(prompt_tokens.begin(), bos); it != prompt_tokens.end(); ++it)
+        promptDecoder.decode(*it, text);
+    promptDecoder.flush(text);
+    std::cout << text << std::flush;
+    text.clear();
+
+    StreamDecoder decoder(tokenizer, stopStrings);
 
-    int token = prompt_tokens.pop();
     Tensor logits(transformer.getConfig().vocabSize);
 
-    while (0 == numSteps || steps < numSteps)
-    {
-        // forward the transformer to get logits for the next token
-        transformer.forward(token, logits);
+    // forward the whole prompt at once to get the logits for the first generated token
+    auto prefillStart = time_in_ms();
+    std::vector<int> tokens(prompt_tokens.begin(), prompt_tokens.end());
+    for (int token : tokens)
+        sampler.accept(token);
+    transformer.forwardBatch(context, tokens, logits);
+    history.insert(history.end(), tokens.begin(), tokens.end());
+    auto prefillEnd = time_in_ms();
 
-        // advance the state machine
-        if (!prompt_tokens.empty())
-            // if we are still processing the input prompt, force the next prompt token
-            token = prompt_tokens.pop();
-        else
-            // otherwise sample the next token from the logits
-            token = sampler.sample(logits.f());
+    // start the main loop
+    std::optional<std::chrono::milliseconds> start; // used to time our code, only initialized after first iteration
+    size_t steps = tokens.size();
+    size_t generated = 0;
+    std::optional<int> unfed; // the printed token a stop string or the step limit did not feed
+
+    while (true)
+    {
+        // sample the next token from the logits
+        int token = sample(sampler, logits);
 
         // data-dependent terminating condition: the BOS (=1) token delimits sequences
-        if ((token == 128001 || token == 128009) && prompt_tokens.empty())
+        if (token == 128001 || token == 128009)
             break;
 
-        // print the token as string, decode it with the Tokenizer object
-        if (auto p = tokenizer.decode(token))
-            std::cout << *p << std::flush;
+        // print the text completed by the token
+        bool stop = decoder.decode(token, text);
+        std::cout << text << std::flush;
+        text.clear();
+
+        if (stop)
+        {
+            unfed = token;
+            break;
+        }
 
         // init the timer here because the first iteration can be slower
         if (!start.has_value())
             start = time_in_ms();
 
+        if (0 != numSteps && steps >= numSteps)
+        {
+            unfed = token;
+            break;
+        }
+
+        // forward the transformer to get logits for the next token
+        transformer.forward(context, token, logits);
+        history.push_back(token);
+
         ++steps;
+        ++generated;
     }
-    std::cout << std::endl;
+    decoder.flush(text);
+    std::cout << text << std::endl;
 
-    // report achieved tok/s (pos-1 because the timer starts after first iteration)
+    auto prefillElapsed = (prefillEnd - prefillStart).count();
+    if (0 < prefillElapsed)
+        std::cout << "prompt tok/s: " << static_cast<double>(tokens.size()) / prefillElapsed * 1000 << std::endl;
+
+    // report achieved tok/s (the timer starts after the first generated token)
     if (start.has_value())
     {
         auto end = time_in_ms();
         auto elapsed = (end - *start).count();
         if (0 < elapsed)
-            std::cout << "achieved tok/s: " << static_cast<double>(steps - 1) / elapsed * 1000 << std::endl;
+            std::cout << "achieved tok/s: " << static_cast<double>(generated) / elapsed * 1000 << std::endl;
+    }
+
+    // the last printed token becomes part of the history, which may be saved
+    // as a session
+    if (unfed)
+    {
+        transformer.forward(context, *unfed, logits);
+        history.push_back(*unfed);
     }
 }
 
@@ -126,15 +276,12 @@ void generate(Transformer &transformer, Tokenizer const &tokenizer, Sampler &sam
 // python reference and that seemed ok, but this was not thoroughly tested and
 // is not safely implemented, it's more a proof of concept atm.
 
-void chat(Transformer &transformer, Tokenizer const &tokenizer, Sampler &sampler, std::string system_prompt,
-          size_t numSteps)
+// A resumed chat, with a non-empty history, continues after the last
+// Assistant turn, its system prompt is kept. Entering exit ends the chat.
+void chat(Transformer const &transformer, InferenceContext &context, Tokenizer const &tokenizer, Sampler &sampler,
+          std::string system_prompt, size_t numSteps, std::vector<std::string> const &stopStrings,
+          std::vector<int> &history)
 {
-    if (system_prompt == "")
-    {
-        std::cout << "Enter system prompt (optional): ";
-        getline(std::cin, system_prompt);
-    }
-
     TokenQueue prompt_tokens;
 
     // start the main loop
@@ -143,11 +290,42 @@ void chat(Transformer &transformer, Tokenizer const &tokenizer, Sampler &sampler
     int token = 0; // stores the current token to feed into the transformer
     Tensor logits(transformer.getConfig().vocabSize);
 
+    // the EOS ending the last Assistant turn was not fed yet
+    if (!history.empty())
+    {
+        if (history.back() != 128009)
+            prompt_tokens.push_back(128009);
+        turn = 2;
+    }
+    else if (system_prompt == "")
+    {
+        std::cout << "Enter system prompt (optional): ";
+        getline(std::cin, system_prompt);
+    }
+
+    StreamDecoder decoder(tokenizer, stopStrings);
+    std::string text;
+
+    // feeds the queued tokens through the transformer at once
+    auto feedQueue = [&]()
+    {
+        std::vector<int> tokens(prompt_tokens.begin(), prompt_tokens.end());
+        prompt_tokens.clear();
+
+        for (int token : tokens)
+            sampler.accept(token);
+        transformer.forwardBatch(context, tokens, logits);
+        history.insert(history.end(), tokens.begin(), tokens.end());
+        steps += tokens.size();
+    };
+
     while (0 == numSteps || steps < numSteps)
     {
         // when it is the user's turn to contribute tokens to the dialog...
         if (0 == turn % 2)
         {
+            // the end of the last Assistant turn, still to be fed
+            size_t pending = prompt_tokens.size();
 
             if (0 == turn)
             {
@@ -170,7 +348,11 @@ void chat(Transformer &transformer, Tokenizer const &tokenizer, Sampler &sampler
             // otherwise get user prompt from stdin
             std::cout << "User (or exit): ";
             std::string user_prompt;
-            getline(std::cin, user_prompt);
+            if (!getline(std::cin, user_prompt) || user_prompt == "exit")
+            {
+                prompt_tokens.resize(pending);
+                break;
+            }
 
             // encode the user prompt into tokens
             auto user_prompt_tokens = tokenizer.encode(user_prompt, 0, 0);
@@ -181,36 +363,58 @@ void chat(Transformer &transformer, Tokenizer const &tokenizer, Sampler &sampler
 
             ++turn;
             std::cout << "Assistant: ";
-        }
 
-        // determine the token to pass into the transformer next
-        if (!prompt_tokens.empty())
+            // forward the whole prompt at once to get the logits for the first
+            // token of the Assistant
+            feedQueue();
+        }
+        else
         {
-            // if we are still processing the input prompt, force the next
-            // prompt token
-            token = prompt_tokens.pop();
+            // forward the transformer to get logits for the next token
+            transformer.forward(context, token, logits);
+            history.push_back(token);
+            ++steps;
         }
 
-        // EOS (=128009) token ends the Assistant turn
-        if (prompt_tokens.empty() && (token == 128009 || token == 128001))
-            ++turn;
-
-        // forward the transformer to get logits for the next token
-        transformer.forward(token, logits);
-        token = sampler.sample(logits.f());
+        token = sample(sampler, logits);
 
-        if ((prompt_tokens.empty() && token != 128009) && token != 128001 && token != 128006)
+        // EOS (=128009) token ends the Assistant turn, it is fed to the
+        // transformer in front of the next user prompt
+        if (token == 128009 || token == 128001)
         {
-            // the Assistant is responding, so print its output
-            if (auto p = tokenizer.decode(token))
-                std::cout << *p << std::flush;
+            decoder.flush(text);
+            std::cout << text << std::endl;
+            text.clear();
+            decoder.reset();
+
+            prompt_tokens.push_back(token);
+            ++turn;
         }
-        if ((prompt_tokens.empty() && token == 128009) || token == 128001)
-            std::cout << std::endl;
+        else if (token != 128006)
+        {
+            // the Assistant is responding, so print its output, a stop string
+            // ends its turn as if it had sampled EOS
+            bool stop = decoder.decode(token, text);
+            std::cout << text << std::flush;
+            text.clear();
 
-        ++steps;
+            if (stop)
+            {
+                std::cout << std::endl;
+                decoder.reset();
+
+                prompt_tokens.insert(prompt_tokens.end(), {token, 128009});
+                ++turn;
+            }
+        }
     }
-    std::cout << std::endl;
+    decoder.flush(text);
+    std::cout << text << std::endl;
+
+    // the tokens ending the last Assistant turn become part of the history,
+    // which may be saved as a session
+    if (!prompt_tokens.empty())
+        feedQueue();
 }
 
 // ----------------------------------------------------------------------------
@@ -223,12 +427,39 @@ struct MyArgs : public argparse::Args
 
     float &temperature = kwarg("t", "temperature in [0,inf], default 1.0").set_default(1.0f);
     float &topP = kwarg("p", "p value in top-p (nucleus) sampling in [0,1]").set_default(0.9f);
+    int &topK = kwarg("top-k", "keep the k most likely tokens, default 0 = off").set_default(0);
+    float &minP = kwarg("min-p", "keep the tokens at least min-p times as likely as the top one, default 0 = off")
+                      .set_default(0.0f);
+    float &typicalP = kwarg("typical-p", "locally typical sampling in [0,1], default 1 = off").set_default(1.0f);
+    float &repeatPenalty = kwarg("repeat-penalty", "repetition penalty, default 1 = off").set_default(1.0f);
+    float &frequencyPenalty = kwarg("frequency-penalty", "frequency penalty, default 0 = off").set_default(0.0f);
+    float &presencePenalty = kwarg("presence-penalty", "presence penalty, default 0 = off").set_default(0.0f);
+    int &penaltyLastN = kwarg("penalty-last-n", "tokens seen by the penalties, default 64, 0 = all").set_default(64);
+    std::string &logitBias = kwarg("logit-bias", "token:bias,... added to the logits, -inf bans").set_default("");
     int &rngSeed = kwarg("s", "random seed, default time(NULL)").set_default(static_cast<unsigned int>(time(NULL)));
     int &steps = kwarg("n", "number of steps to run for, default 4096. 0 = infinite").set_default(4096);
     std::string &prompt = kwarg("i", "input prompt").set_default("");
     std::string &tokenizerPath = kwarg("z", "optional path to custom tokenizer").set_default("tokenizer.bin");
-    std::string &mode = kwarg("m", "mode: generate|chat, default: generate").set_default("generate");
+    bool &noTokenizerCache = flag("no-tokenizer-cache", "do not use or write the precompiled tokenizer cache");
+    std::string &mode = kwarg("m", "mode: generate|chat|server, default: generate").set_default("generate");
     std::string &systemPrompt = kwarg("y", "(optional) system prompt in chat mode").set_default("");
+    std::string &stop = kwarg("stop", "(optional) stop generating when the model outputs this string").set_default("");
+    std::string &listen =
+        kwarg("listen", "server address: host:port or unix:path, default 127.0.0.1:8080").set_default("127.0.0.1:8080");
+    int &maxSessions = kwarg("max-sessions", "sessions decoded together by the server, default 4").set_default(4);
+    int &prefixCache =
+        kwarg("prefix-cache", "MB of prompt prefix KV kept by the server for reuse, default 0 = off").set_default(0);
+    std::string &load = kwarg("l", "checkpoint loading: read|mmap|mmap-populate, default: read").set_default("read");
+    int &contextLength = kwarg("c", "context length, default 2048. 0 = the model's maximum").set_default(2048);
+    std::string &kvType = kwarg("k", "KV cache type: f32|f16|q8, default: f32").set_default("f32");
+    std::string &session =
+        kwarg("session", "(optional) session file to resume from, if it exists, and to save when done").set_default("");
+    std::string &sessionType =
+        kwarg("session-type", "KV type stored in the session: f32|f16|q8, default: the KV cache type").set_default("");
+    int &threads = kwarg("T", "number of threads, default 0 = all available CPUs").set_default(0);
+    bool &noPin = flag("no-pin", "do not pin the threads to CPUs");
+    bool &profile = flag("profile", "print the time spent in every op");
+    std::string &trace = kwarg("trace", "write a Chrome trace of the ops to this file").set_default("");
     bool &debug = flag("d", "debug");
 };
 
@@ -239,19 +470,120 @@ int main(int argc, char *argv[])
     if (args.debug)
         logger.setLevel(Logger::DEBUG);
 
+    CheckpointReader::Mode loadMode;
+    if (args.load == "read")
+        loadMode = CheckpointReader::READ;
+    else if (args.load == "mmap")
+        loadMode = CheckpointReader::MMAP;
+    else if (args.load == "mmap-populate")
+        loadMode = CheckpointReader::MMAP_POPULATE;
+    else
+    {
+        std::cerr << "unknown load mode: " << args.load << std::endl;
+        return 1;
+    }
+
+    KVCache::Type kvType, sessionType;
+    try
+    {
+        kvType = parse_kv_type(args.kvType);
+        sessionType = args.sessionType.empty() ? kvType : parse_kv_type(args.sessionType);
+    }
+    catch (std::exception const &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    SamplingParams sampling;
+    sampling.temperature = args.temperature;
+    sampling.topP = args.topP;
+    sampling.topK = args.topK;
+    sampling.minP = args.minP;
+    sampling.typicalP = args.typicalP;
+    sampling.repeatPenalty = args.repeatPenalty;
+    sampling.frequencyPenalty = args.frequencyPenalty;
+    sampling.presencePenalty = args.presencePenalty;
+    sampling.penaltyLastN = args.penaltyLastN;
+
+    if (args.temperature < 0.0f || args.topK < 0 || args.penaltyLastN < 0)
+    {
+        std::cerr << "invalid sampling parameters" << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        sampling.logitBias = parse_logit_bias(args.logitBias);
+    }
+    catch (std::exception const &)
+    {
+        std::cerr << "invalid logit bias: " << args.logitBias << std::endl;
+        return 1;
+    }
+
+    if (args.threads < 0)
+    {
+        std::cerr << "invalid number of threads: " << args.threads << std::endl;
+        return 1;
+    }
+    threadPool.resize(args.threads, !args.noPin);
+
+    if (args.profile || !args.trace.empty())
+        tracer.enable(!args.trace.empty());
+
     // build the Transformer via the model .bin file
-    Transformer transformer = build_transformer(args.checkpoint_path);
-    Tokenizer tokenizer(args.tokenizerPath, transformer.getConfig().vocabSize);
-    NucleusSampler sampler(transformer.getConfig().vocabSize, args.temperature, args.topP, args.rngSeed);
+    Transformer const transformer = build_transformer(args.checkpoint_path, loadMode, args.contextLength);
+    Tokenizer tokenizer =
+        build_tokenizer(args.tokenizerPath, transformer.getConfig().vocabSize, !args.noTokenizerCache);
+    SamplerChain sampler(transformer.getConfig().vocabSize, sampling, args.rngSeed);
+
+    std::vector<std::string> stopStrings;
+    if (!args.stop.empty())
+        stopStrings.push_back(args.stop);
 
     // run!
-    if (args.mode == "generate")
-        generate(transformer, tokenizer, sampler, args.prompt, args.steps);
-    else if (args.mode == "chat")
-        chat(transformer, tokenizer, sampler, args.systemPrompt, args.steps);
+    if (args.mode == "generate" || args.mode == "chat")
+    {
+        InferenceContext context(transformer.getConfig(), kvType);
+        std::vector<int> history = load_session(args.session, context, sampler);
+
+        if (args.mode == "generate")
+            generate(transformer, context, tokenizer, sampler, args.prompt, args.steps, stopStrings, history);
+        else
+            chat(transformer, context, tokenizer, sampler, args.systemPrompt, args.steps, stopStrings, history);
+
+        if (!args.session.empty())
+            context.sequence().save(args.session, history, sessionType);
+    }
+    else if (args.mode == "server")
+    {
+        Server::Options options;
+        options.address = args.listen;
+        options.maxSessions = std::max(0, args.maxSessions);
+        options.kvType = kvType;
+        options.prefixCacheBytes = static_cast<size_t>(std::max(0, args.prefixCache)) << 20;
+        options.sampling = sampling;
+        options.maxTokens = 0 < args.steps ? args.steps : 256;
+        options.stopStrings = stopStrings;
+
+        Server server(transformer, tokenizer, options);
+        server.run();
+    }
     else
         std::cerr << "unknown mode: " << args.mode << std::endl;
 
+    if (args.profile)
+        tracer.writeSummary(std::cout);
+
+    if (!args.trace.empty())
+    {
+        std::ofstream traceFile(args.trace);
+        tracer.writeChromeTrace(traceFile);
+        if (!traceFile)
+            std::cerr << "couldn't write the trace to " << args.trace << std::endl;
+    }
+
     return 0;
 }
 #endif
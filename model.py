@@ -23,6 +23,10 @@ class ModelArgs:
     norm_eps: float = 1e-5
     max_seq_len: int = 2048
     dropout: float = 0.0
+    # RoPE parameters written to the checkpoint header, None keeps the
+    # defaults of llama3.cpp (theta 500000, no frequency scaling)
+    rope_theta: Optional[float] = None
+    rope_scaling: Optional[dict] = None
 
 
 class RMSNorm(torch.nn.Module):
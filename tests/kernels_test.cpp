@@ -0,0 +1,211 @@
+#include <cmath>
+#include <initializer_list>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "ThreadPool.h"
+#include "kernels.h"
+
+// ----------------------------------------------------------------------------
+// Compares the SIMD matmul kernels with their plain C++ references. Every
+// case runs with the dispatch limited to each instruction set in turn, so all
+// kernels the CPU supports are checked, also the narrower ones on a wider CPU.
+// The rows have tails that do not fill a SIMD block or a block of rows.
+
+namespace
+{
+
+int failures = 0;
+
+Tensor randomTensor(size_t size, float scale, std::mt19937 &rng)
+{
+    std::uniform_real_distribution<float> uniform(-scale, scale);
+
+    Tensor t(size, true);
+    for (auto &v : t.f())
+        v = uniform(rng);
+
+    return t;
+}
+
+char const *name(kernels::InstructionSet set)
+{
+    switch (set)
+    {
+    case kernels::REFERENCE:
+        return "reference";
+    case kernels::AVX2:
+        return "avx2";
+    case kernels::AVX512:
+        return "avx512";
+    }
+
+    return "unknown";
+}
+
+// the largest difference to the reference, relative to its magnitude
+void expectClose(std::string const &what, FloatTensor const &out, FloatTensor const &reference, float tolerance)
+{
+    float worst = 0.0f;
+    for (size_t i = 0; i < reference.size(); i++)
+        worst = std::max(worst, std::abs(out[i] - reference[i]) / (1.0f + std::abs(reference[i])));
+
+    if (worst <= tolerance)
+        return;
+
+    std::cerr << "FAILED " << what << ": relative error " << worst << " above " << tolerance << std::endl;
+    failures++;
+}
+
+std::string caseName(char const *kernel, GroupSize groupSize, size_t n, size_t d, size_t nTokens)
+{
+    return std::string(kernel) + " gs=" + std::to_string(groupSize) + " n=" + std::to_string(n) +
+           " d=" + std::to_string(d) + " nTokens=" + std::to_string(nTokens);
+}
+
+// ----------------------------------------------------------------------------
+// int8 weights
+
+void testQuantized(kernels::InstructionSet set, std::mt19937 &rng)
+{
+    for (GroupSize groupSize : {32u, 64u})
+    {
+        // the VNNI kernel takes groups of 64, rows of 96 values only split
+        // into groups of 32, which go to the AVX2 one
+        for (size_t n : {96, 256})
+        {
+            if (0 != n % groupSize)
+                continue;
+
+            for (size_t nTokens : {1, 3})
+            {
+                size_t d = 13; // three blocks of rows and a single row
+
+                Tensor x = randomTensor(nTokens * n, 1.0f, rng);
+                Tensor w = randomTensor(d * n, 1.0f / std::sqrt(static_cast<float>(n)), rng);
+                auto xq = x.cq(groupSize);
+                auto wq = w.cq(groupSize);
+
+                FloatTensor out(nTokens * d);
+                FloatTensor reference(nTokens * d);
+                kernels::matmulQuantized(out, xq, wq, nTokens);
+                kernels::matmulQuantizedReference(reference, xq, wq, nTokens);
+
+                std::string what = std::string("matmulQuantized ") + name(set) + ": " +
+                                   caseName(kernels::matmulQuantizedKernel(groupSize), groupSize, n, d, nTokens);
+                std::cout << what << std::endl;
+                expectClose(what, out, reference, 1e-5f);
+            }
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+// 4-bit weights
+
+void testQ4(kernels::InstructionSet set, std::mt19937 &rng)
+{
+    for (bool withMin : {false, true})
+    {
+        for (GroupSize groupSize : {32u, 64u})
+        {
+            // the VNNI kernel takes rows of multiples of 64, rows of 96 values
+            // go to the AVX2 one
+            for (size_t n : {96, 256})
+            {
+                if (0 != n % groupSize)
+                    continue;
+
+                for (size_t nTokens : {1, 3})
+                {
+                    size_t d = 13;
+
+                    Tensor x = randomTensor(nTokens * n, 1.0f, rng);
+                    Tensor w = randomTensor(d * n, 1.0f / std::sqrt(static_cast<float>(n)), rng);
+                    auto xq = x.cq(groupSize);
+                    auto wq = w.cq4(groupSize, withMin);
+
+                    FloatTensor out(nTokens * d);
+                    FloatTensor reference(nTokens * d);
+                    kernels::matmulQ4(out, xq, wq, nTokens);
+                    kernels::matmulQ4Reference(reference, xq, wq, nTokens);
+
+                    std::string what = std::string(withMin ? "matmulQ4 with mins " : "matmulQ4 ") + name(set) +
+                                       ": " + caseName(kernels::matmulQ4Kernel(groupSize, n), groupSize, n, d, nTokens);
+                    std::cout << what << std::endl;
+                    expectClose(what, out, reference, 1e-5f);
+                }
+            }
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+// 16-bit float weights
+
+void testHalf(kernels::InstructionSet set, std::mt19937 &rng)
+{
+    for (bool bfloat16 : {false, true})
+    {
+        // n = 84 leaves a tail of 4 values behind the 16 values of an AVX-512
+        // step and behind the 8 values of an AVX2 one
+        for (size_t n : {84, 256})
+        {
+            for (size_t nTokens : {1, 3})
+            {
+                size_t d = 13;
+
+                Tensor x = randomTensor(nTokens * n, 1.0f, rng);
+                Tensor w = randomTensor(d * n, 1.0f / std::sqrt(static_cast<float>(n)), rng);
+                auto wh = w.ch(bfloat16);
+
+                FloatTensor out(nTokens * d);
+                FloatTensor reference(nTokens * d);
+                kernels::matmulFloat(out, x.cf(), wh, nTokens);
+                kernels::matmulFloatReference(reference, x.cf(), wh, nTokens);
+
+                std::string what = std::string(bfloat16 ? "matmulFloat bf16 " : "matmulFloat f16 ") + name(set) +
+                                   ": " + kernels::matmulHalfKernel(bfloat16) + " n=" + std::to_string(n) +
+                                   " d=" + std::to_string(d) + " nTokens=" + std::to_string(nTokens);
+                std::cout << what << std::endl;
+                expectClose(what, out, reference, 1e-5f);
+            }
+        }
+    }
+}
+
+} // namespace
+
+int main()
+{
+    threadPool.resize(0, false);
+    std::mt19937 rng(42);
+
+    for (auto set : {kernels::REFERENCE, kernels::AVX2, kernels::AVX512})
+    {
+        kernels::limitInstructionSet(set);
+
+        // the references have to be the ones selected without SIMD
+        if (kernels::REFERENCE == set && std::string("reference") != kernels::matmulQuantizedKernel(64))
+        {
+            std::cerr << "FAILED the dispatch is not limited to the reference kernels" << std::endl;
+            failures++;
+        }
+
+        testQuantized(set, rng);
+        testQ4(set, rng);
+        testHalf(set, rng);
+    }
+
+    kernels::limitInstructionSet(kernels::AVX512);
+
+    if (0 < failures)
+    {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+
+    std::cout << "all checks passed" << std::endl;
+    return 0;
+}
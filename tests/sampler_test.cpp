@@ -0,0 +1,173 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Sampler.h"
+
+// ----------------------------------------------------------------------------
+// Samples the top-p samplers with a fixed seed and compares the frequencies of
+// the tokens with an exact nucleus, computed in double by sorting the whole
+// vocabulary. The distributions are chosen so that the boundary of the nucleus
+// is far from p, where float and double could disagree.
+
+namespace
+{
+
+int failures = 0;
+
+constexpr size_t nSamples = 100000;
+
+// the total variation distance of two frequencies at nSamples stays below it
+// for the nuclei of up to ~100 tokens used here
+constexpr double tolerance = 0.03;
+
+// the distribution of top-p sampling after an optional top-k, tokens sorted by
+// decreasing probability with the lower token first among equal ones
+std::vector<double> referenceNucleus(std::vector<float> const &logits, float temperature, float topP,
+                                     size_t topK = 0)
+{
+    std::vector<uint32_t> order(logits.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(),
+              [&](uint32_t a, uint32_t b) { return logits[a] > logits[b] || (logits[a] == logits[b] && a < b); });
+    if (0 < topK && topK < order.size())
+        order.resize(topK);
+
+    double maxLogit = logits[order.front()];
+    std::vector<double> probs(logits.size(), 0.0);
+    double sum = 0.0;
+    for (auto token : order)
+        sum += probs[token] = std::exp((logits[token] - maxLogit) / temperature);
+
+    // the first tokens holding more than topP
+    double cumulativeProb = 0.0;
+    size_t size = 0;
+    while (size < order.size() && cumulativeProb <= topP * sum)
+        cumulativeProb += probs[order[size++]];
+
+    std::vector<double> nucleus(logits.size(), 0.0);
+    for (size_t i = 0; i < size; i++)
+        nucleus[order[i]] = probs[order[i]] / cumulativeProb;
+
+    return nucleus;
+}
+
+double totalVariation(Sampler &sampler, std::vector<float> const &logits, std::vector<double> const &expected)
+{
+    std::vector<size_t> counts(logits.size(), 0);
+    std::vector<float> copy(logits.size());
+    for (size_t i = 0; i < nSamples; i++)
+    {
+        // the samplers may modify the logits
+        std::copy(logits.begin(), logits.end(), copy.begin());
+        counts[sampler.sample(copy)]++;
+    }
+
+    double distance = 0.0;
+    for (size_t token = 0; token < logits.size(); token++)
+        distance += std::abs(static_cast<double>(counts[token]) / nSamples - expected[token]);
+
+    return distance / 2.0;
+}
+
+void expectNucleus(std::string const &what, Sampler &sampler, std::vector<float> const &logits,
+                   std::vector<double> const &expected)
+{
+    double distance = totalVariation(sampler, logits, expected);
+    std::cout << what << ": total variation " << distance << std::endl;
+
+    if (distance <= tolerance)
+        return;
+
+    std::cerr << "FAILED " << what << ": total variation " << distance << " above " << tolerance << std::endl;
+    failures++;
+}
+
+// ----------------------------------------------------------------------------
+// distributions
+
+// probabilities decreasing by a constant factor, the nucleus of p = 0.9 holds
+// 47 tokens with very different probabilities. Adding up the probability of
+// the first token instead of the current one made them about uniform, at a
+// total variation of 0.27.
+std::vector<float> geometric(size_t vocabSize, std::mt19937 &rng)
+{
+    std::vector<float> logits(vocabSize);
+    for (size_t i = 0; i < vocabSize; i++)
+        logits[i] = -0.05f * i;
+
+    std::shuffle(logits.begin(), logits.end(), rng);
+    return logits;
+}
+
+// 200 tokens of the same probability at random places, above 800 less likely
+// ones. The nucleus of p = 0.5 takes the 120 lowest of the tied tokens, it
+// depends on a strict order of equal probabilities, which the comparator >=
+// of the old std::sort was not.
+std::vector<float> ties(std::mt19937 &rng)
+{
+    std::vector<float> logits(1000, -3.0f);
+    std::fill(logits.begin(), logits.begin() + 200, 0.0f);
+
+    std::shuffle(logits.begin(), logits.end(), rng);
+    return logits;
+}
+
+// peaked like a language model: 40 likely tokens out of 32000
+std::vector<float> peaked(std::mt19937 &rng)
+{
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+
+    std::vector<float> logits(32000);
+    for (size_t i = 0; i < logits.size(); i++)
+        logits[i] = normal(rng) + (i < 40 ? 10.0f : 0.0f);
+
+    std::shuffle(logits.begin(), logits.end(), rng);
+    return logits;
+}
+
+} // namespace
+
+int main()
+{
+    std::mt19937 rng(42);
+
+    {
+        auto logits = geometric(512, rng);
+        NucleusSampler sampler(logits.size(), 1.0f, 0.9f, 1);
+        expectNucleus("top-p 0.9 geometric", sampler, logits, referenceNucleus(logits, 1.0f, 0.9f));
+    }
+
+    {
+        auto logits = ties(rng);
+        NucleusSampler sampler(logits.size(), 1.0f, 0.5f, 2);
+        expectNucleus("top-p 0.5 ties", sampler, logits, referenceNucleus(logits, 1.0f, 0.5f));
+    }
+
+    {
+        auto logits = peaked(rng);
+        NucleusSampler sampler(logits.size(), 0.7f, 0.9f, 3);
+        expectNucleus("top-p 0.9 temperature 0.7 peaked", sampler, logits, referenceNucleus(logits, 0.7f, 0.9f));
+    }
+
+    {
+        // after top-k the candidates are a list, which top-p weighs itself
+        auto logits = geometric(512, rng);
+        SamplerChain sampler(logits.size(), 4);
+        sampler.add(std::make_shared<TopK>(40)).add(std::make_shared<TopP>(0.8f));
+        expectNucleus("top-k 40 top-p 0.8 geometric", sampler, logits, referenceNucleus(logits, 1.0f, 0.8f, 40));
+    }
+
+    if (0 < failures)
+    {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+
+    std::cout << "all checks passed" << std::endl;
+    return 0;
+}